@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dssend.h"
+#include "dscrypto.h"
+#include "dsmisc.h"
+
+#define BENCH_SETUP     "SET dsbench 1" // nil answer would close the connection
+#define BENCH_COMMAND   "GET dsbench"
+#define BENCH_STATS     "dbsyncd:STATS"
+#define BENCH_TIMEOUT   5000 // ms for every command
+
+static int g_signed = DSSEND_UNSIGNED;
+
+
+// Reads counter of STATS answer, -1 when it is missing
+long long stats_counter(const char *stats, const char *name)
+{
+  const char *pos = stats;
+  int len = strlen(name);
+
+  while((pos = strstr(pos, name)))
+  {
+    if((pos == stats || pos[-1] == '\n') && pos[len] == ' ')
+      return atoll(pos + len + 1);
+    pos += len;
+  }
+
+  return -1;
+}
+
+
+// Asks daemon for main loop counters over new connection,
+// kept one would be closed by daemon while idle during the run
+int read_loop(void *ctx, char *engine, long long *calls, long long *commands)
+{
+  const char *res = NULL;
+  int res_size = 0;
+
+  dssend(ctx, g_signed, 0, DSSEND_ALL, 0, 0, BENCH_TIMEOUT, 0, BENCH_STATS, &res, &res_size);
+  if(!res)
+    return -1;
+
+  *calls = stats_counter(res, "loop.socket_calls");
+  *commands = stats_counter(res, "loop.commands");
+  if(*calls < 0 || *commands < 0)
+    return -1;
+
+  const char *pos = strstr(res, "loop.engine ");
+  if(pos)
+    sscanf(pos + strlen("loop.engine "), "%15s", engine); // engine is 16 bytes
+
+  return 0;
+}
+
+
+// Client connects, waits for start, sends its commands over kept connection
+// and holds the connection till the parent took the counters
+int run_client(const char *servers, int commands, int ready, int start, int done, int finish)
+{
+  const char *res = NULL;
+  int res_size = 0;
+  int failures = 0;
+  char c = 0;
+  int i;
+
+  void *ctx = dssend_init_ctx(servers);
+  if(!ctx)
+    return 1;
+
+  // connection is opened before counting starts
+  dssend(ctx, g_signed, 1, DSSEND_ALL, 0, 0, BENCH_TIMEOUT, 0, BENCH_SETUP, &res, &res_size);
+  if(!res)
+    failures++;
+
+  if(write(ready, &c, 1) != 1 || read(start, &c, 1) < 0)
+    return 1;
+
+  for(i = 0; i < commands; i++)
+  {
+    dssend(ctx, g_signed, 1, DSSEND_ALL, 0, 0, BENCH_TIMEOUT, 0, BENCH_COMMAND, &res, &res_size);
+    if(!res)
+      failures++;
+  }
+
+  c = failures ? 1 : 0;
+  if(write(done, &c, 1) != 1 || read(finish, &c, 1) < 0)
+    return 1;
+
+  dssend_release_ctx(ctx);
+  dssend_cleanup();
+  return failures ? 1 : 0;
+}
+
+
+// Usage ./dsbench [-s 127.0.0.1:1111] [-c clients] [-n commands_per_client] [-k private_key_path]
+int main(int argc, char *argv[])
+{
+  const char *servers = "127.0.0.1:1111";
+  int clients = 16;
+  int commands = 10000;
+  int ready[2], start[2], done[2], finish[2];
+  int i, c;
+
+  while((c = getopt(argc, argv, "s:c:n:k:")) != -1)
+  {
+    switch(c)
+    {
+      case 's':
+        servers = optarg;
+        break;
+      case 'c':
+        clients = atoi(optarg);
+        break;
+      case 'n':
+        commands = atoi(optarg);
+        break;
+      case 'k':
+        g_signed = DSSEND_SIGNED;
+        dscrypto_init();
+        if(!dscrypto_load_private(optarg))
+          dsdie("Cannot load private key %s", optarg);
+        break;
+    }
+  }
+
+  if(clients < 1 || commands < 1)
+    dsdie("Clients and commands should be positive");
+
+  if(pipe(ready) || pipe(start) || pipe(done) || pipe(finish))
+    dsdie("Cannot create pipes");
+
+  for(i = 0; i < clients; i++)
+  {
+    pid_t pid = fork();
+    if(pid < 0)
+      dsdie("Cannot start client %d", i);
+    if(!pid)
+    {
+      close(start[1]);
+      close(finish[1]);
+      exit(run_client(servers, commands, ready[1], start[0], done[1], finish[0]));
+    }
+  }
+  close(ready[1]);
+  close(start[0]);
+  close(done[1]);
+  close(finish[0]);
+
+  // all clients are connected and idle before the first counters
+  char buf;
+  for(i = 0; i < clients; i++)
+  {
+    if(read(ready[0], &buf, 1) != 1)
+      dsdie("Client exited before start");
+  }
+
+  void *ctx = dssend_init_ctx(servers);
+  if(!ctx)
+    dsdie("Bad server %s", servers);
+
+  char engine[16] = "unknown";
+  long long calls_before, commands_before, calls_after, commands_after;
+  if(read_loop(ctx, engine, &calls_before, &commands_before))
+    dsdie("No main loop counters from %s", servers);
+
+  long long start_us = dsclock_us();
+  close(start[1]);
+
+  int failed = 0;
+  for(i = 0; i < clients; i++)
+  {
+    if(read(done[0], &buf, 1) != 1)
+      dsdie("Client exited before end");
+    failed += buf;
+  }
+  long long elapsed_us = dsclock_us() - start_us;
+
+  if(read_loop(ctx, engine, &calls_after, &commands_after))
+    dsdie("No main loop counters from %s", servers);
+
+  close(finish[1]);
+  while(wait(NULL) > 0);
+
+  // the second STATS is counted as command too
+  long long counted = commands_after - commands_before - 1;
+  long long calls = calls_after - calls_before;
+  long long sent = (long long)clients * commands;
+
+  printf("engine %s, %d clients, %lld commands in %.2f s, %.0f commands/s\n", engine, clients, sent,
+         elapsed_us / 1000000.0, elapsed_us ? sent * 1000000.0 / elapsed_us : 0.0);
+  printf("socket calls %lld for %lld commands, %.2f per command, %d clients failed\n", calls, counted,
+         counted ? (double)calls / counted : 0.0, failed);
+
+  dssend_release_ctx(ctx);
+  dssend_cleanup();
+  return failed ? 1 : 0;
+}
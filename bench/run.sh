@@ -0,0 +1,38 @@
+#!/bin/sh
+# Compares socket calls per command of daemon main loop on poll and on io_uring
+# Usage ./run.sh [clients] [commands_per_client] [db_addresses]
+
+CLIENTS=${1:-16}
+COMMANDS=${2:-10000}
+DATABASES=${3:-redis:127.0.0.1:6379}
+PORT=${DSBENCH_PORT:-11111}
+DAEMON=${DSBENCH_DAEMON:-../daemon/dbsyncd}
+
+cd "$(dirname "$0")" || exit 1
+
+for ENGINE in "" "-i"; do
+  # sockets of stopped io_uring daemon are released a bit after its exit
+  TRIES=10
+  while :; do
+    $DAEMON -b 127.0.0.1 -p $PORT -d $DATABASES $ENGINE &
+    PID=$!
+    sleep 1
+    if kill -0 $PID 2>/dev/null; then
+      break
+    fi
+    TRIES=$((TRIES - 1))
+    if [ $TRIES -eq 0 ]; then
+      echo "Daemon $DAEMON cannot be started on port $PORT"
+      exit 1
+    fi
+  done
+
+  ./dsbench -s 127.0.0.1:$PORT -c $CLIENTS -n $COMMANDS
+  RC=$?
+
+  kill $PID
+  wait $PID 2>/dev/null
+  if [ $RC -ne 0 ]; then
+    exit $RC
+  fi
+done
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dsarena.h"
+#include "dsmisc.h"
+
+
+#define ALIGN_SIZE(size) (((size) + 15) & ~15)
+
+
+static PDSARENA_CHUNK _chunk_new(int size)
+{
+  PDSARENA_CHUNK chunk = (PDSARENA_CHUNK)malloc(sizeof(DSARENA_CHUNK) + size);
+  if(!chunk)
+  {
+    dslogerr(errno, "Cannot allocate arena chunk of size %d", size);
+    return NULL;
+  }
+
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->next = NULL;
+
+  return chunk;
+}
+
+
+static void _chunks_free(PDSARENA_CHUNK chunk)
+{
+  PDSARENA_CHUNK next;
+
+  while(chunk)
+  {
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+}
+
+
+PDSARENA dsarena_create(int chunk_size)
+{
+  PDSARENA arena = (PDSARENA)malloc(sizeof(DSARENA));
+  if(!arena)
+  {
+    dslogerr(errno, "Cannot allocate arena");
+    return NULL;
+  }
+
+  arena->chunk_size = chunk_size > 0 ? ALIGN_SIZE(chunk_size) : DSARENA_CHUNK_SIZE;
+  arena->total_size = 0;
+  arena->last = NULL;
+  arena->chunks = NULL; // first chunk is allocated on demand
+
+  return arena;
+}
+
+
+void dsarena_destroy(PDSARENA arena)
+{
+  if(!arena)
+    return;
+
+  _chunks_free(arena->chunks);
+  free(arena);
+}
+
+
+// Drop all allocations at once. When the last request spilled over several
+// chunks they are merged into single one of the high water size, so the next
+// request of the same shape is served without touching the allocator.
+void dsarena_reset(PDSARENA arena)
+{
+  if(!arena || !arena->chunks)
+    return;
+
+  if(arena->chunks->next)
+  {
+    int size = arena->total_size;
+    if(size > DSARENA_RETAIN_MAX)
+      size = DSARENA_RETAIN_MAX;
+    size = (size + arena->chunk_size - 1) / arena->chunk_size * arena->chunk_size;
+
+    dstrace("Arena merge chunks to size %d", size);
+
+    _chunks_free(arena->chunks);
+    arena->chunks = _chunk_new(size);
+  }
+  else if(arena->chunks->size > DSARENA_RETAIN_MAX)
+  {
+    _chunks_free(arena->chunks);
+    arena->chunks = NULL;
+  }
+  else
+  {
+    arena->chunks->used = 0;
+  }
+
+  arena->total_size = 0;
+  arena->last = NULL;
+}
+
+
+// Drop all allocations and give the memory back, used by idle owners
+void dsarena_release(PDSARENA arena)
+{
+  if(!arena)
+    return;
+
+  _chunks_free(arena->chunks);
+  arena->chunks = NULL;
+  arena->total_size = 0;
+  arena->last = NULL;
+}
+
+
+void* dsarena_alloc(PDSARENA arena, int size)
+{
+  PDSARENA_CHUNK chunk = arena->chunks;
+
+  size = ALIGN_SIZE(size > 0 ? size : 1);
+
+  if(!chunk || chunk->size - chunk->used < size)
+  {
+    chunk = _chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+    if(!chunk)
+      return NULL;
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+  }
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  arena->total_size += size;
+  arena->last = ptr;
+
+  return ptr;
+}
+
+
+void* dsarena_realloc(PDSARENA arena, void *ptr, int old_size, int size)
+{
+  if(!ptr)
+    return dsarena_alloc(arena, size);
+
+  // The latest allocation grows in place while the chunk has room
+  PDSARENA_CHUNK chunk = arena->chunks;
+  if(ptr == arena->last)
+  {
+    int offset = (unsigned char *)ptr - chunk->data;
+    int used = offset + ALIGN_SIZE(size > 0 ? size : 1);
+    if(used <= chunk->size)
+    {
+      arena->total_size += used - chunk->used;
+      chunk->used = used;
+      return ptr;
+    }
+  }
+
+  void *newptr = dsarena_alloc(arena, size);
+  if(newptr)
+    memcpy(newptr, ptr, old_size < size ? old_size : size);
+
+  return newptr;
+}
+
+
+char* dsarena_strdup(PDSARENA arena, const char *str)
+{
+  int size = strlen(str) + 1;
+
+  char *res = (char *)dsarena_alloc(arena, size);
+  if(res)
+    memcpy(res, str, size);
+
+  return res;
+}
@@ -0,0 +1,31 @@
+#ifndef __DSARENA_H__
+#define __DSARENA_H__
+
+#define DSARENA_CHUNK_SIZE  16384
+#define DSARENA_RETAIN_MAX  (64 * 1024)
+
+typedef struct _dsarena_chunk {
+  int size;
+  int used;
+  struct _dsarena_chunk *next;
+  unsigned char data[];
+
+} DSARENA_CHUNK, *PDSARENA_CHUNK;
+
+typedef struct _dsarena {
+  int chunk_size;
+  int total_size;   // bytes allocated since last reset
+  void *last;       // last allocation, may grow in place
+  PDSARENA_CHUNK chunks;
+
+} DSARENA, *PDSARENA;
+
+PDSARENA dsarena_create(int chunk_size);
+void     dsarena_destroy(PDSARENA arena);
+void     dsarena_reset(PDSARENA arena);
+void     dsarena_release(PDSARENA arena);
+void*    dsarena_alloc(PDSARENA arena, int size);
+void*    dsarena_realloc(PDSARENA arena, void *ptr, int old_size, int size);
+char*    dsarena_strdup(PDSARENA arena, const char *str);
+
+#endif /* __DSARENA_H__ */
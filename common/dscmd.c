@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "dscmd.h"
+#include "dsmisc.h"
+
+
+typedef struct _dscmd_info {
+  const char *name;
+  int cmdclass;
+
+} DSCMD_INFO, *PDSCMD_INFO;
+
+typedef struct _dscmd_keyspec {
+  const char *name;
+  int keys;
+  int first;   // argument index of the first key
+  int last;    // of the last key, negative counts from the end
+  int step;
+  int numkeys; // argument with number of keys following it, 0 when none
+
+} DSCMD_KEYSPEC, *PDSCMD_KEYSPEC;
+
+
+// Read-only Redis commands, sorted by name for binary search.
+// Anything not listed is treated as write and goes to every target.
+// Cursor and whole keyspace reads go to every target as well, cursor
+// of one database means nothing to another one.
+static const DSCMD_INFO g_commands[] = {
+  { "BITCOUNT",         DSCMD_READ },
+  { "BITPOS",           DSCMD_READ },
+  { "DBSIZE",           DSCMD_SCAN },
+  { "DUMP",             DSCMD_READ },
+  { "ECHO",             DSCMD_READ },
+  { "EXISTS",           DSCMD_READ },
+  { "GEODIST",          DSCMD_READ },
+  { "GEOHASH",          DSCMD_READ },
+  { "GEOPOS",           DSCMD_READ },
+  { "GET",              DSCMD_READ },
+  { "GETBIT",           DSCMD_READ },
+  { "GETRANGE",         DSCMD_READ },
+  { "HEXISTS",          DSCMD_READ },
+  { "HGET",             DSCMD_READ },
+  { "HGETALL",          DSCMD_READ },
+  { "HKEYS",            DSCMD_READ },
+  { "HLEN",             DSCMD_READ },
+  { "HMGET",            DSCMD_READ },
+  { "HSCAN",            DSCMD_SCAN },
+  { "HSTRLEN",          DSCMD_READ },
+  { "HVALS",            DSCMD_READ },
+  { "KEYS",             DSCMD_SCAN },
+  { "LINDEX",           DSCMD_READ },
+  { "LLEN",             DSCMD_READ },
+  { "LRANGE",           DSCMD_READ },
+  { "MGET",             DSCMD_READ },
+  { "PING",             DSCMD_READ },
+  { "PTTL",             DSCMD_READ },
+  { "RANDOMKEY",        DSCMD_SCAN },
+  { "SCAN",             DSCMD_SCAN },
+  { "SCARD",            DSCMD_READ },
+  { "SDIFF",            DSCMD_READ },
+  { "SINTER",           DSCMD_READ },
+  { "SISMEMBER",        DSCMD_READ },
+  { "SMEMBERS",         DSCMD_READ },
+  { "SSCAN",            DSCMD_SCAN },
+  { "STRLEN",           DSCMD_READ },
+  { "SUBSTR",           DSCMD_READ },
+  { "SUNION",           DSCMD_READ },
+  { "TTL",              DSCMD_READ },
+  { "TYPE",             DSCMD_READ },
+  { "XLEN",             DSCMD_READ },
+  { "XRANGE",           DSCMD_READ },
+  { "XREVRANGE",        DSCMD_READ },
+  { "ZCARD",            DSCMD_READ },
+  { "ZCOUNT",           DSCMD_READ },
+  { "ZLEXCOUNT",        DSCMD_READ },
+  { "ZRANGE",           DSCMD_READ },
+  { "ZRANGEBYLEX",      DSCMD_READ },
+  { "ZRANGEBYSCORE",    DSCMD_READ },
+  { "ZRANK",            DSCMD_READ },
+  { "ZREVRANGE",        DSCMD_READ },
+  { "ZREVRANGEBYLEX",   DSCMD_READ },
+  { "ZREVRANGEBYSCORE", DSCMD_READ },
+  { "ZREVRANK",         DSCMD_READ },
+  { "ZSCAN",            DSCMD_SCAN },
+  { "ZSCORE",           DSCMD_READ },
+};
+
+
+// Key positions of commands as COMMAND INFO of Redis tells them, sorted
+// by name. Keys of commands not listed are unknown, they cannot be placed
+// on shard or lane. Keys of commands with number of keys argument follow
+// it, SORT and GEORADIUS are left out for their STORE option.
+static const DSCMD_KEYSPEC g_keyspecs[] = {
+  { "APPEND",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "BGREWRITEAOF",         DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "BGSAVE",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "BITCOUNT",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "BITFIELD",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "BITFIELD_RO",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "BITOP",                DSCMD_KEY_MULTI,  2, -1, 1, 0 },
+  { "BITPOS",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "BLMOVE",               DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "BLMPOP",               DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "BLPOP",                DSCMD_KEY_MULTI,  1, -2, 1, 0 },
+  { "BRPOP",                DSCMD_KEY_MULTI,  1, -2, 1, 0 },
+  { "BRPOPLPUSH",           DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "BZMPOP",               DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "BZPOPMAX",             DSCMD_KEY_MULTI,  1, -2, 1, 0 },
+  { "BZPOPMIN",             DSCMD_KEY_MULTI,  1, -2, 1, 0 },
+  { "CLIENT",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "CLUSTER",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "COMMAND",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "CONFIG",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "COPY",                 DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "DBSIZE",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "DECR",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "DECRBY",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "DEL",                  DSCMD_KEY_COUNT,  1, -1, 1, 0 },
+  { "DUMP",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ECHO",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "EVAL",                 DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "EVAL_RO",              DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "EVALSHA",              DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "EVALSHA_RO",           DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "EXISTS",               DSCMD_KEY_COUNT,  1, -1, 1, 0 },
+  { "EXPIRE",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "EXPIREAT",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "EXPIRETIME",           DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "FCALL",                DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "FCALL_RO",             DSCMD_KEY_MULTI,  3,  0, 1, 2 },
+  { "FLUSHALL",             DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "FLUSHDB",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "FUNCTION",             DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "GEOADD",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEODIST",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEOHASH",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEOPOS",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEORADIUS_RO",         DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEORADIUSBYMEMBER_RO", DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEOSEARCH",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GEOSEARCHSTORE",       DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "GET",                  DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GETBIT",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GETDEL",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GETEX",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GETRANGE",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "GETSET",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HDEL",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HEXISTS",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HGET",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HGETALL",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HINCRBY",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HINCRBYFLOAT",         DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HKEYS",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HLEN",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HMGET",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HMSET",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HRANDFIELD",           DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HSCAN",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HSET",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HSETNX",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HSTRLEN",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "HVALS",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "INCR",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "INCRBY",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "INCRBYFLOAT",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "INFO",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "KEYS",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "LASTSAVE",             DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "LATENCY",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "LCS",                  DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "LINDEX",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LINSERT",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LLEN",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LMOVE",                DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "LMPOP",                DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "LOLWUT",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "LPOP",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LPOS",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LPUSH",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LPUSHX",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LRANGE",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LREM",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LSET",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "LTRIM",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "MEMORY",               DSCMD_KEY_SINGLE, 2,  2, 1, 0 },
+  { "MGET",                 DSCMD_KEY_ALL,    1, -1, 1, 0 },
+  { "MSET",                 DSCMD_KEY_PAIRS,  1, -1, 2, 0 },
+  { "MSETNX",               DSCMD_KEY_MULTI,  1, -1, 2, 0 },
+  { "OBJECT",               DSCMD_KEY_SINGLE, 2,  2, 1, 0 },
+  { "PERSIST",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PEXPIRE",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PEXPIREAT",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PEXPIRETIME",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PFADD",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PFCOUNT",              DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "PFMERGE",              DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "PING",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "PSETEX",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PTTL",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "PUBLISH",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "RANDOMKEY",            DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "RENAME",               DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "RENAMENX",             DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "RESTORE",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ROLE",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "RPOP",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "RPOPLPUSH",            DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "RPUSH",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "RPUSHX",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SADD",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SAVE",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "SCAN",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "SCARD",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SCRIPT",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "SDIFF",                DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SDIFFSTORE",           DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SELECT",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "SET",                  DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SETBIT",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SETEX",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SETNX",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SETRANGE",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SINTER",               DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SINTERCARD",           DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "SINTERSTORE",          DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SISMEMBER",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SLOWLOG",              DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "SMEMBERS",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SMISMEMBER",           DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SMOVE",                DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "SPOP",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SRANDMEMBER",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SREM",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SSCAN",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "STRLEN",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SUBSTR",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "SUNION",               DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SUNIONSTORE",          DSCMD_KEY_MULTI,  1, -1, 1, 0 },
+  { "SWAPDB",               DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "TIME",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "TOUCH",                DSCMD_KEY_COUNT,  1, -1, 1, 0 },
+  { "TTL",                  DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "TYPE",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "UNLINK",               DSCMD_KEY_COUNT,  1, -1, 1, 0 },
+  { "WAIT",                 DSCMD_KEY_NONE,   0,  0, 1, 0 },
+  { "XACK",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XADD",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XAUTOCLAIM",           DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XCLAIM",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XDEL",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XGROUP",               DSCMD_KEY_SINGLE, 2,  2, 1, 0 },
+  { "XINFO",                DSCMD_KEY_SINGLE, 2,  2, 1, 0 },
+  { "XLEN",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XPENDING",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XRANGE",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XREVRANGE",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XSETID",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "XTRIM",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZADD",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZCARD",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZCOUNT",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZDIFF",                DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "ZDIFFSTORE",           DSCMD_KEY_MULTI,  1,  0, 1, 2 },
+  { "ZINCRBY",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZINTER",               DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "ZINTERCARD",           DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "ZINTERSTORE",          DSCMD_KEY_MULTI,  1,  0, 1, 2 },
+  { "ZLEXCOUNT",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZMPOP",                DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "ZMSCORE",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZPOPMAX",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZPOPMIN",              DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZRANDMEMBER",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZRANGE",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZRANGEBYLEX",          DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZRANGEBYSCORE",        DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZRANGESTORE",          DSCMD_KEY_MULTI,  1,  2, 1, 0 },
+  { "ZRANK",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREM",                 DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREMRANGEBYLEX",       DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREMRANGEBYRANK",      DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREMRANGEBYSCORE",     DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREVRANGE",            DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREVRANGEBYLEX",       DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREVRANGEBYSCORE",     DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZREVRANK",             DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZSCAN",                DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZSCORE",               DSCMD_KEY_SINGLE, 1,  1, 1, 0 },
+  { "ZUNION",               DSCMD_KEY_MULTI,  2,  0, 1, 1 },
+  { "ZUNIONSTORE",          DSCMD_KEY_MULTI,  1,  0, 1, 2 },
+};
+
+
+static int _compare(const void *name, const void *info)
+{
+  return strcasecmp((const char *)name, ((PDSCMD_INFO)info)->name);
+}
+
+
+static int _compare_keyspec(const void *name, const void *keyspec)
+{
+  return strcasecmp((const char *)name, ((PDSCMD_KEYSPEC)keyspec)->name);
+}
+
+
+// Copies the first word of command, false when it is too long
+static int _name(const char *cmd, char *name, int name_size)
+{
+  int i = 0;
+
+  while(isspace((unsigned char)*cmd))
+    cmd++;
+
+  while(cmd[i] && !isspace((unsigned char)cmd[i]))
+  {
+    if(i >= name_size - 1)
+      return 0;
+    name[i] = cmd[i];
+    i++;
+  }
+  name[i] = 0;
+
+  return 1;
+}
+
+
+// Command is classified by its first word, case insensitive
+int dscmd_class(const char *cmd)
+{
+  char name[32];
+
+  if(!_name(cmd, name, sizeof(name)))
+    return DSCMD_WRITE;
+
+  PDSCMD_INFO info = bsearch(name, g_commands, sizeof(g_commands) / sizeof(g_commands[0]), sizeof(g_commands[0]), _compare);
+  if(!info)
+    return DSCMD_WRITE;
+
+  dstrace("Command %s is classified as %s", name, info->cmdclass == DSCMD_READ ? "read" : info->cmdclass == DSCMD_SCAN ? "scan" : "write");
+
+  return info->cmdclass;
+}
+
+
+static PDSCMD_KEYSPEC _keyspec(const char *cmd)
+{
+  char name[32];
+
+  if(!_name(cmd, name, sizeof(name)))
+    return NULL;
+
+  return bsearch(name, g_keyspecs, sizeof(g_keyspecs) / sizeof(g_keyspecs[0]), sizeof(g_keyspecs[0]), _compare_keyspec);
+}
+
+
+// Tells how keys of the command are placed, DSCMD_KEY_UNKNOWN when not known
+int dscmd_keys(const char *cmd)
+{
+  PDSCMD_KEYSPEC keyspec = _keyspec(cmd);
+
+  return keyspec ? keyspec->keys : DSCMD_KEY_UNKNOWN;
+}
+
+
+// Keyless read of the whole keyspace run on every part of it has answers
+// merged, DSCMD_KEY_COUNT sums them and DSCMD_KEY_ALL joins them. Answer
+// of one part which cannot be merged is DSCMD_KEY_UNKNOWN, answer of other
+// commands is DSCMD_KEY_NONE.
+int dscmd_keyspace(const char *cmd)
+{
+  char name[32];
+
+  if(dscmd_class(cmd) != DSCMD_SCAN || !_name(cmd, name, sizeof(name)))
+    return DSCMD_KEY_NONE;
+
+  if(!strcasecmp(name, "DBSIZE"))
+    return DSCMD_KEY_COUNT;
+  if(!strcasecmp(name, "KEYS"))
+    return DSCMD_KEY_ALL;
+
+  return DSCMD_KEY_UNKNOWN;
+}
+
+
+// Prepares walk over keys of the command, unknown command has no keys
+int dscmd_keys_begin(const char *cmd, PDSCMD_KEYITER iter)
+{
+  PDSCMD_KEYSPEC keyspec = _keyspec(cmd);
+  const char *arg;
+  int arg_len;
+
+  memset(iter, 0, sizeof(DSCMD_KEYITER));
+  iter->pos = cmd;
+  iter->arg = -1;
+
+  if(!keyspec)
+    return DSCMD_KEY_UNKNOWN;
+
+  iter->next = keyspec->first;
+  iter->step = keyspec->step;
+
+  if(keyspec->numkeys)
+  {
+    iter->skip = keyspec->numkeys;
+    if(!dscmd_arg(cmd, keyspec->numkeys, &arg, &arg_len))
+      iter->last = keyspec->numkeys + atoi(arg);
+  }
+  else if(keyspec->last < 0)
+  {
+    const char *pos = cmd;
+    int args = 0;
+    while(!dscmd_arg(pos, 0, &arg, &arg_len))
+    {
+      pos = arg + arg_len;
+      args++;
+    }
+    iter->last = args + keyspec->last;
+  }
+  else
+    iter->last = keyspec->last;
+
+  return keyspec->keys;
+}
+
+
+int dscmd_keys_next(PDSCMD_KEYITER iter, const char **key, int *key_len)
+{
+  if(iter->next == iter->skip)
+    iter->next++;
+
+  if(iter->next < 1 || iter->next > iter->last)
+    return -1;
+
+  while(iter->arg < iter->next)
+  {
+    if(dscmd_arg(iter->pos, 0, key, key_len))
+      return -1;
+
+    iter->pos = *key + *key_len;
+    iter->arg++;
+  }
+
+  iter->next += iter->step;
+
+  return 0;
+}
+
+
+// Only part of key inside {} is used for placement when present,
+// keys sharing it are kept together
+void dscmd_keytag(const char **key, int *key_len)
+{
+  const char *open = memchr(*key, '{', *key_len);
+  if(!open)
+    return;
+
+  const char *close = memchr(open + 1, '}', *key + *key_len - open - 1);
+  if(close && close > open + 1)
+  {
+    *key = open + 1;
+    *key_len = close - open - 1;
+  }
+}
+
+
+// Finds argument by index, command name is argument 0.
+// Arguments are separated by spaces the same way hiredis splits the command.
+int dscmd_arg(const char *cmd, int index, const char **arg, int *arg_len)
+{
+  int i;
+
+  for(i = 0; ; i++)
+  {
+    while(*cmd == ' ')
+      cmd++;
+
+    if(!*cmd)
+      return -1;
+
+    const char *end = strchr(cmd, ' ');
+    if(!end)
+      end = cmd + strlen(cmd);
+
+    if(i == index)
+    {
+      *arg = cmd;
+      *arg_len = end - cmd;
+      return 0;
+    }
+
+    cmd = end;
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef __DSCMD_H__
+#define __DSCMD_H__
+
+#define DSCMD_WRITE 0
+#define DSCMD_READ  1
+#define DSCMD_SCAN  2 // read of cursor or whole keyspace, answer holds for one database only
+
+#define DSCMD_KEY_UNKNOWN -1 // command is not in key table, its keys are unknown
+#define DSCMD_KEY_NONE     0 // no key, command goes to every shard
+#define DSCMD_KEY_SINGLE   1 // single key
+#define DSCMD_KEY_ALL      2 // every argument is key, array answers are merged
+#define DSCMD_KEY_COUNT    3 // every argument is key, integer answers are summed
+#define DSCMD_KEY_PAIRS    4 // key value pairs, status answers
+#define DSCMD_KEY_MULTI    5 // several keys, command cannot be split
+
+// Walks keys of command, see dscmd_keys_begin
+typedef struct _dscmd_keyiter {
+  const char *pos; // past argument of index arg
+  int arg;
+  int next;        // index of the next key
+  int last;        // index of the last key
+  int step;
+  int skip;        // index of argument with number of keys
+
+} DSCMD_KEYITER, *PDSCMD_KEYITER;
+
+int dscmd_class(const char *cmd);
+int dscmd_keys(const char *cmd);
+int dscmd_keyspace(const char *cmd);
+int dscmd_keys_begin(const char *cmd, PDSCMD_KEYITER iter);
+int dscmd_keys_next(PDSCMD_KEYITER iter, const char **key, int *key_len);
+void dscmd_keytag(const char **key, int *key_len);
+int dscmd_arg(const char *cmd, int index, const char **arg, int *arg_len);
+
+#endif /* __DSCMD_H__ */
@@ -254,3 +254,100 @@ int dscrypto_signature(void *key, const void *data, int data_size, void **signat
 
   return ret;
 }
+
+
+// Maximum signature size for the key, to reserve space in caller buffer
+int dscrypto_signature_size(void *key)
+{
+  EVP_PKEY *pkey = key;
+
+  if(!pkey)
+    pkey = g_private;
+
+  if(!pkey)
+  {
+    dslog("Have no private key to get signature size");
+    return -1;
+  }
+
+  return EVP_PKEY_size(pkey);
+}
+
+
+// Uses private key, signature is written to caller buffer of *signature_size capacity
+int dscrypto_signature_buf(void *key, const void *data, int data_size, void *signature_buf, int *signature_size)
+{
+  int rc, ret = 0;
+  EVP_PKEY *pkey = key;
+
+  if(!pkey)
+    pkey = g_private;
+
+  if(!pkey)
+  {
+    dslog("Have no private key to build signature");
+    return -1;
+  }
+
+  EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+  if(!mdctx)
+  {
+    dslog("Cannot create digest context");
+    return -1;
+  }
+
+  rc = EVP_DigestSignInit(mdctx, NULL, EVP_sha256(), NULL, pkey);
+  if(rc != 1)
+  {
+    dslog("Cannot initialise SHA-256 signing");
+    ret = -1;
+  }
+
+  if(!ret)
+  {
+    rc = EVP_DigestSignUpdate(mdctx, data, data_size);
+    if(rc != 1)
+    {
+      dslog("Failed to sign the data");
+      ret = -1;
+    }
+  }
+
+  if(!ret)
+  {
+    size_t _signature_size = *signature_size;
+    rc = EVP_DigestSignFinal(mdctx, signature_buf, &_signature_size);
+    if(rc != 1)
+    {
+      dslog("Cannot obtain signature");
+      ret = -1;
+    }
+    else
+      *signature_size = _signature_size;
+  }
+
+  EVP_MD_CTX_destroy(mdctx);
+
+  dstrace("Built signature of size %d for %d size message", *signature_size, data_size);
+
+  return ret;
+}
+
+
+// SHA-256 of data as hex string, buffer takes DSCRYPTO_DIGEST_SIZE
+int dscrypto_digest(const void *data, int data_size, char *digest)
+{
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_size = 0;
+
+  if(EVP_Digest(data, data_size, md, &md_size, EVP_sha256(), NULL) != 1)
+  {
+    dslog("Cannot calculate SHA-256 digest");
+    return -1;
+  }
+
+  for(unsigned int i = 0; i < md_size; i++)
+    sprintf(digest + i * 2, "%02x", md[i]);
+
+  return 0;
+}
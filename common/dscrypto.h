@@ -1,6 +1,8 @@
 #ifndef __DSCRYPTO_H__
 #define __DSCRYPTO_H__
 
+#define DSCRYPTO_DIGEST_SIZE 65 // hex SHA-256 with trailing 0
+
 void  dscrypto_init(void);
 void  dscrypto_cleanup(void);
 void* dscrypto_load_public(const char *path);
@@ -8,5 +10,8 @@ void* dscrypto_load_private(const char *path);
 void  dscrypto_keyfree(void *key);
 int   dscrypto_verify(void *key, const void *data, int data_size, void *signature_buf, int signature_size);
 int   dscrypto_signature(void *key, const void *data, int data_size, void **signature_buf, int *signature_size);
+int   dscrypto_signature_size(void *key);
+int   dscrypto_signature_buf(void *key, const void *data, int data_size, void *signature_buf, int *signature_size);
+int   dscrypto_digest(const void *data, int data_size, char *digest);
 
 #endif /* __DSCRYPTO_H__ */
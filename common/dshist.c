@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dshist.h"
+
+
+
+// Log-linear buckets as HDR histograms have: values below 64 get a bucket
+// each, every next power of 2 is split into 32 equal buckets.
+
+
+#define SUB_SIZE (1 << DSHIST_SUB_BITS)
+
+
+
+int dshist_bucket(long long value)
+{
+  if(value < 0)
+    value = 0;
+  if(value >= 1LL << DSHIST_VALUE_BITS)
+    value = (1LL << DSHIST_VALUE_BITS) - 1;
+  if(value < SUB_SIZE * 2)
+    return value;
+
+  int shift = 63 - __builtin_clzll(value) - DSHIST_SUB_BITS;
+  return shift * SUB_SIZE + (value >> shift);
+}
+
+
+// The highest value counted in bucket
+long long dshist_value(int bucket)
+{
+  if(bucket < SUB_SIZE * 2)
+    return bucket;
+
+  int shift = bucket / SUB_SIZE - 1;
+  long long sub = bucket - shift * SUB_SIZE;
+  return ((sub + 1) << shift) - 1;
+}
+
+
+// Bound of bucket is reported, but never above the longest value seen
+long long dshist_quantile(const long long *buckets, long long count, long long max, int permille)
+{
+  long long rank = (count * permille + 999) / 1000;
+  long long seen = 0;
+  int i;
+
+  if(!count)
+    return 0;
+
+  for(i = 0; i < DSHIST_BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if(seen >= rank)
+      break;
+  }
+
+  long long value = dshist_value(i < DSHIST_BUCKETS ? i : DSHIST_BUCKETS - 1);
+  return value < max ? value : max;
+}
+
+
+void dshist_add(PDSHIST hist, long long value)
+{
+  hist->buckets[dshist_bucket(value)]++;
+  hist->count++;
+  if(value > hist->max)
+    hist->max = value;
+}
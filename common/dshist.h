@@ -0,0 +1,21 @@
+#ifndef __DSHIST_H__
+#define __DSHIST_H__
+
+#define DSHIST_SUB_BITS   5   // each power of 2 is split into 32 buckets, 3% precision
+#define DSHIST_VALUE_BITS 32  // longer values are counted as the longest one
+#define DSHIST_BUCKETS    ((DSHIST_VALUE_BITS - DSHIST_SUB_BITS + 1) << DSHIST_SUB_BITS)
+
+// Histogram of single writer
+typedef struct _dshist {
+  long long count;
+  long long max;
+  long long buckets[DSHIST_BUCKETS];
+
+} DSHIST, *PDSHIST;
+
+int       dshist_bucket(long long value);
+long long dshist_value(int bucket);
+long long dshist_quantile(const long long *buckets, long long count, long long max, int permille);
+void      dshist_add(PDSHIST hist, long long value);
+
+#endif /* __DSHIST_H__ */
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "dsmisc.h"
 
@@ -119,38 +120,64 @@ void dslogwerr(int err, const char *msg, ...)
 }
 
 
+// monotonic clock in microseconds, for latency measurements
+long long dsclock_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// FNV-1a
+unsigned long long dshash(const void *data, int size)
+{
+  const unsigned char *ptr = data;
+  unsigned long long hash = 14695981039346656037ULL;
+
+  while(size-- > 0)
+  {
+    hash ^= *ptr++;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+
+// Message is formatted once, arguments cannot be passed on to dslog
 void dsdie(const char *msg, ...)
 {
+  char text[512];
   va_list aptr;
-  
-  fprintf(stderr, "ERROR: ");
-  
+
   va_start(aptr, msg);
-  vfprintf(stderr, msg, aptr);
-  fprintf(stderr, "\n");
-  dslog(msg, aptr);
+  vsnprintf(text, sizeof(text), msg, aptr);
   va_end(aptr);
 
+  fprintf(stderr, "ERROR: %s\n", text);
+  dslog("%s", text);
+
   exit(1);
 }
 
 void dsdierr(int err, const char *msg, ...)
 {
   char buf[256];
-
-  if(!strerror_r(err, buf, sizeof(buf)))
-    fprintf(stderr, "ERROR: (%s) ", buf);
-  else
-    fprintf(stderr, "ERROR: ");
-
+  char text[512];
   va_list aptr;
-  
+
   va_start(aptr, msg);
-  vfprintf(stderr, msg, aptr);
-  dslogerr(err, msg, aptr);
+  vsnprintf(text, sizeof(text), msg, aptr);
   va_end(aptr);
 
-  fprintf(stderr, "\n");
+  if(!strerror_r(err, buf, sizeof(buf)))
+    fprintf(stderr, "ERROR: (%s) %s\n", buf, text);
+  else
+    fprintf(stderr, "ERROR: %s\n", text);
+  dslogerr(err, "%s", text);
 
   exit(1);
 }
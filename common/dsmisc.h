@@ -8,6 +8,9 @@ void dslogerr(int err, const char *msg, ...);
 void dslogw(const char *msg, ...);
 void dslogwerr(int err, const char *msg, ...);
 
+long long dsclock_us(void);
+unsigned long long dshash(const void *data, int size);
+
 #ifdef DSDEBUG
 void dstrace(const char *msg, ...);
 void dstracerr(int err, const char *msg, ...);
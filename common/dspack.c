@@ -4,18 +4,23 @@
 #include <errno.h>
 
 #include "dspack.h"
+#include "dsarena.h"
 #include "dscrypto.h"
+#include "dszip.h"
 #include "dsmisc.h"
 
 
-static int _pack(const char *tag, const void *data, int data_size, void **res, int *res_size)
+#define CHUNK_TAG_SIZE 16 // tag of chunk looked up by tag is shorter
+
+
+static int _pack(PDSARENA arena, const char *tag, const void *data, int data_size, void **res, int *res_size)
 {
   char lenbuf[16];
   snprintf(lenbuf, sizeof(lenbuf), "%d", data_size);
   
   *res_size = data_size + strlen(tag) + strlen(lenbuf) + 2;
 
-  char *buf = (char *)malloc(*res_size);
+  char *buf = arena ? (char *)dsarena_alloc(arena, *res_size) : (char *)malloc(*res_size);
   if(!buf)
   {
     dslogerr(errno, "Cannot allocate pack buffer");
@@ -164,13 +169,13 @@ int dspack_complete(const char *tag, const void *data, int data_size)
 }
 
 
-int dspack(const char *tag, const void *data, int data_size, void **res, int *res_size, int options)
+int dspack_arena(PDSARENA arena, const char *tag, const void *data, int data_size, void **res, int *res_size, int options)
 {
   int rc;
 
   void *pkt = NULL;
   int pkt_size = 0;
-  rc = _pack(tag, data, data_size, &pkt, &pkt_size);
+  rc = _pack(arena, tag, data, data_size, &pkt, &pkt_size);
   if(rc)
   {
     dstrace("Error: Packing failed");
@@ -205,14 +210,15 @@ int dspack(const char *tag, const void *data, int data_size, void **res, int *re
         memcpy(pkt_signed, pkt, pkt_size);
         memcpy(pkt_signed + pkt_size, signature, signature_size);
 
-        rc = _pack(tag, pkt_signed, pkt_signed_size, res, res_size);
+        rc = _pack(arena, tag, pkt_signed, pkt_signed_size, res, res_size);
 
         free(pkt_signed);
       }
       free(signature);
     }
 
-    free(pkt);
+    if(!arena)
+      free(pkt);
   }
 
   if(rc)
@@ -226,6 +232,96 @@ int dspack(const char *tag, const void *data, int data_size, void **res, int *re
 }
 
 
+static int _buf_reserve(void **buf, int *buf_size, int size)
+{
+  if(*buf_size >= size)
+    return 0;
+
+  int new_size = *buf_size ? *buf_size : 256;
+  while(new_size < size)
+    new_size *= 2;
+
+  void *new_buf = realloc(*buf, new_size);
+  if(!new_buf)
+  {
+    dslogerr(errno, "Cannot grow pack buffer to %d", new_size);
+    return -1;
+  }
+
+  *buf = new_buf;
+  *buf_size = new_size;
+
+  return 0;
+}
+
+
+static int _header(const char *tag, int data_size, char *hdr)
+{
+  return sprintf(hdr, "%s:%d:", tag, data_size);
+}
+
+
+// Packs into caller owned buffer which grows geometrically and is kept
+// between calls. *res points inside of *buf.
+int dspack_buf(const char *tag, const void *data, int data_size, void **buf, int *buf_size, void **res, int *res_size, int options)
+{
+  char hdr[64];
+  int hdr_size, inner_size;
+  int hdr_max = strlen(tag) + 12; // tag, colons and up to 10 digits of size
+
+  if(strlen(tag) > sizeof(hdr) - 13)
+  {
+    dslog("Error: Pack tag is too long");
+    return -1;
+  }
+
+  int signature_max = 0;
+  if(options & DSPACK_SIGNED)
+  {
+    signature_max = dscrypto_signature_size(NULL);
+    if(signature_max < 0)
+      return -1;
+  }
+
+  if(_buf_reserve(buf, buf_size, hdr_max * 2 + data_size + signature_max))
+    return -1;
+
+  // Inner packet is built after space reserved for the outer header
+  unsigned char *inner = (unsigned char *)*buf + ((options & DSPACK_SIGNED) ? hdr_max : 0);
+  hdr_size = _header(tag, data_size, hdr);
+  memcpy(inner, hdr, hdr_size);
+  memcpy(inner + hdr_size, data, data_size);
+  inner_size = hdr_size + data_size;
+
+  *res = inner;
+  *res_size = inner_size;
+
+  if(options & DSPACK_SIGNED)
+  {
+    int signature_size = signature_max;
+    if(dscrypto_signature_buf(NULL, data, data_size, inner + inner_size, &signature_size))
+    {
+      dslog("Error: Packing failed");
+      return -1;
+    }
+
+    hdr_size = _header(tag, inner_size + signature_size, hdr);
+    memcpy(inner - hdr_size, hdr, hdr_size);
+
+    *res = inner - hdr_size;
+    *res_size = hdr_size + inner_size + signature_size;
+  }
+
+  return 0;
+}
+
+
+int dspack(const char *tag, const void *data, int data_size, void **res, int *res_size, int options)
+{
+  return dspack_arena(NULL, tag, data, data_size, res, res_size, options);
+}
+
+
 int dsunpack(const char *tag, const void *data, int data_size, const void **res, int *res_size, int options)
 {
   int rc;
@@ -273,3 +369,214 @@ int dsunpack(const char *tag, const void *data, int data_size, const void **res,
   
   return rc;
 }
+
+
+// Signed packet wraps the inner one followed by signature
+int dspack_signed(const char *tag, const void *data, int data_size)
+{
+  const void *inner = NULL, *buf = NULL;
+  int inner_size = 0, buf_size = 0;
+
+  if(_unpack(tag, data, data_size, &inner, &inner_size) != data_size)
+    return 0;
+
+  int tag_size = strlen(tag);
+  if(inner_size <= tag_size || memcmp(inner, tag, tag_size) || ((const char *)inner)[tag_size] != ':')
+    return 0;
+
+  int offset = _unpack(tag, inner, inner_size, &buf, &buf_size);
+
+  return offset > 0 && offset < inner_size;
+}
+
+
+// Time left for the call follows trailing zero of command as
+// "tm:<size>:<ms>\0", so the message still ends with zero for daemon not
+// knowing about it. Other fields such as priority are added the same way.
+// Time is relative, clocks of driver and daemon hosts may differ.
+int dspack_timeout(long long timeout_ms, char *buf, int buf_size)
+{
+  char value[24];
+  int value_size = snprintf(value, sizeof(value), "%lld", timeout_ms) + 1;
+
+  int size = snprintf(buf, buf_size, "tm:%d:%s", value_size, value) + 1;
+  if(size > buf_size)
+  {
+    dslog("Error: Timeout buffer is too small");
+    return -1;
+  }
+
+  return size;
+}
+
+
+// Chunks with text values follow one by one from offset, the chunk is
+// found by its tag
+static int _unpack_chunk(const char *tag, const void *data, int offset, int data_size, const void **value, int *value_size)
+{
+  while(offset < data_size)
+  {
+    const char *chunk = (const char *)data + offset;
+    const char *colon = memchr(chunk, ':', data_size - offset < CHUNK_TAG_SIZE ? data_size - offset : CHUNK_TAG_SIZE);
+
+    int size = -1;
+    if(colon)
+    {
+      char chunk_tag[CHUNK_TAG_SIZE];
+      memcpy(chunk_tag, chunk, colon - chunk);
+      chunk_tag[colon - chunk] = 0;
+      size = _unpack(chunk_tag, chunk, data_size - offset, value, value_size);
+    }
+
+    if(size <= 0)
+    {
+      dslogw("Bad chunk format");
+      return -1;
+    }
+
+    if(!strncmp(chunk, tag, colon - chunk) && !tag[colon - chunk])
+    {
+      if(*value_size < 2 || ((const char *)*value)[*value_size - 1])
+      {
+        dslogw("Bad %s value format", tag);
+        return -1;
+      }
+
+      return 0;
+    }
+
+    offset += size;
+  }
+
+  return -1;
+}
+
+
+// Fields follow trailing zero of command
+static int _unpack_field(const char *tag, const void *data, int data_size, const void **value, int *value_size)
+{
+  return _unpack_chunk(tag, data, strnlen((const char *)data, data_size) + 1, data_size, value, value_size);
+}
+
+
+int dspack_priority(int priority, char *buf, int buf_size)
+{
+  int size = snprintf(buf, buf_size, "pr:2:%d", priority) + 1;
+  if(priority < 0 || priority >= DSPRIO_CLASSES || size > buf_size)
+  {
+    dslog("Error: Bad priority %d", priority);
+    return -1;
+  }
+
+  return size;
+}
+
+
+// Field asks daemon to answer with digest of its answer only
+int dspack_digest_only(char *buf, int buf_size)
+{
+  int size = snprintf(buf, buf_size, "dg:2:1") + 1;
+  if(size > buf_size)
+  {
+    dslog("Error: No room for digest field");
+    return -1;
+  }
+
+  return size;
+}
+
+
+// Field offers compression, driver takes compressed answers and daemon
+// knowing the method answers in compressed frames
+int dspack_accept_zip(char *buf, int buf_size)
+{
+  int size = snprintf(buf, buf_size, "zc:%d:%s", (int)sizeof(DSZIP_METHOD), DSZIP_METHOD) + 1;
+  if(size > buf_size)
+  {
+    dslog("Error: No room for compression field");
+    return -1;
+  }
+
+  return size;
+}
+
+
+// Time left for the call in milliseconds, 0 when message has none
+long long dsunpack_timeout(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  if(_unpack_field("tm", data, data_size, &value, &value_size))
+    return 0;
+
+  return atoll((const char *)value);
+}
+
+
+int dsunpack_digest_only(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  return !_unpack_field("dg", data, data_size, &value, &value_size);
+}
+
+
+int dsunpack_accept_zip(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  if(_unpack_field("zc", data, data_size, &value, &value_size))
+    return 0;
+
+  return !strcmp((const char *)value, DSZIP_METHOD);
+}
+
+
+// Interactive class when message has none
+int dsunpack_priority(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  if(_unpack_field("pr", data, data_size, &value, &value_size))
+    return DSPRIO_INTERACTIVE;
+
+  int priority = atoi((const char *)value);
+  if(priority < 0 || priority >= DSPRIO_CLASSES)
+  {
+    dslogw("Bad priority %d", priority);
+    return DSPRIO_INTERACTIVE;
+  }
+
+  return priority;
+}
+
+
+// Verdict of daemon comparing answers of its databases, NULL when
+// answer has none
+const char* dsunpack_verdict(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  if(_unpack_chunk("verdict", data, 0, data_size, &value, &value_size))
+    return NULL;
+
+  return (const char *)value;
+}
+
+
+// Digest sent in place of answer, NULL when answer is full
+const char* dsunpack_reply_digest(const void *data, int data_size)
+{
+  const void *value = NULL;
+  int value_size = 0;
+
+  if(_unpack_chunk("digest", data, 0, data_size, &value, &value_size))
+    return NULL;
+
+  return (const char *)value;
+}
@@ -1,11 +1,32 @@
 #ifndef __DSPACK_H__
 #define __DSPACK_H__
 
+#include "dsarena.h"
+
 #define DSPACK_SIGNED 1
 
+#define DSPRIO_INTERACTIVE 0 // page requests, default
+#define DSPRIO_NORMAL      1
+#define DSPRIO_BATCH       2 // background jobs
+#define DSPRIO_CLASSES     3
+
 int dspack(const char *tag, const void *data, int data_size, void **res, int *res_size, int options);
+int dspack_arena(PDSARENA arena, const char *tag, const void *data, int data_size, void **res, int *res_size, int options);
+int dspack_buf(const char *tag, const void *data, int data_size, void **buf, int *buf_size, void **res, int *res_size, int options);
 int dspack_bufsize(const char *tag, const void *data, int data_size, int *size);
 int dspack_complete(const char *tag, const void *data, int data_size);
 int dsunpack(const char *tag, const void *data, int data_size, const void **res, int *res_size, int options);
+int dspack_signed(const char *tag, const void *data, int data_size);
+
+int dspack_timeout(long long timeout_ms, char *buf, int buf_size);
+long long dsunpack_timeout(const void *data, int data_size);
+int dspack_priority(int priority, char *buf, int buf_size);
+int dsunpack_priority(const void *data, int data_size);
+const char* dsunpack_verdict(const void *data, int data_size);
+int dspack_digest_only(char *buf, int buf_size);
+int dsunpack_digest_only(const void *data, int data_size);
+int dspack_accept_zip(char *buf, int buf_size);
+int dsunpack_accept_zip(const void *data, int data_size);
+const char* dsunpack_reply_digest(const void *data, int data_size);
 
 #endif /* __DSPACK_H__ */
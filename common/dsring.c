@@ -0,0 +1,394 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "dsring.h"
+#include "dsmisc.h"
+
+
+
+// Shared memory of local driver holds request ring and answer ring, each
+// with single writer and single reader. Side finding its ring empty or full
+// marks itself idle and sleeps on its eventfd, the other side writes the
+// eventfd only then, so busy sides exchange commands without system calls.
+//
+// Driver creates memory and both eventfds and passes them over local socket.
+// Daemon does not trust the driver: memory is sealed against shrinking and
+// positions are checked before use.
+
+
+#define VERSION_SIZE 8
+
+
+typedef struct _ring_queue {
+  unsigned int head __attribute__((aligned(64))); // bytes written, moved by writer
+  unsigned int tail __attribute__((aligned(64))); // bytes read, moved by reader
+  int reader_idle __attribute__((aligned(64)));   // reader sleeps till data comes
+  int writer_idle;                                // writer sleeps till room is freed
+
+} RING_QUEUE, *PRING_QUEUE;
+
+typedef struct _ring_shm {
+  char version[VERSION_SIZE];
+  int closed;              // either side left
+  RING_QUEUE request;
+  RING_QUEUE answer;
+  unsigned char request_data[DSRING_REQUEST_SIZE];
+  unsigned char answer_data[DSRING_ANSWER_SIZE];
+
+} RING_SHM, *PRING_SHM;
+
+typedef struct _ring {
+  PRING_SHM shm;
+  PRING_QUEUE in;
+  unsigned char *in_data;
+  unsigned int in_size;
+  PRING_QUEUE out;
+  unsigned char *out_data;
+  unsigned int out_size;
+  int memfd;
+  int wait_fd;             // own eventfd
+  int wake_fd;             // eventfd of the other side
+
+} RING, *PRING;
+
+
+
+static void _close_fds(int *fds, int fds_num)
+{
+  for(int i = 0; i < fds_num; i++)
+    if(fds[i] >= 0)
+      close(fds[i]);
+}
+
+
+// the other side sleeps only after it marked itself idle
+static void _wake(PRING ring, int *idle)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(idle, __ATOMIC_RELAXED) && __atomic_exchange_n(idle, 0, __ATOMIC_SEQ_CST))
+  {
+    dstrace("Wake the other side of ring");
+    eventfd_write(ring->wake_fd, 1);
+  }
+}
+
+
+// idle mark is set before the last look at position moved by the other side
+static void _sleep(int *idle)
+{
+  __atomic_store_n(idle, 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void _awake(int *idle)
+{
+  __atomic_store_n(idle, 0, __ATOMIC_SEQ_CST);
+}
+
+
+void* dsring_create(void)
+{
+  PRING ring = (PRING)calloc(1, sizeof(RING));
+  if(!ring)
+  {
+    dslogerr(errno, "Cannot allocate ring");
+    return NULL;
+  }
+
+  ring->wait_fd = -1;
+  ring->wake_fd = -1;
+  ring->memfd = memfd_create("dbsync", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(ring->memfd < 0)
+  {
+    dslogerr(errno, "Cannot create ring memory");
+    goto fail;
+  }
+
+  if(ftruncate(ring->memfd, sizeof(RING_SHM)) ||
+     fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+  {
+    dslogerr(errno, "Cannot size ring memory");
+    goto fail;
+  }
+
+  ring->shm = (PRING_SHM)mmap(NULL, sizeof(RING_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+  if(ring->shm == MAP_FAILED)
+  {
+    dslogerr(errno, "Cannot map ring memory");
+    ring->shm = NULL;
+    goto fail;
+  }
+
+  ring->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ring->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(ring->wait_fd < 0 || ring->wake_fd < 0)
+  {
+    dslogerr(errno, "Cannot create ring wakeups");
+    goto fail;
+  }
+
+  strcpy(ring->shm->version, DSRING_VERSION);
+
+  // driver writes requests and reads answers
+  ring->out = &ring->shm->request;
+  ring->out_data = ring->shm->request_data;
+  ring->out_size = DSRING_REQUEST_SIZE;
+  ring->in = &ring->shm->answer;
+  ring->in_data = ring->shm->answer_data;
+  ring->in_size = DSRING_ANSWER_SIZE;
+
+  return ring;
+
+fail:
+  if(ring->shm)
+    munmap(ring->shm, sizeof(RING_SHM));
+  _close_fds(&ring->memfd, 1);
+  _close_fds(&ring->wait_fd, 1);
+  _close_fds(&ring->wake_fd, 1);
+  free(ring);
+
+  return NULL;
+}
+
+
+// Takes descriptors got from driver in dsring_fds order, they are closed
+// on failure
+void* dsring_attach(int *fds)
+{
+  struct stat st;
+
+  if(fstat(fds[0], &st) || st.st_size < sizeof(RING_SHM))
+  {
+    dslogw("Bad ring memory");
+    _close_fds(fds, DSRING_FDS);
+    return NULL;
+  }
+
+  // driver shrinking memory would crash the daemon
+  int seals = fcntl(fds[0], F_GET_SEALS);
+  if(seals < 0 || !(seals & F_SEAL_SHRINK))
+  {
+    dslogw("Ring memory is not sealed");
+    _close_fds(fds, DSRING_FDS);
+    return NULL;
+  }
+
+  // daemon must not block on descriptors it got
+  if(fcntl(fds[1], F_SETFL, O_NONBLOCK) || fcntl(fds[2], F_SETFL, O_NONBLOCK))
+  {
+    dslogerr(errno, "Cannot set ring wakeups to non-blocking mode");
+    _close_fds(fds, DSRING_FDS);
+    return NULL;
+  }
+
+  PRING ring = (PRING)calloc(1, sizeof(RING));
+  if(!ring)
+  {
+    dslogerr(errno, "Cannot allocate ring");
+    _close_fds(fds, DSRING_FDS);
+    return NULL;
+  }
+
+  ring->shm = (PRING_SHM)mmap(NULL, sizeof(RING_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if(ring->shm == MAP_FAILED)
+  {
+    dslogerr(errno, "Cannot map ring memory");
+    _close_fds(fds + 1, DSRING_FDS - 1);
+    free(ring);
+    return NULL;
+  }
+
+  if(strncmp(ring->shm->version, DSRING_VERSION, VERSION_SIZE))
+  {
+    dslogw("Ring version differs from %s", DSRING_VERSION);
+    munmap(ring->shm, sizeof(RING_SHM));
+    _close_fds(fds + 1, DSRING_FDS - 1);
+    free(ring);
+    return NULL;
+  }
+
+  ring->memfd = -1;
+  ring->wait_fd = fds[1];
+  ring->wake_fd = fds[2];
+
+  // daemon reads requests and writes answers
+  ring->in = &ring->shm->request;
+  ring->in_data = ring->shm->request_data;
+  ring->in_size = DSRING_REQUEST_SIZE;
+  ring->out = &ring->shm->answer;
+  ring->out_data = ring->shm->answer_data;
+  ring->out_size = DSRING_ANSWER_SIZE;
+
+  // daemon waits in poll till the first command
+  _sleep(&ring->in->reader_idle);
+
+  return ring;
+}
+
+
+// The other side is woken to notice it is left alone
+void dsring_free(void *ring)
+{
+  PRING _ring = (PRING)ring;
+
+  if(!_ring)
+    return;
+
+  __atomic_store_n(&_ring->shm->closed, 1, __ATOMIC_SEQ_CST);
+  eventfd_write(_ring->wake_fd, 1);
+
+  munmap(_ring->shm, sizeof(RING_SHM));
+  _close_fds(&_ring->memfd, 1);
+  _close_fds(&_ring->wait_fd, 1);
+  _close_fds(&_ring->wake_fd, 1);
+  free(_ring);
+}
+
+
+// Memory, wakeup of daemon and wakeup of driver, as driver passes them
+void dsring_fds(void *ring, int *fds)
+{
+  PRING _ring = (PRING)ring;
+
+  fds[0] = _ring->memfd;
+  fds[1] = _ring->wake_fd;
+  fds[2] = _ring->wait_fd;
+}
+
+
+// Readable when the other side woke this one
+int dsring_fd(void *ring)
+{
+  return ((PRING)ring)->wait_fd;
+}
+
+
+void dsring_drain(void *ring)
+{
+  eventfd_t value;
+
+  eventfd_read(((PRING)ring)->wait_fd, &value);
+}
+
+
+int dsring_closed(void *ring)
+{
+  return __atomic_load_n(&((PRING)ring)->shm->closed, __ATOMIC_ACQUIRE);
+}
+
+
+// True for registration frame
+int dsring_frame(const void *data, int data_size)
+{
+  return data_size > 2 && !memcmp(data, DSRING_TAG ":", 3);
+}
+
+
+// Returns as send does: bytes written, 0 when the other side left, -1 with
+// EWOULDBLOCK when ring is full and this side sleeps till room is freed
+int dsring_send(void *ring, const void *data, int size)
+{
+  PRING _ring = (PRING)ring;
+  PRING_QUEUE q = _ring->out;
+
+  if(dsring_closed(ring))
+    return 0;
+
+  unsigned int head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  if(head - tail > _ring->out_size)
+  {
+    dslogw("Ring positions are broken");
+    errno = EPROTO;
+    return -1;
+  }
+
+  if(head - tail == _ring->out_size)
+  {
+    _sleep(&q->writer_idle);
+    tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+    if(head - tail >= _ring->out_size)
+    {
+      errno = EWOULDBLOCK;
+      return -1;
+    }
+    _awake(&q->writer_idle);
+  }
+
+  unsigned int room = _ring->out_size - (head - tail);
+  unsigned int n = size < room ? size : room;
+  unsigned int offset = head & (_ring->out_size - 1);
+  unsigned int first = n < _ring->out_size - offset ? n : _ring->out_size - offset;
+
+  memcpy(_ring->out_data + offset, data, first);
+  memcpy(_ring->out_data, (const unsigned char *)data + first, n - first);
+  __atomic_store_n(&q->head, head + n, __ATOMIC_RELEASE);
+
+  _wake(_ring, &q->reader_idle);
+
+  return n;
+}
+
+
+// Returns as recv does: bytes read, 0 when the other side left, -1 with
+// EWOULDBLOCK when ring is empty and this side sleeps till data comes
+int dsring_recv(void *ring, void *buf, int size)
+{
+  PRING _ring = (PRING)ring;
+  PRING_QUEUE q = _ring->in;
+
+  unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  if(head - tail > _ring->in_size)
+  {
+    dslogw("Ring positions are broken");
+    errno = EPROTO;
+    return -1;
+  }
+
+  if(head == tail)
+  {
+    if(dsring_closed(ring))
+      return 0;
+
+    _sleep(&q->reader_idle);
+    head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+    if(head == tail)
+    {
+      errno = EWOULDBLOCK;
+      return -1;
+    }
+    _awake(&q->reader_idle);
+
+    if(head - tail > _ring->in_size)
+    {
+      dslogw("Ring positions are broken");
+      errno = EPROTO;
+      return -1;
+    }
+  }
+
+  unsigned int used = head - tail;
+  unsigned int n = size < used ? size : used;
+  unsigned int offset = tail & (_ring->in_size - 1);
+  unsigned int first = n < _ring->in_size - offset ? n : _ring->in_size - offset;
+
+  memcpy(buf, _ring->in_data + offset, first);
+  memcpy((unsigned char *)buf + first, _ring->in_data, n - first);
+  __atomic_store_n(&q->tail, tail + n, __ATOMIC_RELEASE);
+
+  _wake(_ring, &q->writer_idle);
+
+  return n;
+}
@@ -0,0 +1,21 @@
+#ifndef __DSRING_H__
+#define __DSRING_H__
+
+#define DSRING_TAG          "dr"               // of registration frame on local socket
+#define DSRING_VERSION      "1"                // layout of shared memory
+#define DSRING_FDS          3                  // memory, wakeups of daemon and driver
+#define DSRING_REQUEST_SIZE (64 * 1024)        // power of 2
+#define DSRING_ANSWER_SIZE  (256 * 1024)       // power of 2, longer answers are streamed
+
+void* dsring_create(void);
+void* dsring_attach(int *fds);
+void  dsring_free(void *ring);
+void  dsring_fds(void *ring, int *fds);
+int   dsring_fd(void *ring);
+void  dsring_drain(void *ring);
+int   dsring_closed(void *ring);
+int   dsring_frame(const void *data, int data_size);
+int   dsring_send(void *ring, const void *data, int size);
+int   dsring_recv(void *ring, void *buf, int size);
+
+#endif /* __DSRING_H__ */
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <zlib.h>
+
+#include "dszip.h"
+#include "dsmisc.h"
+
+
+
+// Payload of compressed frame is "<raw size>:<data>", data as long as raw
+// size is stored as is. Compression is fast zlib level, streams live as
+// long as their owner and are only reset between frames.
+
+
+#define ZIP_LEVEL       1
+#define SIZE_HEADER_MAX 12 // up to 10 digits and colon
+
+
+typedef struct _zip {
+  z_stream deflate;
+  z_stream inflate;
+  int deflate_ready;
+  int inflate_ready;
+
+} ZIP, *PZIP;
+
+
+
+void* dszip_create(void)
+{
+  PZIP zip = (PZIP)calloc(1, sizeof(ZIP));
+  if(!zip)
+    dslogerr(errno, "Cannot allocate compression context");
+
+  return zip;
+}
+
+
+void dszip_free(void *zip)
+{
+  PZIP _zip = (PZIP)zip;
+
+  if(!_zip)
+    return;
+
+  if(_zip->deflate_ready)
+    deflateEnd(&_zip->deflate);
+  if(_zip->inflate_ready)
+    inflateEnd(&_zip->inflate);
+
+  free(_zip);
+}
+
+
+// True for frame with compressed payload
+int dszip_frame(const void *data, int data_size)
+{
+  return data_size > 2 && !memcmp(data, DSZIP_TAG ":", 3);
+}
+
+
+// Room for payload of data, stored one included
+int dszip_bound(int data_size)
+{
+  int bound = compressBound(data_size);
+
+  return SIZE_HEADER_MAX + (bound > data_size ? bound : data_size);
+}
+
+
+// Data shorter than min_size or not shrinking is stored. Returns payload size.
+int dszip_pack(void *zip, const void *data, int data_size, int min_size, void *buf)
+{
+  PZIP _zip = (PZIP)zip;
+  int rc;
+
+  int header_size = sprintf((char *)buf, "%d:", data_size);
+  unsigned char *out = (unsigned char *)buf + header_size;
+
+  if(data_size >= min_size)
+  {
+    if(!_zip->deflate_ready)
+    {
+      rc = deflateInit(&_zip->deflate, ZIP_LEVEL);
+      if(rc != Z_OK)
+      {
+        dslog("Cannot init compression, error %d", rc);
+        return -1;
+      }
+      _zip->deflate_ready = 1;
+    }
+    else
+      deflateReset(&_zip->deflate);
+
+    _zip->deflate.next_in = (unsigned char *)data;
+    _zip->deflate.avail_in = data_size;
+    _zip->deflate.next_out = out;
+    _zip->deflate.avail_out = data_size - 1;
+
+    // output has to be shorter than data, otherwise data is stored
+    rc = deflate(&_zip->deflate, Z_FINISH);
+    if(rc == Z_STREAM_END)
+    {
+      dstrace("Compressed %d bytes to %lu", data_size, _zip->deflate.total_out);
+      return header_size + _zip->deflate.total_out;
+    }
+    if(rc != Z_OK && rc != Z_BUF_ERROR)
+    {
+      dslog("Compression failed, error %d", rc);
+      return -1;
+    }
+  }
+
+  memcpy(out, data, data_size);
+
+  return header_size + data_size;
+}
+
+
+// Size of data in payload, -1 for bad payload
+int dszip_size(const void *payload, int payload_size)
+{
+  const char *colon = memchr(payload, ':', payload_size < SIZE_HEADER_MAX ? payload_size : SIZE_HEADER_MAX);
+  if(!colon)
+  {
+    dslogw("Bad compressed payload header");
+    return -1;
+  }
+
+  int raw_size = atoi((const char *)payload);
+  if(raw_size <= 0 || raw_size > DSZIP_MAX_SIZE)
+  {
+    dslogw("Bad compressed payload size %d", raw_size);
+    return -1;
+  }
+
+  return raw_size;
+}
+
+
+int dszip_unpack(void *zip, const void *payload, int payload_size, void *buf, int raw_size)
+{
+  PZIP _zip = (PZIP)zip;
+  int rc;
+
+  const char *colon = memchr(payload, ':', payload_size < SIZE_HEADER_MAX ? payload_size : SIZE_HEADER_MAX);
+  if(!colon)
+    return -1;
+
+  const unsigned char *data = (const unsigned char *)colon + 1;
+  int data_size = payload_size - (data - (const unsigned char *)payload);
+
+  if(data_size == raw_size)
+  {
+    memcpy(buf, data, data_size);
+    return 0;
+  }
+
+  if(!_zip->inflate_ready)
+  {
+    rc = inflateInit(&_zip->inflate);
+    if(rc != Z_OK)
+    {
+      dslog("Cannot init decompression, error %d", rc);
+      return -1;
+    }
+    _zip->inflate_ready = 1;
+  }
+  else
+    inflateReset(&_zip->inflate);
+
+  _zip->inflate.next_in = (unsigned char *)data;
+  _zip->inflate.avail_in = data_size;
+  _zip->inflate.next_out = (unsigned char *)buf;
+  _zip->inflate.avail_out = raw_size;
+
+  rc = inflate(&_zip->inflate, Z_FINISH);
+  if(rc != Z_STREAM_END || _zip->inflate.total_out != raw_size)
+  {
+    dslogw("Bad compressed data, error %d", rc);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __DSZIP_H__
+#define __DSZIP_H__
+
+#define DSZIP_TAG      "dz"                // of compressed frame, plain one is "ds"
+#define DSZIP_METHOD   "zlib"
+#define DSZIP_MAX_SIZE (64 * 1024 * 1024)  // of decompressed data
+
+void* dszip_create(void);
+void  dszip_free(void *zip);
+int   dszip_frame(const void *data, int data_size);
+int   dszip_bound(int data_size);
+int   dszip_pack(void *zip, const void *data, int data_size, int min_size, void *buf);
+int   dszip_size(const void *payload, int payload_size);
+int   dszip_unpack(void *zip, const void *payload, int payload_size, void *buf, int raw_size);
+
+#endif /* __DSZIP_H__ */
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE // struct ucred
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
@@ -7,17 +9,37 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <pwd.h>
+#include <sched.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <sys/times.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "dsredis.h"
+#include "dscache.h"
+#include "dscluster.h"
+#include "dsjournal.h"
+#include "dsasync.h"
+#include "dshealth.h"
+#include "dscodel.h"
+#include "dssched.h"
+#include "dslane.h"
+#include "dsuring.h"
+#include "dsstats.h"
+#include "dsshard.h"
 #include "dsmisc.h"
+#include "dsarena.h"
 #include "dspack.h"
 #include "dscrypto.h"
+#include "dszip.h"
+#include "dsring.h"
+#include "dscmd.h"
 
 
 
@@ -29,16 +51,57 @@
 #define LISTEN_BACKLOG_SIZE   100
 #define POLL_QUEUE_SIZE       1024
 #define READ_BUFFER_SIZE      10240
+#define COMMAND_MAX_SIZE      READ_BUFFER_SIZE // compressed command unpacks to the same limit
+
+#define CACHE_COMMANDS        "GET,HGET,HGETALL"
+
+#define EXPIRED_REPORT_MS     10000 // dropped commands are logged not more often
+
+#define OVERLOADED            "overloaded"
+#define SCHED_SLICE_MS        5     // commands left after it wait for the next poll pass
+#define LANE_BARRIER          -1    // command runs while other lanes are idle
+#define VERDICT_SIZE          512
+#define ZIP_MIN_SIZE          1024  // shorter answers are not compressed
+#define TRUSTED_UIDS_MAX      16
+#define LOOP_REPORT_MS        10000 // socket calls per command are logged not more often
+#define SERVICE_TAG           "dbsyncd:" // commands to daemon itself
+#define SERVICE_TAG_SIZE      8
+#define STATS_LINE_SIZE       512
+#define ADMIN_ADDRESS         "127.0.0.1"
 
 
 typedef struct _db_address {
   char *db;
   char *address;
   int port;
+  void *health;            // circuit breaker of target
+  void *tracker;           // read cache invalidation source
+  void *cluster;           // slot map and node connections of rediscluster
+  void *journal;           // writes kept while target is unreachable
+  int async;               // writes are sent in background, reads skip it
+  void *queue;             // of async target
+  int index;               // position in targets list
   struct _db_address *next;
 
 } DB_ADDRESS, *PDB_ADDRESS;
 
+// Answers of targets compared by daemon, only the first one goes back
+typedef struct _consensus {
+  PDB_ADDRESS first;
+  unsigned char *res;
+  int res_size;
+  PDB_ADDRESS diverged;    // the first target answered differently
+
+} CONSENSUS, *PCONSENSUS;
+
+// Answer shared by connections coalesced on the same read command
+typedef struct _drv_reply {
+  int refs;
+  int size;
+  unsigned char data[];
+
+} DRV_REPLY, *PDRV_REPLY;
+
 typedef struct _drv_connection {
   int sockfd;
   int connbuf_insize;
@@ -47,8 +110,32 @@ typedef struct _drv_connection {
   unsigned char *connbuf_out;
   unsigned char *connbuf_outptr;
   int conn_timeout_ms;
+
+  PDSARENA arena; // command processing memory, reset once answer is sent
   
   int trusted;
+  int peer_trusted;        // local peer may send unsigned commands
+  unsigned int client;     // peer address, process of local peer
+  int local;               // peer came over local socket
+  int admin;               // peer came to admin port, only service commands are taken
+  void *ring;              // shared memory rings of local driver, polled by its eventfd
+
+  int pending;             // command is received and waits for execution
+  long long received_us;   // first bytes of command arrived
+  int shed;                // answered as overloaded without execution
+  int priority;            // class of command
+  long long finish;        // fair queuing tag, 0 till command is scheduled
+  int lane;                // runs the command
+  int running;             // command is given to lane, main loop does not touch connection
+  int done;                // set by lane
+  const char *cmd;         // pending command inside connbuf_in
+  int digest_only;         // driver gets full answer from other server
+  int accept_zip;          // driver takes compressed answer
+  long long deadline_us;   // driver waits for answer till then, 0 for no limit
+  unsigned long long hash; // of pending read command
+  struct _drv_connection *leader; // executes the same read command
+  int followers;           // connections waiting for this one answer
+  PDRV_REPLY reply;        // answer shared with followers
 
 } DRV_CONNECTION, *PDRV_CONNECTION;
 
@@ -58,208 +145,1908 @@ static int          g_service_working = 0;
 static int          g_pack_options = 0;
 static int          g_keepalive = 1;
 static PDB_ADDRESS  g_db_addresses = NULL;
+static int          g_read_routing = 0;
+static __thread PDB_ADDRESS g_read_next = NULL; // round-robin position for reads of the lane
+static int          g_sharding = 0;
+static int          g_db_count = 0;
+static int          g_open_skip = 0;     // writes leave out open targets instead of failing
+static int          g_consensus = 0;     // answers of targets are compared, one is returned
+static __thread long long g_deadline_us = 0; // of command processed by the thread
+static long long    g_expired = 0;       // commands dropped after their deadline
+static long long    g_expired_reported_us = 0;
+static int          g_codel = 1;         // queue delay based load shedding
+static int          g_client_limit = 0;  // commands of one client in queue, 0 for no limit
+static long long    g_client_shed = 0;
+static int          g_lanes_num = 1;     // commands run in main loop unless more lanes
+static int          g_barrier = 0;       // command touching keys of several lanes runs alone
+static void      ***g_pools = NULL;      // connection to every redis target per lane
+static __thread void **g_pool = NULL;    // of the lane
+static void       **g_zips = NULL;       // compression context per lane
+static __thread void *g_zip = NULL;      // of the lane
+static void        *g_unzip = NULL;      // commands are decompressed by main loop
+static int          g_zip_min = ZIP_MIN_SIZE; // 0 disables compression
+static char        *g_unix_path = NULL;  // of local listening socket
+static uid_t        g_trusted_uids[TRUSTED_UIDS_MAX]; // local peers not signing commands
+static int          g_trusted_uids_num = 0;
+static int          g_listen_num = 1;    // listening sockets lead poll array
+static int          g_uring = 0;         // main loop runs on io_uring instead of poll
+static long long    g_loop_syscalls = 0; // socket calls of poll engine
+static long long    g_loop_commands = 0;
+static long long    g_loop_reported_us = 0;
+static long long    g_loop_reported_syscalls = 0;
+static long long    g_loop_reported_commands = 0;
+static int          g_spin_us = 0;       // main loop polls without blocking this long after activity
+static int          g_busy_poll_us = 0;  // SO_BUSY_POLL of client connections
+static int          g_loop_cpu = -1;     // main loop is pinned to this CPU
+static long long    g_loop_active_us = 0;
+static long long    g_loop_spin_us = 0;  // time spent spinning
+static long long    g_loop_spin_hits = 0;  // events found while spinning
+static long long    g_loop_wakeups = 0;  // events found by blocking wait
+static long long    g_loop_reported_spin_us = 0;
+static long long    g_loop_reported_spin_hits = 0;
+static long long    g_loop_reported_wakeups = 0;
+static int          g_admin_port = 0;    // of listening socket for service commands only
+static int          g_admin_fd = -1;
+static long long    g_started_us = 0;
+
+
+// Backend work is not started when its answer comes after deadline
+int target_late(PDB_ADDRESS db_address, long long now_us)
+{
+  return g_deadline_us && now_us + dshealth_latency(db_address->health) > g_deadline_us;
+}
 
 
-#ifdef DSDEBUG
-void service_command(const char *cmd)
+// Connection of the lane to redis target is kept open
+void* target_connection(PDB_ADDRESS db_address)
 {
-  if(!strcmp(cmd, "QUIT"))
-    g_service_working = 0;
+  void **slot = &g_pool[db_address->index];
+
+  if(*slot && (dsredis_broken(*slot) || dsredis_stale(*slot)))
+  {
+    dsredis_free(*slot);
+    *slot = NULL;
+  }
+
+  if(!*slot)
+    *slot = dsredis_connect(db_address->address, db_address->port);
+
+  return *slot;
 }
-#endif
 
-void process_command(const char *cmd, void **res, int *res_size)
+
+int target_run(PDSARENA arena, PDB_ADDRESS db_address, const char *cmd, unsigned char **res, int *res_size)
 {
-#ifdef DSDEBUG
-  char *cmdpos = strchr(cmd, ':');
-  if(!strncmp(cmd, "dbsyncd", cmdpos - cmd))
+  void *redis_ctx = target_connection(db_address);
+  if(!redis_ctx)
+    return DSREDIS_UNREACHABLE;
+
+  return dsredis_run(arena, redis_ctx, cmd, res, res_size);
+}
+
+
+int target_run_elements(PDSARENA arena, PDB_ADDRESS db_address, const char *cmd, char ***elements, int *elements_num)
+{
+  void *redis_ctx = target_connection(db_address);
+  if(!redis_ctx)
+    return DSREDIS_UNREACHABLE;
+
+  return dsredis_run_elements(arena, redis_ctx, cmd, elements, elements_num);
+}
+
+
+// Target is not asked when it cannot answer till deadline or is failing
+int target_check(PDB_ADDRESS db_address, long long start_us)
+{
+  if(target_late(db_address, start_us))
   {
-    dstrace("Processing service command: %s", cmdpos + 1);
+    dstrace("Db %s:%s:%d cannot answer till deadline", db_address->db, db_address->address, db_address->port);
+    dsstats_target(db_address->index, DSREDIS_EXPIRED, -1);
+    return DSREDIS_EXPIRED;
+  }
 
-    service_command(cmdpos + 1);
-    return;
+  if(!dshealth_allow(db_address->health))
+  {
+    dstrace("Db %s:%s:%d is failing, command rejected", db_address->db, db_address->address, db_address->port);
+    dsstats_target(db_address->index, DSHEALTH_REJECTED, -1);
+    return DSHEALTH_REJECTED;
+  }
+
+  return 0;
+}
+
+
+// Result of the target goes to its health and statistics
+int target_report(PDB_ADDRESS db_address, int rc, long long start_us)
+{
+  long long now_us = dsclock_us();
+  if(rc == DSREDIS_UNREACHABLE && g_deadline_us && now_us >= g_deadline_us)
+    rc = DSREDIS_EXPIRED; // timeout was cut by deadline, target may be fine
+
+  dshealth_report(db_address->health, rc, now_us - start_us);
+  dsstats_target(db_address->index, rc, now_us - start_us);
+
+  return rc;
+}
+
+
+// Runs command on single target and keeps its health.
+// Cached command is read through tracked connection of the target.
+int run_target(PDSARENA arena, PDB_ADDRESS db_address, const char *cmd, int cached, unsigned char **dbres, int *dbres_size)
+{
+  long long start_us = dsclock_us();
+
+  int rc = target_check(db_address, start_us);
+  if(rc)
+    return rc;
+
+  dstrace("Process on db %s:%s:%d", db_address->db, db_address->address, db_address->port);
+
+  if(!strcmp(db_address->db, "redis"))
+  {
+    if(cached && db_address->tracker)
+      rc = dscache_run(db_address->tracker, arena, cmd, dbres, dbres_size);
+    else
+      rc = target_run(arena, db_address, cmd, dbres, dbres_size);
+  }
+  else if(!strcmp(db_address->db, "rediscluster"))
+  {
+    rc = db_address->cluster ? dscluster_run(arena, db_address->cluster, cmd, dbres, dbres_size) : DSREDIS_UNREACHABLE;
+  }
+
+  return target_report(db_address, rc, start_us);
+}
+
+
+// Packed answer of database is appended to result
+int add_chunk(PDSARENA arena, const char *db, const unsigned char *dbres, int dbres_size, void **res, int *res_size)
+{
+  int rc = 0;
+  void *chunk = NULL;
+  int chunk_size = 0;
+
+  if(dbres_size > 0)
+    rc = dspack_arena(arena, db, dbres, dbres_size, &chunk, &chunk_size, 0);
+
+  if(!rc && chunk_size > 0)
+  {
+    dstrace("Add chunk of size %d to %d result", chunk_size, *res_size);
+    *res = dsarena_realloc(arena, *res, *res_size, *res_size + chunk_size);
+    if(*res)
+    {
+      memcpy(*res + *res_size, chunk, chunk_size);
+      *res_size += chunk_size;
+    }
+    else
+      dslog("Result reallocation for new chunk failed");
+  }
+
+  return rc;
+}
+
+
+int process_target(PDSARENA arena, PDB_ADDRESS db_address, const char *cmd, int cached, void **res, int *res_size)
+{
+  unsigned char *dbres = NULL;
+  int dbres_size = 0;
+
+  int rc = run_target(arena, db_address, cmd, cached, &dbres, &dbres_size);
+  if(!rc)
+    rc = add_chunk(arena, db_address->db, dbres, dbres_size, res, res_size);
+
+  return rc;
+}
+
+
+int consensus_target(PDSARENA arena, PCONSENSUS consensus, PDB_ADDRESS db_address, const char *cmd, int cached)
+{
+  unsigned char *dbres = NULL;
+  int dbres_size = 0;
+
+  int rc = run_target(arena, db_address, cmd, cached, &dbres, &dbres_size);
+  if(rc)
+    return rc;
+
+  if(!consensus->first)
+  {
+    consensus->first = db_address;
+    consensus->res = dbres;
+    consensus->res_size = dbres_size;
+  }
+  else if(!consensus->diverged &&
+          (dbres_size != consensus->res_size || memcmp(dbres, consensus->res, dbres_size)))
+  {
+    dslogw("Db %s:%d answers differently from %s:%d", db_address->address, db_address->port,
+      consensus->first->address, consensus->first->port);
+    consensus->diverged = db_address;
+  }
+
+  return 0;
+}
+
+
+// Single answer is followed by "verdict" chunk with "agree" or
+// "diverged <db>:<address>:<port>" naming the different target
+int consensus_result(PDSARENA arena, PCONSENSUS consensus, void **res, int *res_size)
+{
+  char verdict[VERDICT_SIZE];
+
+  if(!consensus->first || (!consensus->res_size && !consensus->diverged))
+    return 0;
+
+  int rc = add_chunk(arena, consensus->first->db, consensus->res, consensus->res_size, res, res_size);
+
+  if(consensus->diverged)
+    snprintf(verdict, sizeof(verdict), "diverged %s:%s:%d", consensus->diverged->db, consensus->diverged->address, consensus->diverged->port);
+  else
+    snprintf(verdict, sizeof(verdict), "agree");
+
+  if(!rc)
+    rc = add_chunk(arena, "verdict", (unsigned char *)verdict, strlen(verdict) + 1, res, res_size);
+
+  return rc;
+}
+
+
+// All databases should have successful result. Target with journal is
+// skipped while it is failing or its journal is not replayed yet, the
+// write is appended to the journal once other targets applied it. Other
+// failing targets fail the command at once or are left out by policy.
+// Write applied by any target goes on to the rest of them, and deadline
+// is checked only before the first one, otherwise targets diverge.
+// Asynchronous targets get the write queued after synchronous ones answered.
+int process_all(PDSARENA arena, const char *cmd, int cmdclass, int cached, void **res, int *res_size)
+{
+  int rc = 0, applied = 0;
+  PDB_ADDRESS db_address;
+  CONSENSUS consensus;
+
+  memset(&consensus, 0, sizeof(consensus));
+
+  char *spill = (char *)dsarena_alloc(arena, g_db_count);
+  if(!spill)
+    return -1;
+  memset(spill, 0, g_db_count);
+
+  // no target gets the command unless all of them answer till deadline
+  long long deadline_us = g_deadline_us;
+  if(deadline_us)
+  {
+    long long need_us = 0;
+    for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+      if(!db_address->async)
+        need_us += dshealth_latency(db_address->health);
+
+    if(dsclock_us() + need_us > deadline_us)
+    {
+      dstrace("Databases cannot answer till deadline, %lld us needed", need_us);
+      return DSREDIS_EXPIRED;
+    }
+
+    if(cmdclass == DSCMD_WRITE)
+    {
+      g_deadline_us = 0;
+      dsredis_deadline(0);
+    }
+  }
+
+  for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+  {
+    if(rc && (cmdclass != DSCMD_WRITE || !applied))
+      break;
+
+    if(db_address->async)
+      continue;
+
+    // journal keeps order of writes
+    if(db_address->journal && dsjournal_pending(db_address->journal))
+    {
+      spill[db_address->index] = 1;
+      continue;
+    }
+
+    int target_rc;
+    if(g_consensus)
+      target_rc = consensus_target(arena, &consensus, db_address, cmd, cached);
+    else
+      target_rc = process_target(arena, db_address, cmd, cached, res, res_size);
+
+    if(!target_rc)
+      applied++;
+    else if((target_rc == DSREDIS_UNREACHABLE || target_rc == DSHEALTH_REJECTED) && db_address->journal)
+      spill[db_address->index] = 1;
+    else if(!rc && !(target_rc == DSHEALTH_REJECTED && g_open_skip))
+      rc = target_rc;
+  }
+
+  g_deadline_us = deadline_us;
+  dsredis_deadline(deadline_us);
+
+  if(!rc && !applied)
+  {
+    dslogw("No database is reachable");
+    rc = DSREDIS_UNREACHABLE;
+  }
+
+  if(!rc && g_consensus)
+    rc = consensus_result(arena, &consensus, res, res_size);
+
+  for(db_address = g_db_addresses; applied && cmdclass == DSCMD_WRITE && db_address; db_address = db_address->next)
+  {
+    if(spill[db_address->index] && dsjournal_append(db_address->journal, cmd))
+    {
+      dslog("Command is lost for %s:%d", db_address->address, db_address->port);
+      rc = -1;
+    }
+  }
+
+  for(db_address = g_db_addresses; applied && cmdclass == DSCMD_WRITE && db_address; db_address = db_address->next)
+  {
+    if(db_address->async && dsasync_push(db_address->queue, cmd))
+      dslogw("Write is dropped for %s:%d, its queue is full", db_address->address, db_address->port);
+  }
+
+  return rc;
+}
+
+
+// Read-only command goes to single healthy target in round-robin order,
+// the next one is tried when it fails. Asynchronous targets and targets
+// with journal to replay may miss writes, they never answer reads.
+int process_read(PDSARENA arena, const char *cmd, int cached, void **res, int *res_size)
+{
+  int rc = -1;
+  int pass, tried = 0;
+
+  // failing targets are tried only when no healthy one is left
+  for(pass = 0; pass < 2 && rc && !tried; pass++)
+  {
+    PDB_ADDRESS db_address = g_read_next ? g_read_next : g_db_addresses;
+    PDB_ADDRESS start = db_address;
+    do
+    {
+      int synced = !db_address->async && !(db_address->journal && dsjournal_pending(db_address->journal));
+      if(synced && (pass == 0) == dshealth_closed(db_address->health))
+      {
+        tried++;
+        rc = process_target(arena, db_address, cmd, cached, res, res_size);
+        if(!rc)
+          dstrace("Read served by db %s:%s:%d", db_address->db, db_address->address, db_address->port);
+      }
+
+      db_address = db_address->next ? db_address->next : g_db_addresses;
+      if(!rc)
+        g_read_next = db_address;
+    } while(rc && db_address != start);
+  }
+
+  if(!tried)
+    dslogw("Read command failed, no database is in sync");
+  else if(rc)
+    dslogw("Read command failed on %d databases", tried);
+
+  return rc;
+}
+
+
+// Multi-key command is split into one command per shard, answers are merged
+// in the order of keys
+int process_split(PDSARENA arena, const char *cmd, int keyspec, void **res, int *res_size)
+{
+  int i, rc = 0;
+  int step = keyspec == DSCMD_KEY_PAIRS ? 2 : 1;
+  int cmd_len = strlen(cmd);
+
+  // per shard commands and key positions
+  char **cmds = (char **)dsarena_alloc(arena, g_db_count * sizeof(char *));
+  int *lens = (int *)dsarena_alloc(arena, g_db_count * sizeof(int));
+  int *keys = (int *)dsarena_alloc(arena, g_db_count * sizeof(int));
+  int *key_shards = (int *)dsarena_alloc(arena, (cmd_len / 2 + 1) * sizeof(int));
+  if(!cmds || !lens || !keys || !key_shards)
+    return -1;
+
+  const char *name;
+  int name_len;
+  dscmd_arg(cmd, 0, &name, &name_len);
+
+  for(i = 0; i < g_db_count; i++)
+  {
+    cmds[i] = NULL;
+    lens[i] = 0;
+    keys[i] = 0;
+  }
+
+  int keys_num = 0;
+  const char *pos = name + name_len;
+  while(1)
+  {
+    while(*pos == ' ')
+      pos++;
+    if(!*pos)
+      break;
+
+    // key with its value for pairs
+    const char *start = pos;
+    const char *end = start;
+    for(i = 0; i < step && *pos; i++)
+    {
+      while(*pos == ' ')
+        pos++;
+      end = strchr(pos, ' ');
+      if(!end)
+        end = pos + strlen(pos);
+      pos = end;
+    }
+
+    const char *key_end = strchr(start, ' ');
+    if(!key_end || key_end > end)
+      key_end = end;
+
+    PDB_ADDRESS db_address = dsshard_target(start, key_end - start);
+    int shard = db_address->index;
+
+    if(!cmds[shard])
+    {
+      cmds[shard] = (char *)dsarena_alloc(arena, cmd_len + 1);
+      if(!cmds[shard])
+        return -1;
+      memcpy(cmds[shard], name, name_len);
+      lens[shard] = name_len;
+    }
+    cmds[shard][lens[shard]++] = ' ';
+    memcpy(cmds[shard] + lens[shard], start, end - start);
+    lens[shard] += end - start;
+    cmds[shard][lens[shard]] = 0;
+
+    keys[shard]++;
+    key_shards[keys_num++] = shard;
+  }
+
+  char ***elements = NULL;
+  int *elements_num = NULL;
+  if(keyspec == DSCMD_KEY_ALL)
+  {
+    elements = (char ***)dsarena_alloc(arena, g_db_count * sizeof(char **));
+    elements_num = (int *)dsarena_alloc(arena, g_db_count * sizeof(int));
+    if(!elements || !elements_num)
+      return -1;
+  }
+
+  long long count = 0;
+  PDB_ADDRESS db_address;
+  for(db_address = g_db_addresses; !rc && db_address; db_address = db_address->next)
+  {
+    int shard = db_address->index;
+    if(!cmds[shard])
+      continue;
+
+    long long start_us = dsclock_us();
+
+    rc = target_check(db_address, start_us);
+    if(rc)
+      break;
+
+    if(keyspec == DSCMD_KEY_ALL)
+    {
+      rc = target_run_elements(arena, db_address, cmds[shard], &elements[shard], &elements_num[shard]);
+      if(!rc && elements_num[shard] != keys[shard])
+      {
+        dslog("Shard answer has %d elements for %d keys", elements_num[shard], keys[shard]);
+        rc = -1;
+      }
+    }
+    else
+    {
+      unsigned char *dbres = NULL;
+      int dbres_size = 0;
+
+      rc = target_run(arena, db_address, cmds[shard], &dbres, &dbres_size);
+      if(!rc && keyspec == DSCMD_KEY_COUNT)
+        count += dbres ? atoll((char *)dbres) : 0;
+    }
+
+    rc = target_report(db_address, rc, start_us);
+  }
+
+  if(rc)
+    return rc;
+
+  char buf[32];
+  unsigned char *merged = (unsigned char *)buf;
+  int merged_size = 0;
+
+  if(keyspec == DSCMD_KEY_ALL)
+  {
+    // same new line joined form as single array answer
+    for(i = 0; i < g_db_count; i++)
+      keys[i] = 0;
+    for(i = 0; i < keys_num; i++)
+    {
+      const char *element = elements[key_shards[i]][keys[key_shards[i]]++];
+      merged_size += (element ? strlen(element) : 0) + 1;
+    }
+    for(i = 0; i < g_db_count; i++)
+      keys[i] = 0;
+
+    merged = (unsigned char *)dsarena_alloc(arena, merged_size);
+    if(!merged)
+      return -1;
+
+    int offset = 0;
+    for(i = 0; i < keys_num; i++)
+    {
+      int shard = key_shards[i];
+      const char *element = elements[shard][keys[shard]++];
+      int len = element ? strlen(element) : 0;
+      if(len)
+        memcpy(merged + offset, element, len);
+      offset += len;
+      merged[offset++] = i < keys_num - 1 ? '\n' : 0;
+    }
+  }
+  else if(keyspec == DSCMD_KEY_COUNT)
+  {
+    merged_size = snprintf(buf, sizeof(buf), "%lld", count) + 1;
+  }
+  else
+  {
+    merged_size = snprintf(buf, sizeof(buf), "OK") + 1;
+  }
+
+  dstrace("Command split over shards, %d keys", keys_num);
+
+  return add_chunk(arena, g_db_addresses->db, merged, merged_size, res, res_size);
+}
+
+
+// Keyless read of the whole keyspace runs on every shard, counts are summed
+// and keys joined
+int process_gather(PDSARENA arena, const char *cmd, int merge, void **res, int *res_size)
+{
+  int rc = 0;
+  long long count = 0;
+  unsigned char *joined = NULL;
+  int joined_size = 0;
+
+  PDB_ADDRESS db_address;
+  for(db_address = g_db_addresses; !rc && db_address; db_address = db_address->next)
+  {
+    unsigned char *dbres = NULL;
+    int dbres_size = 0;
+    long long start_us = dsclock_us();
+
+    rc = target_check(db_address, start_us);
+    if(rc)
+      break;
+
+    rc = target_run(arena, db_address, cmd, &dbres, &dbres_size);
+    if(!rc && merge == DSCMD_KEY_COUNT)
+      count += dbres ? atoll((char *)dbres) : 0;
+    else if(!rc)
+      rc = dsredis_join(arena, &joined, &joined_size, dbres, dbres_size);
+
+    rc = target_report(db_address, rc, start_us);
+  }
+
+  if(rc)
+    return rc;
+
+  char buf[32];
+  if(merge == DSCMD_KEY_COUNT)
+  {
+    joined = (unsigned char *)buf;
+    joined_size = snprintf(buf, sizeof(buf), "%lld", count) + 1;
+  }
+
+  dstrace("Command gathered from every shard");
+
+  return add_chunk(arena, g_db_addresses->db, joined, joined_size, res, res_size);
+}
+
+
+// Command goes to the shard of its keys, multi-key command of several shards
+// is split over them and keyless command goes to every shard. Command with
+// unknown keys, keys of several shards which cannot be split or answer of
+// single shard, as cursor is, is refused.
+int process_sharded(PDSARENA arena, const char *cmd, int cached, void **res, int *res_size)
+{
+  int rc = 0;
+  DSCMD_KEYITER keys;
+  int keyspec = dscmd_keys_begin(cmd, &keys);
+  const char *key;
+  int key_len;
+
+  if(keyspec == DSCMD_KEY_UNKNOWN)
+  {
+    dscmd_arg(cmd, 0, &key, &key_len);
+    dslogw("Command %.*s cannot be sharded, its keys are unknown", key_len, key);
+    return DSREDIS_ERROR;
+  }
+
+  if(keyspec == DSCMD_KEY_NONE || dscmd_keys_next(&keys, &key, &key_len))
+  {
+    int merge = dscmd_keyspace(cmd);
+    if(merge == DSCMD_KEY_UNKNOWN)
+    {
+      dscmd_arg(cmd, 0, &key, &key_len);
+      dslogw("Command %.*s cannot be sharded, its answer holds for one shard", key_len, key);
+      return DSREDIS_ERROR;
+    }
+
+    if(merge != DSCMD_KEY_NONE)
+      return process_gather(arena, cmd, merge, res, res_size);
+
+    PDB_ADDRESS db_address;
+    for(db_address = g_db_addresses; !rc && db_address; db_address = db_address->next)
+      rc = process_target(arena, db_address, cmd, cached, res, res_size);
+
+    return rc;
+  }
+
+  PDB_ADDRESS db_address = dsshard_target(key, key_len);
+
+  while(!dscmd_keys_next(&keys, &key, &key_len))
+  {
+    if(dsshard_target(key, key_len) == db_address)
+      continue;
+
+    if(keyspec != DSCMD_KEY_SINGLE && keyspec != DSCMD_KEY_MULTI)
+      return process_split(arena, cmd, keyspec, res, res_size);
+
+    dslogw("Keys of command are on different shards, hash tags keep them together");
+    return DSREDIS_ERROR;
+  }
+
+  dstrace("Command goes to shard %s:%d", db_address->address, db_address->port);
+
+  return process_target(arena, db_address, cmd, cached, res, res_size);
+}
+
+
+// Name of command to daemon itself, NULL for database command
+const char* service_name(const char *cmd)
+{
+  return strncmp(cmd, SERVICE_TAG, SERVICE_TAG_SIZE) ? NULL : cmd + SERVICE_TAG_SIZE;
+}
+
+
+// Line of service answer is appended to text growing in arena
+void stats_line(PDSARENA arena, char **text, int *text_size, const char *format, ...)
+{
+  char line[STATS_LINE_SIZE];
+  va_list args;
+
+  if(!*text)
+    return;
+
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if(len < 0)
+    return;
+  if(len >= sizeof(line))
+    len = sizeof(line) - 1;
+
+  *text = (char *)dsarena_realloc(arena, *text, *text_size + 1, *text_size + len + 1);
+  if(!*text)
+    return;
+
+  memcpy(*text + *text_size, line, len + 1);
+  *text_size += len;
+}
+
+
+void stats_latency(PDSARENA arena, char **text, int *text_size, const char *name, PDSSTATS_LATENCY latency)
+{
+  stats_line(arena, text, text_size, "%s.count %lld\n%s.errors %lld\n", name, latency->count, name, latency->errors);
+  stats_line(arena, text, text_size, "%s.p50_us %lld\n%s.p99_us %lld\n%s.p999_us %lld\n%s.max_us %lld\n",
+             name, latency->p50_us, name, latency->p99_us, name, latency->p999_us, name, latency->max_us);
+}
+
+
+// Counters of daemon and its modules as "name value" lines. Runs in main
+// loop, its own counters are read without locks.
+int stats_reply(PDSARENA arena, void **res, int *res_size)
+{
+  static const char *cmdclasses[DSSTATS_CLASSES] = {"write", "read", "scan"};
+  static const char *priorities[DSPRIO_CLASSES] = {"interactive", "normal", "batch"};
+  static const char *states[] = {"closed", "open", "half_open"};
+  DSSTATS_LATENCY latency;
+  char name[STATS_LINE_SIZE];
+  int i;
+
+  int text_size = 0;
+  char *text = (char *)dsarena_alloc(arena, 1);
+  if(!text)
+    return -1;
+  *text = 0;
+
+  long long now_us = dsclock_us();
+  long long commands = 0;
+  for(i = 0; i < DSSTATS_CLASSES; i++)
+  {
+    dsstats_class_latency(i, &latency);
+    commands += latency.count;
+  }
+
+  long long accepted = dsstats_counter(DSSTATS_ACCEPTED);
+  // counters only grow, rate is taken by scraper from two answers
+  stats_line(arena, &text, &text_size, "version %s\nuptime_s %lld\ncommands %lld\n",
+             DSVERSION, (now_us - g_started_us) / 1000000, commands);
+  stats_line(arena, &text, &text_size, "bytes_in %lld\nbytes_out %lld\n",
+             dsstats_counter(DSSTATS_BYTES_IN), dsstats_counter(DSSTATS_BYTES_OUT));
+  stats_line(arena, &text, &text_size, "connections.open %lld\nconnections.accepted %lld\nconnections.timeouts %lld\n",
+             accepted - dsstats_counter(DSSTATS_CLOSED), accepted, dsstats_counter(DSSTATS_TIMEOUTS));
+  stats_line(arena, &text, &text_size, "errors.bad_packets %lld\nerrors.expired %lld\nerrors.client_limit %lld\n",
+             dsstats_counter(DSSTATS_BAD_PACKETS), g_expired, g_client_shed);
+
+  dsstats_verify_latency(&latency);
+  stats_latency(arena, &text, &text_size, "verify", &latency);
+  dsstats_queue_latency(&latency);
+  stats_latency(arena, &text, &text_size, "queue", &latency);
+  for(i = 0; i < DSSTATS_CLASSES; i++)
+  {
+    dsstats_class_latency(i, &latency);
+    snprintf(name, sizeof(name), "class.%s", cmdclasses[i]);
+    stats_latency(arena, &text, &text_size, name, &latency);
+  }
+
+  PDB_ADDRESS db_address;
+  for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+  {
+    snprintf(name, sizeof(name), "target.%s:%s:%d", db_address->db, db_address->address, db_address->port);
+    dsstats_target_latency(db_address->index, &latency);
+    stats_latency(arena, &text, &text_size, name, &latency);
+
+    if(db_address->health)
+    {
+      DSHEALTH_STATS health;
+      dshealth_stats(db_address->health, &health);
+      stats_line(arena, &text, &text_size, "%s.state %s\n%s.failures %lld\n%s.opened %lld\n%s.rejected %lld\n",
+                 name, states[health.state], name, health.failures, name, health.opened, name, health.rejected);
+      stats_line(arena, &text, &text_size, "%s.probes %lld\n%s.probe_us %lld\n%s.latency_us %lld\n",
+                 name, health.probes, name, health.probe_us, name, health.latency_us);
+    }
+
+    if(db_address->queue)
+    {
+      DSASYNC_STATS async;
+      dsasync_stats(db_address->queue, &async);
+      stats_line(arena, &text, &text_size, "%s.async_queued %lld\n%s.async_sent %lld\n%s.async_failed %lld\n%s.async_dropped %lld\n%s.async_spilled %lld\n",
+                 name, async.queued, name, async.sent, name, async.failed, name, async.dropped, name, async.spilled);
+    }
+
+    if(db_address->journal)
+    {
+      DSJOURNAL_STATS journal;
+      dsjournal_stats(db_address->journal, &journal);
+      stats_line(arena, &text, &text_size, "%s.journal_entries %lld\n%s.journal_size %lld\n%s.journal_lag_ms %lld\n%s.journal_replayed %lld\n%s.journal_failed %lld\n",
+                 name, journal.entries, name, journal.size, name, journal.lag_ms, name, journal.replayed, name, journal.failed);
+    }
+  }
+
+  DSCODEL_STATS codel;
+  dscodel_stats(&codel);
+  stats_line(arena, &text, &text_size, "codel.dropped %lld\ncodel.sojourn_us %lld\ncodel.dropping %d\n",
+             codel.dropped, codel.sojourn_us, codel.dropping);
+
+  DSSCHED_STATS sched;
+  dssched_stats(&sched);
+  for(i = 0; i < DSPRIO_CLASSES; i++)
+    stats_line(arena, &text, &text_size, "sched.%s.weight %d\nsched.%s.commands %lld\n",
+               priorities[i], sched.weights[i], priorities[i], sched.commands[i]);
+  stats_line(arena, &text, &text_size, "sched.deferred %lld\n", sched.deferred);
+
+  for(i = 0; g_lanes_num > 1 && i < g_lanes_num; i++)
+  {
+    DSLANE_STATS lane;
+    dslane_stats(i, &lane);
+    stats_line(arena, &text, &text_size, "lane.%d.busy %d\nlane.%d.jobs %lld\nlane.%d.busy_us %lld\n",
+               i, lane.busy, i, lane.jobs, i, lane.busy_us);
+  }
+
+  DSCACHE_STATS cache;
+  dscache_stats(&cache);
+  stats_line(arena, &text, &text_size, "cache.hits %lld\ncache.misses %lld\ncache.stores %lld\ncache.invalidations %lld\n",
+             cache.hits, cache.misses, cache.stores, cache.invalidations);
+  stats_line(arena, &text, &text_size, "cache.evictions %lld\ncache.flushes %lld\ncache.entries %lld\ncache.memory %lld\n",
+             cache.evictions, cache.flushes, cache.entries, cache.memory);
+
+  long long syscalls = g_loop_syscalls;
+  if(g_uring)
+  {
+    DSURING_STATS uring;
+    dsuring_stats(&uring);
+    syscalls += uring.syscalls;
+    stats_line(arena, &text, &text_size, "loop.uring_completions %lld\n", uring.completions);
+  }
+  stats_line(arena, &text, &text_size, "loop.engine %s\nloop.socket_calls %lld\nloop.commands %lld\n",
+             g_uring ? "io_uring" : "poll", syscalls, g_loop_commands);
+  stats_line(arena, &text, &text_size, "loop.spin_us %lld\nloop.spin_hits %lld\nloop.wakeups %lld\n",
+             g_loop_spin_us, g_loop_spin_hits, g_loop_wakeups);
+
+  if(!text)
+    return -1;
+
+  return add_chunk(arena, "stats", (unsigned char *)text, text_size + 1, res, res_size);
+}
+
+
+// Service command answers by "stats" chunk, unknown one gets no answer
+void service_command(PDSARENA arena, const char *name, void **res, int *res_size)
+{
+  if(!strcmp(name, "STATS"))
+  {
+    if(stats_reply(arena, res, res_size))
+    {
+      *res = NULL;
+      *res_size = 0;
+    }
+    return;
+  }
+
+#ifdef DSDEBUG
+  if(!strcmp(name, "QUIT"))
+  {
+    g_service_working = 0;
+    return;
+  }
+#endif
+
+  dslogw("Unknown service command %s", name);
+}
+
+
+void process_command(PDSARENA arena, const char *cmd, void **res, int *res_size)
+{
+  int rc;
+  *res = NULL;
+  *res_size = 0;
+
+  const char *service = service_name(cmd);
+  if(service)
+  {
+    dstrace("Processing service command: %s", service);
+
+    service_command(arena, service, res, res_size);
+    return;
+  }
+
+  dstrace("Processing command: %s", cmd);
+
+  int cmdclass = dscmd_class(cmd);
+
+  int cached = dscache_cacheable(cmd);
+  if(cached)
+  {
+    if(!dscache_get(arena, cmd, res, res_size))
+      return;
+    dscache_fetch_begin(cmd);
+  }
+
+  if(g_sharding)
+  {
+    rc = process_sharded(arena, cmd, cached, res, res_size);
+  }
+  else if(g_read_routing && g_db_addresses->next && cmdclass == DSCMD_READ)
+  {
+    rc = process_read(arena, cmd, cached, res, res_size);
+  }
+  else
+  {
+    rc = process_all(arena, cmd, cmdclass, cached, res, res_size);
+  }
+
+  if(cached)
+    dscache_fetch_end(cmd, rc ? NULL : *res, *res_size);
+  else if(cmdclass == DSCMD_WRITE)
+    dscache_invalidate_cmd(cmd);
+
+  // result memory belongs to arena
+  if(rc)
+  {
+    *res = NULL;
+    *res_size = 0;
+  }
+}
+
+
+void free_db_addresses(void)
+{
+  PDB_ADDRESS prev;
+
+  while(g_db_addresses)
+  {
+    dscluster_free(g_db_addresses->cluster);
+    free(g_db_addresses->address);
+    free(g_db_addresses->db);
+
+    prev = g_db_addresses;
+    g_db_addresses = g_db_addresses->next;
+    free(prev);
+  }
+}
+
+
+void parse_db_addresses(const char *saddresses)
+{
+  PDB_ADDRESS pcurr = g_db_addresses;
+  
+  char *_targets = strdup(saddresses);
+  const char *pos = _targets;
+  do
+  {
+    char *s1 = strchr(pos, ',');
+    if(s1)
+      s1[0] = 0;
+
+    char *s2 = strchr(pos, ':');
+    if(!s2 || (s1 && s2 > s1))
+    {
+      dsdie("Bad database string format '%s'", pos);
+    }
+    else
+    {
+      const char *db = pos;
+      const char *address = s2 + 1;
+
+      char *s3 = strchr(address, ':');
+      if(!s3 || (s1 && (s3 > s1)))
+      {
+        dsdie("Bad db string format \"%s\"", pos);
+      }
+      else
+      {
+        const char *port = s3 + 1;
+        int async = 0;
+
+        // optional replication mode follows the port
+        char *s4 = strchr(port, ':');
+        if(s4)
+        {
+          if(!strcmp(s4 + 1, "async"))
+            async = 1;
+          else if(strcmp(s4 + 1, "sync"))
+            dsdie("Bad replication mode \"%s\"", s4 + 1);
+          s4[0] = 0;
+        }
+        
+        s2[0] = 0;
+        s3[0] = 0;
+
+        dstrace("Process on db %s:%s:%d", db, address, atoi(port));
+        if(!pcurr)
+        {
+          pcurr = (PDB_ADDRESS)malloc(sizeof(DB_ADDRESS));
+          g_db_addresses = pcurr;
+        }
+        else
+        {
+          pcurr->next = (PDB_ADDRESS)malloc(sizeof(DB_ADDRESS));
+          pcurr = pcurr->next;
+        }
+
+        pcurr->db = strdup(db);
+        pcurr->address = strdup(address);
+        pcurr->port = atoi(port);
+        pcurr->health = NULL;
+        pcurr->tracker = NULL;
+        pcurr->cluster = NULL;
+        pcurr->journal = NULL;
+        pcurr->async = async;
+        pcurr->queue = NULL;
+        pcurr->index = g_db_count++;
+        pcurr->next = NULL;
+      }
+    }
+    if(s1)
+      pos = s1+1;
+    else
+      pos = NULL;
+  } while(pos);
+
+  free(_targets);
+}
+
+
+// Users given by name or number
+void parse_trusted_uids(const char *users)
+{
+  char *_users = strdup(users);
+  char *save = NULL;
+
+  for(char *user = strtok_r(_users, ",", &save); user; user = strtok_r(NULL, ",", &save))
+  {
+    if(g_trusted_uids_num == TRUSTED_UIDS_MAX)
+      dsdie("More than %d trusted users", TRUSTED_UIDS_MAX);
+
+    char *end = NULL;
+    long uid = strtol(user, &end, 10);
+    if(*end)
+    {
+      struct passwd *pw = getpwnam(user);
+      if(!pw)
+        dsdie("Unknown user %s", user);
+      uid = pw->pw_uid;
+    }
+
+    g_trusted_uids[g_trusted_uids_num++] = (uid_t)uid;
+  }
+
+  free(_users);
+}
+
+
+// Compressed message goes to arena
+int unzip_command(PDSARENA arena, const void **data, int *data_size)
+{
+  int raw_size = dszip_size(*data, *data_size);
+  if(raw_size < 0)
+    return -1;
+
+  if(raw_size > COMMAND_MAX_SIZE)
+  {
+    dslogw("Compressed command of %d bytes is longer than %d", raw_size, COMMAND_MAX_SIZE);
+    return -1;
+  }
+
+  void *buf = dsarena_alloc(arena, raw_size);
+  if(!buf)
+    return -1;
+
+  if(dszip_unpack(g_unzip, *data, *data_size, buf, raw_size))
+    return -1;
+
+  *data = buf;
+  *data_size = raw_size;
+
+  return 0;
+}
+
+
+// return true for correct packet, to mark trustworthy connection
+int try_command(PDSARENA arena, int peer_trusted, const unsigned char *cmdbuf, int cmdbuf_size, const char **cmd, long long *deadline_us, int *priority, int *digest_only, int *accept_zip)
+{
+  *cmd = NULL;
+  *deadline_us = 0;
+  *priority = DSPRIO_INTERACTIVE;
+  *digest_only = 0;
+  *accept_zip = 0;
+
+  // signature covers compressed message
+  int zipped = dszip_frame(cmdbuf, cmdbuf_size);
+  const char *tag = zipped ? DSZIP_TAG : "ds";
+
+  int rc = dspack_complete(tag, cmdbuf, cmdbuf_size);
+  if(!rc)
+  {
+    dstrace("Packet ready");
+
+    // trusted local peer may still sign
+    int options = g_pack_options;
+    if(peer_trusted && !dspack_signed(tag, cmdbuf, cmdbuf_size))
+      options &= ~DSPACK_SIGNED;
+
+    const void *data = NULL;
+    int data_size = 0;
+    long long start_us = dsclock_us();
+    rc = dsunpack(tag, cmdbuf, cmdbuf_size, &data, &data_size, options);
+    if(options & DSPACK_SIGNED)
+      dsstats_verify(rc != 0, dsclock_us() - start_us);
+    if(!rc && zipped)
+      rc = unzip_command(arena, &data, &data_size);
+    
+    if(rc)
+    {
+      dslog("Fail to unpack");
+      dsstats_count(DSSTATS_BAD_PACKETS, 1);
+    }
+    else
+    {
+      dstrace("Pack extracted, data size %d", data_size);
+
+      if(((const char *)data)[data_size - 1] != 0)
+      {
+        dstrace("Incorrect message trailing symbol detected");
+      }
+      else
+      {
+        *cmd = data;
+
+        // time left for the call starts on local monotonic clock
+        long long timeout_ms = dsunpack_timeout(data, data_size);
+        if(timeout_ms)
+          *deadline_us = dsclock_us() + timeout_ms * 1000;
+
+        *priority = dsunpack_priority(data, data_size);
+        *digest_only = dsunpack_digest_only(data, data_size);
+        *accept_zip = g_zip_min && dsunpack_accept_zip(data, data_size);
+      }
+    }
+  } // pack_complete
+  else if(rc < 0)
+  {
+    dstrace("Abnormal packet detected");
+    dsstats_count(DSSTATS_BAD_PACKETS, 1);
+  }
+  else //if(rc > 0)
+  {
+    dstrace("Packet is not complete");
+  }
+  
+  return rc;
+}
+
+
+// Digest of the answer goes back instead of the answer when driver
+// compares it with full one of other server
+int digest_reply(PDSARENA arena, void **buf, int *buf_size)
+{
+  char digest[DSCRYPTO_DIGEST_SIZE];
+
+  if(dscrypto_digest(*buf, *buf_size, digest))
+    return -1;
+
+  return dspack_arena(arena, "digest", digest, sizeof(digest), buf, buf_size, 0);
+}
+
+
+// Answer goes in compressed frame for driver taking it, short answer is
+// stored there as is
+int zip_reply(PDSARENA arena, void *buf, int buf_size, unsigned char **res, int *res_size)
+{
+  void *payload = dsarena_alloc(arena, dszip_bound(buf_size));
+  if(!payload)
+    return -1;
+
+  int payload_size = dszip_pack(g_zip, buf, buf_size, g_zip_min, payload);
+  if(payload_size < 0)
+    return -1;
+
+  return dspack_arena(arena, DSZIP_TAG, payload, payload_size, (void **)res, res_size, 0);
+}
+
+
+void run_command(PDSARENA arena, const char *cmd, long long deadline_us, int digest_only, int accept_zip, unsigned char **res, int *res_size)
+{
+  void *buf = NULL;
+  int buf_size = 0;
+
+  g_deadline_us = deadline_us;
+  dsredis_deadline(deadline_us);
+
+  long long start_us = dsclock_us();
+  process_command(arena, cmd, &buf, &buf_size);
+  if(!service_name(cmd))
+    dsstats_command(dscmd_class(cmd), !buf || !buf_size, dsclock_us() - start_us);
+
+  g_deadline_us = 0;
+  dsredis_deadline(0);
+
+  if(buf && buf_size && digest_only && digest_reply(arena, &buf, &buf_size))
+    return;
+
+  if(buf && buf_size && accept_zip)
+    /*rc = */zip_reply(arena, buf, buf_size, res, res_size);
+  else if(buf && buf_size)
+    /*rc = */dspack_arena(arena, "ds", buf, buf_size, (void **)res, res_size, 0);
+}
+
+
+void release_reply(PDRV_CONNECTION conn)
+{
+  if(conn->reply && --conn->reply->refs == 0)
+    free(conn->reply);
+  conn->reply = NULL;
+}
+
+
+// Daemon own answer, driver takes it as error
+void overloaded_reply(PDRV_CONNECTION conn)
+{
+  void *chunk = NULL;
+  int chunk_size = 0;
+
+  if(!dspack_arena(conn->arena, "dbsyncd", OVERLOADED, sizeof(OVERLOADED), &chunk, &chunk_size, 0))
+    dspack_arena(conn->arena, "ds", chunk, chunk_size, (void **)&conn->connbuf_out, &conn->connbuf_outsize, 0);
+}
+
+
+// Arrival time of data read by recvmsg, kernel stamps it in wall clock
+long long received_time(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  long long now_us = dsclock_us();
+
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      struct timespec stamp, wall;
+      memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+      clock_gettime(CLOCK_REALTIME, &wall);
+
+      long long age_us = (wall.tv_sec - stamp.tv_sec) * 1000000LL + (wall.tv_nsec - stamp.tv_nsec) / 1000;
+      if(age_us > 0)
+        return now_us - age_us;
+    }
+  }
+
+  return now_us;
+}
+
+
+// Commands of one client above limit in the same pass are answered as
+// overloaded at once
+void limit_clients(PDRV_CONNECTION *conns, int conns_num)
+{
+  int i;
+  unsigned int clients[POLL_QUEUE_SIZE * 2];
+  int counts[POLL_QUEUE_SIZE * 2];
+
+  memset(counts, 0, sizeof(counts));
+
+  for(i = g_listen_num; i < conns_num; i++)
+  {
+    PDRV_CONNECTION conn = conns[i];
+    if(!conn->pending || !conn->cmd)
+      continue;
+
+    int slot = (conn->client * 2654435761u) % (POLL_QUEUE_SIZE * 2);
+    while(counts[slot] && clients[slot] != conn->client)
+      slot = (slot + 1) % (POLL_QUEUE_SIZE * 2);
+
+    clients[slot] = conn->client;
+    if(++counts[slot] > g_client_limit && !conn->running)
+    {
+      dstrace("Client of %d has %d commands in queue", conn->sockfd, counts[slot]);
+      conn->shed = 1;
+      g_client_shed++;
+    }
+  }
+}
+
+
+// Nobody waits for answer after deadline, command is dropped
+int command_expired(PDRV_CONNECTION conn)
+{
+  long long now_us = dsclock_us();
+
+  if(!conn->cmd || !conn->deadline_us || now_us < conn->deadline_us)
+    return 0;
+
+  dstrace("Command on %d expired %lld us ago", conn->sockfd, now_us - conn->deadline_us);
+
+  conn->cmd = NULL;
+  g_expired++;
+  if(now_us >= g_expired_reported_us + EXPIRED_REPORT_MS * 1000)
+  {
+    g_expired_reported_us = now_us;
+    dslogw("%lld commands expired before execution", g_expired);
+  }
+
+  return 1;
+}
+
+
+typedef struct _sched_entry {
+  long long finish;
+  int index;
+} SCHED_ENTRY, *PSCHED_ENTRY;
+
+
+int compare_finish(const void *a, const void *b)
+{
+  const SCHED_ENTRY *ea = a, *eb = b;
+
+  if(ea->finish != eb->finish)
+    return ea->finish < eb->finish ? -1 : 1;
+  return ea->index - eb->index;
+}
+
+
+// Followers get a copy of answer, it lives longer than its connection
+void share_reply(PDRV_CONNECTION conn)
+{
+  if(conn->connbuf_out && conn->followers)
+  {
+    conn->reply = (PDRV_REPLY)malloc(sizeof(DRV_REPLY) + conn->connbuf_outsize);
+    if(!conn->reply)
+    {
+      dslogerr(errno, "Cannot allocate shared answer");
+    }
+    else
+    {
+      conn->reply->refs = 1;
+      conn->reply->size = conn->connbuf_outsize;
+      memcpy(conn->reply->data, conn->connbuf_out, conn->connbuf_outsize);
+    }
+  }
+}
+
+
+void run_pending(PDRV_CONNECTION conn)
+{
+  run_command(conn->arena, conn->cmd, conn->deadline_us, conn->digest_only, conn->accept_zip, &conn->connbuf_out, &conn->connbuf_outsize);
+  share_reply(conn);
+}
+
+
+// Lane runs command with its own connections to databases
+void run_lane(void *job, int lane)
+{
+  PDRV_CONNECTION conn = (PDRV_CONNECTION)job;
+
+  g_pool = g_pools[lane];
+  g_zip = g_zips[lane];
+  dsstats_thread(lane + 1);
+  run_pending(conn);
+
+  __atomic_store_n(&conn->done, 1, __ATOMIC_RELEASE);
+}
+
+
+int key_lane(const char *key, int key_len)
+{
+  dscmd_keytag(&key, &key_len);
+  return dshash(key, key_len) % g_lanes_num;
+}
+
+
+// Commands on the same key go to the same lane one after another. Write
+// with unknown keys, without key or touching keys of several lanes runs
+// alone, otherwise databases could apply it in different order with
+// writes of other lanes.
+int command_lane(const char *cmd)
+{
+  DSCMD_KEYITER keys;
+  const char *key;
+  int key_len;
+  int keyspec = dscmd_keys_begin(cmd, &keys);
+  int write = dscmd_class(cmd) == DSCMD_WRITE;
+
+  if(keyspec == DSCMD_KEY_UNKNOWN || keyspec == DSCMD_KEY_NONE || dscmd_keys_next(&keys, &key, &key_len))
+    return write ? LANE_BARRIER : 0;
+
+  int lane = key_lane(key, key_len);
+  if(!write)
+    return lane;
+
+  while(!dscmd_keys_next(&keys, &key, &key_len))
+    if(key_lane(key, key_len) != lane)
+      return LANE_BARRIER;
+
+  return lane;
+}
+
+
+void complete_pending(struct pollfd *pollfd, PDRV_CONNECTION conn)
+{
+  if(conn->connbuf_out)
+    dstrace("Command is processed, poll to send an answer");
+  else
+    dstrace("Command is processed, nothing to send");
+
+  // connection without answer is closed at the next poll
+  conn->pending = 0;
+  conn->shed = 0;
+  conn->leader = NULL;
+  conn->followers = 0;
+  pollfd->events = POLLOUT;
+  conn->connbuf_outptr = conn->connbuf_out;
+  conn->connbuf_insize = 0; // reset for safety
+}
+
+
+// Connection waiting for the same command takes the answer of its leader
+void follow_leader(struct pollfd *pollfd, PDRV_CONNECTION conn)
+{
+  conn->reply = conn->leader->reply;
+  if(conn->reply)
+  {
+    conn->reply->refs++;
+    conn->connbuf_out = conn->reply->data;
+    conn->connbuf_outsize = conn->reply->size;
+  }
+
+  complete_pending(pollfd, conn);
+}
+
+
+// Commands received during the poll pass are executed after it. Identical
+// read commands are run once and the answer is shared by all their
+// connections. Every command goes to the same targets, so the command bytes
+// with the form of answer are the whole key.
+//
+// Commands run in order of their fair queuing tags. Those left when the
+// pass took its time slice stay pending, so commands arriving meanwhile
+// may get ahead of them. Returns number of such commands.
+//
+// With several lanes command is given to idle lane of its key, command for
+// busy lane waits till the lane finishes.
+int process_pending(struct pollfd *pollfds, PDRV_CONNECTION *conns, int conns_num)
+{
+  int i, j;
+  int leaders[POLL_QUEUE_SIZE];
+  int leaders_num = 0;
+  SCHED_ENTRY order[POLL_QUEUE_SIZE];
+  int order_num = 0;
+  int deferred = 0;
+
+  if(g_lanes_num > 1)
+  {
+    dslane_drain();
+
+    for(i = g_listen_num; i < conns_num; i++)
+    {
+      PDRV_CONNECTION conn = conns[i];
+      if(!conn->running || !__atomic_load_n(&conn->done, __ATOMIC_ACQUIRE))
+        continue;
+
+      conn->running = 0;
+      conn->done = 0;
+      if(conn->lane == LANE_BARRIER)
+        g_barrier = 0;
+
+      // followers waited for the lane with their leader
+      int followers = conn->followers;
+      for(j = g_listen_num; followers && j < conns_num; j++)
+      {
+        if(conns[j]->pending && conns[j]->leader == conn)
+        {
+          follow_leader(&pollfds[j], conns[j]);
+          followers--;
+        }
+      }
+
+      complete_pending(&pollfds[i], conn);
+    }
+  }
+
+  if(g_client_limit)
+    limit_clients(conns, conns_num);
+
+  for(i = g_listen_num; i < conns_num; i++)
+  {
+    PDRV_CONNECTION conn = conns[i];
+    if(!conn->pending || conn->running || (conn->leader && conn->leader->running))
+      continue;
+
+    conn->leader = NULL;
+    conn->followers = 0;
+
+    if(conn->shed || command_expired(conn) || !conn->cmd || dscmd_class(conn->cmd) != DSCMD_READ)
+      continue;
+
+    conn->hash = dshash(conn->cmd, strlen(conn->cmd));
+    for(j = 0; j < leaders_num; j++)
+    {
+      PDRV_CONNECTION leader = conns[leaders[j]];
+      if(leader->hash == conn->hash && leader->digest_only == conn->digest_only && leader->accept_zip == conn->accept_zip && !strcmp(leader->cmd, conn->cmd))
+      {
+        dstrace("Connection %d waits for the same command on %d", conn->sockfd, leader->sockfd);
+        conn->leader = leader;
+        leader->followers++;
+
+        // leader runs while any of the connections waits, as soon as any
+        // of them needs
+        if(leader->deadline_us && (!conn->deadline_us || conn->deadline_us > leader->deadline_us))
+          leader->deadline_us = conn->deadline_us;
+        if(conn->priority < leader->priority)
+          leader->priority = conn->priority;
+        break;
+      }
+    }
+
+    if(!conn->leader)
+      leaders[leaders_num++] = i;
+  }
+
+  for(i = g_listen_num; i < conns_num; i++)
+  {
+    PDRV_CONNECTION conn = conns[i];
+    if(!conn->pending || conn->leader || conn->running)
+      continue;
+
+    if(conn->cmd && !conn->shed && !conn->finish)
+      conn->finish = dssched_tag(conn->priority);
+
+    order[order_num].finish = conn->finish;
+    order[order_num].index = i;
+    order_num++;
+  }
+
+  qsort(order, order_num, sizeof(SCHED_ENTRY), compare_finish);
+
+  long long slice_end_us = dsclock_us() + SCHED_SLICE_MS * 1000;
+  int blocked = g_barrier; // nothing goes ahead of command waiting to run alone
+  for(j = 0; j < order_num; j++)
+  {
+    i = order[j].index;
+    PDRV_CONNECTION conn = conns[i];
+
+    if(conn->cmd && !command_expired(conn))
+    {
+      // service command runs in main loop, it is neither queued nor shed
+      int service = service_name(conn->cmd) != NULL;
+      int lane = 0;
+      if(!conn->shed && !service && g_lanes_num > 1)
+      {
+        lane = command_lane(conn->cmd);
+        if(blocked || (lane == LANE_BARRIER ? !dslane_idle() : dslane_busy(lane)))
+        {
+          if(lane == LANE_BARRIER)
+            blocked = 1;
+          dssched_defer();
+          continue;
+        }
+      }
+      else if(!conn->shed && !service && dsclock_us() >= slice_end_us)
+      {
+        dssched_defer();
+        deferred++;
+        continue;
+      }
+
+      long long now_us = dsclock_us();
+      if(!service)
+        dsstats_queue(now_us - conn->received_us);
+      if(!conn->shed && !service && g_codel && dscodel_drop(now_us - conn->received_us, now_us))
+        conn->shed = 1;
+
+      if(conn->finish && !conn->shed)
+        dssched_start(conn->priority, conn->finish);
+      conn->finish = 0;
+
+      if(conn->shed)
+      {
+        overloaded_reply(conn);
+        share_reply(conn);
+      }
+      else if(g_lanes_num > 1 && !service)
+      {
+        conn->lane = lane;
+        conn->running = 1;
+        if(lane == LANE_BARRIER)
+        {
+          g_barrier = 1;
+          blocked = 1;
+          lane = 0;
+        }
+
+        dslane_push(lane, conn);
+        continue;
+      }
+      else
+        run_pending(conn);
+    }
+
+    complete_pending(&pollfds[i], conn);
+  }
+
+  // followers of leaders left for the next pass or running wait with them
+  for(i = g_listen_num; i < conns_num; i++)
+  {
+    PDRV_CONNECTION conn = conns[i];
+    if(!conn->pending || !conn->leader || conn->leader->pending)
+      continue;
+
+    follow_leader(&pollfds[i], conn);
+  }
+
+  return deferred;
+}
+
+
+// Local socket is open to everybody as TCP one is, unsigned commands are
+// taken from trusted users only
+int listen_unix(const char *path)
+{
+  struct sockaddr_un serv_addr;
+
+  if(strlen(path) >= sizeof(serv_addr.sun_path))
+    dsdie("Socket path %s is too long", path);
+
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(listenfd < 0)
+    dsdierr(errno, "Fail to create local listening socket");
+
+  bzero((char *) &serv_addr, sizeof(serv_addr));
+  serv_addr.sun_family = AF_UNIX;
+  strcpy(serv_addr.sun_path, path);
+
+  // socket left by previous run
+  unlink(path);
+
+  if(bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    dsdierr(errno, "Binding to %s failed", path);
+
+  if(chmod(path, 0666) < 0)
+    dslogerr(errno, "Cannot open %s to other users", path);
+
+  if(listen(listenfd, LISTEN_BACKLOG_SIZE) < 0)
+    dsdierr(errno, "Failed to mark connection being listen");
+
+  return listenfd;
+}
+
+
+// Admin port takes service commands only, they come unsigned from the host
+int listen_admin(int port)
+{
+  struct sockaddr_in serv_addr;
+  int on = 1;
+
+  int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(listenfd < 0)
+    dsdierr(errno, "Fail to create admin listening socket");
+
+  if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+    dsdierr(errno, "Set socket being reusable failed");
+
+  bzero((char *) &serv_addr, sizeof(serv_addr));
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_port = htons(port);
+  inet_pton(AF_INET, ADMIN_ADDRESS, &serv_addr.sin_addr);
+
+  if(bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    dsdierr(errno, "Binding to admin port %d failed", port);
+
+  if(listen(listenfd, LISTEN_BACKLOG_SIZE) < 0)
+    dsdierr(errno, "Failed to mark connection being listen");
+
+  return listenfd;
+}
+
+
+// Client of local peer is its process
+void accept_peer(PDRV_CONNECTION conn, struct sockaddr_storage *peer)
+{
+  conn->peer_trusted = 0;
+  conn->local = peer->ss_family == AF_UNIX;
+
+  if(peer->ss_family == AF_INET)
+  {
+    conn->client = ((struct sockaddr_in *)peer)->sin_addr.s_addr;
+    return;
+  }
+
+  struct ucred cred;
+  socklen_t cred_size = sizeof(cred);
+  if(getsockopt(conn->sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size))
+  {
+    dslogerr(errno, "Cannot get credentials of local peer");
+    conn->client = 0;
+    return;
+  }
+
+  conn->client = cred.pid;
+  for(int i = 0; i < g_trusted_uids_num; i++)
+    if(cred.uid == g_trusted_uids[i])
+      conn->peer_trusted = 1;
+
+  dstrace("Local peer pid %d uid %d is %s", cred.pid, cred.uid, conn->peer_trusted ? "trusted" : "not trusted");
+}
+
+
+// Descriptors passed by local peer, ones above fds_max are closed
+int received_fds(struct msghdr *msg, int *fds, int fds_max)
+{
+  struct cmsghdr *cmsg;
+  int fds_num = 0;
+
+  for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for(int j = 0; j < n; j++)
+    {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + j * sizeof(int), sizeof(int));
+      if(fds_num < fds_max)
+        fds[fds_num++] = fd;
+      else
+        close(fd);
+    }
+  }
+
+  return fds_num;
+}
+
+
+// Local driver registers its rings with the first frame and gets the same
+// frame back. Connections closed after each command do not take rings.
+int attach_ring(PDRV_CONNECTION conn, struct msghdr *msg, const void *data, int data_size)
+{
+  int fds[DSRING_FDS];
+  int fds_num = received_fds(msg, fds, DSRING_FDS);
+
+  if(!conn->local || !g_keepalive || fds_num != DSRING_FDS || dspack_complete(DSRING_TAG, data, data_size))
+  {
+    dslogw("Ring registration of client %u is refused", conn->client);
+    for(int j = 0; j < fds_num; j++)
+      close(fds[j]);
+    return -1;
+  }
+
+  conn->ring = dsring_attach(fds);
+  if(!conn->ring)
+    return -1;
+
+  if(send(conn->sockfd, data, data_size, 0) != data_size)
+  {
+    dslogerr(errno, "Cannot confirm ring registration");
+    dsring_free(conn->ring);
+    conn->ring = NULL;
+    return -1;
   }
-#endif
 
-  int rc;
-  *res = NULL;
-  *res_size = 0;
+  dstrace("Client %u talks over ring", conn->client);
+  return 0;
+}
 
-  dstrace("Processing command: %s", cmd);
 
-  // Loop through targets
-  PDB_ADDRESS db_address = g_db_addresses;
-  rc = 0; // all databases should have successful result
-  while(!rc && db_address)
-  {
-    dstrace("Process on db %s:%s:%d", db_address->db, db_address->address, db_address->port);
+// Main loop calls go to io_uring engine while it runs, socket calls of both
+// engines are counted to compare them
+int loop_wait(struct pollfd *pollfds, int nfds, int timeout_ms)
+{
+  if(g_uring)
+    return dsuring_poll(pollfds, nfds, timeout_ms);
+
+  g_loop_syscalls++;
+  return poll(pollfds, nfds, timeout_ms);
+}
 
-    unsigned char *dbres = NULL;
-    int dbres_size = 0;
 
-    if(!strcmp(db_address->db, "redis"))
-      rc = dsredis(db_address->address, db_address->port, cmd, &dbres, &dbres_size);
+// With spinning the loop polls without blocking for g_spin_us after the last
+// event before it sleeps, so the next command close behind is taken without
+// wakeup
+int loop_poll(struct pollfd *pollfds, int nfds, int timeout_ms)
+{
+  int rc;
 
-    void *chunk = NULL;
-    int chunk_size = 0;
-    if(!rc && dbres_size > 0)
-      rc = dspack(db_address->db, dbres, dbres_size, &chunk, &chunk_size, 0);
+  if(g_spin_us && timeout_ms)
+  {
+    long long start_us = dsclock_us();
+    long long now_us = start_us;
 
-    if(!rc && chunk_size > 0)
+    while(now_us < g_loop_active_us + g_spin_us)
     {
-      dstrace("Add chunk of size %d to %d result", chunk_size, *res_size);
-      *res = realloc(*res, *res_size + chunk_size);
-      if(*res)
+      rc = loop_wait(pollfds, nfds, 0);
+      now_us = dsclock_us();
+      if(rc)
       {
-        memcpy(*res + *res_size, chunk, chunk_size);
-        *res_size += chunk_size;
+        g_loop_spin_us += now_us - start_us;
+        if(rc > 0)
+        {
+          g_loop_spin_hits++;
+          g_loop_active_us = now_us;
+        }
+        return rc;
       }
-      else
-        dslogerr(errno, "Result reallocation for new chunk failed");
     }
-    if(chunk)
-      free(chunk);
-    if(dbres)
-      free(dbres);
 
-    db_address = db_address->next;
+    g_loop_spin_us += now_us - start_us;
   }
 
-  if(rc && *res)
+  rc = loop_wait(pollfds, nfds, timeout_ms);
+  if(rc > 0 && g_spin_us)
   {
-    free(*res);
-    *res = NULL;
-    *res_size = 0;
+    if(timeout_ms)
+      g_loop_wakeups++;
+    g_loop_active_us = dsclock_us();
   }
+
+  return rc;
 }
 
 
-void free_db_addresses(void)
+int loop_accept(int fd, struct sockaddr_storage *peer, socklen_t *peer_size)
 {
-  PDB_ADDRESS prev;
+  if(g_uring)
+    return dsuring_accept(fd, (struct sockaddr *)peer, peer_size);
 
-  while(g_db_addresses)
-  {
-    free(g_db_addresses->address);
-    free(g_db_addresses->db);
+  g_loop_syscalls++;
+  return accept4(fd, (struct sockaddr *)peer, peer_size, SOCK_NONBLOCK);
+}
 
-    prev = g_db_addresses;
-    g_db_addresses = g_db_addresses->next;
-    free(prev);
-  }
+
+// TCP connections are received and answered by io_uring, local ones keep
+// recvmsg to get descriptors
+int loop_streamed(PDRV_CONNECTION conn)
+{
+  return g_uring && !conn->local;
 }
 
 
-void parse_db_addresses(const char *saddresses)
+// Descriptors are forgotten by io_uring before they are closed
+void loop_forget(struct pollfd *pollfd, PDRV_CONNECTION conn)
 {
-  PDB_ADDRESS pcurr = g_db_addresses;
-  
-  char *_targets = strdup(saddresses);
-  const char *pos = _targets;
-  do
-  {
-    char *s1 = strchr(pos, ',');
-    if(s1)
-      s1[0] = 0;
+  if(!g_uring)
+    return;
 
-    char *s2 = strchr(pos, ':');
-    if(!s2 || (s1 && s2 > s1))
-    {
-      dsdie("Bad database string format '%s'", pos);
-    }
-    else
-    {
-      const char *db = pos;
-      const char *address = s2 + 1;
+  dsuring_forget(pollfd->fd);
+  if(pollfd->fd != conn->sockfd)
+    dsuring_forget(conn->sockfd);
+}
 
-      char *s3 = strchr(address, ':');
-      if(!s3 || (s1 && (s3 > s1)))
-      {
-        dsdie("Bad db string format \"%s\"", pos);
-      }
-      else
-      {
-        const char *port = s3 + 1;
-        
-        s2[0] = 0;
-        s3[0] = 0;
 
-        dstrace("Process on db %s:%s:%d", db, address, atoi(port));
-        if(!pcurr)
-        {
-          pcurr = (PDB_ADDRESS)malloc(sizeof(DB_ADDRESS));
-          g_db_addresses = pcurr;
-        }
-        else
-        {
-          pcurr->next = (PDB_ADDRESS)malloc(sizeof(DB_ADDRESS));
-          pcurr = pcurr->next;
-        }
+void report_loop(void)
+{
+  long long now_us = dsclock_us();
 
-        pcurr->db = strdup(db);
-        pcurr->address = strdup(address);
-        pcurr->port = atoi(port);
-        pcurr->next = NULL;
-      }
-    }
-    if(s1)
-      pos = s1+1;
-    else
-      pos = NULL;
-  } while(pos);
+  if(now_us < g_loop_reported_us + LOOP_REPORT_MS * 1000)
+    return;
 
-  free(_targets);
+  long long syscalls = g_loop_syscalls;
+  if(g_uring)
+  {
+    DSURING_STATS stats;
+    dsuring_stats(&stats);
+    syscalls += stats.syscalls;
+  }
+
+  long long commands = g_loop_commands - g_loop_reported_commands;
+  if(commands)
+    dslog("Main loop on %s made %.2f socket calls per command, %lld commands", g_uring ? "io_uring" : "poll",
+          (double)(syscalls - g_loop_reported_syscalls) / commands, commands);
+
+  if(g_spin_us && commands)
+    dslog("Main loop spun %lld us, found %lld events spinning and %lld after sleep",
+          g_loop_spin_us - g_loop_reported_spin_us, g_loop_spin_hits - g_loop_reported_spin_hits,
+          g_loop_wakeups - g_loop_reported_wakeups);
+
+  g_loop_reported_us = now_us;
+  g_loop_reported_syscalls = syscalls;
+  g_loop_reported_commands = g_loop_commands;
+  g_loop_reported_spin_us = g_loop_spin_us;
+  g_loop_reported_spin_hits = g_loop_spin_hits;
+  g_loop_reported_wakeups = g_loop_wakeups;
 }
 
 
-// return true for correct packet, to mark trustworthy connection
-int try_command(const unsigned char *cmdbuf, int cmdbuf_size, unsigned char **res, int *res_size)
+// Spin option is spin_us[,busy_poll_us[,cpu]]
+void parse_spin(const char *spin)
 {
-  int rc = dspack_complete("ds", cmdbuf, cmdbuf_size);
-  if(!rc)
-  {
-    dstrace("Packet ready");
+  g_spin_us = atoi(spin);
+  if(g_spin_us < 0)
+    dsdie("Bad spin time %s", spin);
 
-    const void *data = NULL;
-    int data_size = 0;
-    rc = dsunpack("ds", cmdbuf, cmdbuf_size, &data, &data_size, g_pack_options);
-    
-    if(rc)
-    {
-      dslog("Fail to unpack");
-    }
-    else
-    {
-      void *buf = NULL;
-      int buf_size = 0;
+  const char *busy_poll = strchr(spin, ',');
+  if(!busy_poll)
+    return;
 
-      dstrace("Pack extracted, data size %d", data_size);
+  g_busy_poll_us = atoi(busy_poll + 1);
+  if(g_busy_poll_us < 0)
+    dsdie("Bad busy poll time %s", busy_poll + 1);
 
-      if(((const char *)data)[data_size - 1] != 0)
-        dstrace("Incorrect message trailing symbol detected");
-      else
-        process_command(data, &buf, &buf_size);
-      
-      if(res && res_size && buf && buf_size)
-        /*rc = */dspack("ds", buf, buf_size, (void **)res, res_size, 0);
-      
-      if(buf)
-        free(buf);
-    }
-  } // pack_complete
-  else if(rc < 0)
+  const char *cpu = strchr(busy_poll + 1, ',');
+  if(cpu)
   {
-    dstrace("Abnormal packet detected");
-  }
-  else //if(rc > 0)
-  {
-    dstrace("Packet is not complete");
+    g_loop_cpu = atoi(cpu + 1);
+    if(g_loop_cpu < 0 || g_loop_cpu >= CPU_SETSIZE)
+      dsdie("Bad CPU %s", cpu + 1);
   }
-  
-  return rc;
 }
 
 
+// Threads started before keep their CPUs, later ones inherit this one
+void pin_loop(void)
+{
+  if(g_loop_cpu < 0)
+    return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(g_loop_cpu, &cpus);
+  if(sched_setaffinity(0, sizeof(cpus), &cpus))
+    dslogerr(errno, "Cannot pin main loop to CPU %d", g_loop_cpu);
+  else
+    dslog("Main loop is pinned to CPU %d", g_loop_cpu);
+}
+
 
 void process_conns(const char *address, int port)
 {
@@ -275,10 +2062,23 @@ void process_conns(const char *address, int port)
       dsdierr(errno, "Cannot allocate context for incoming data");
     conns[i]->sockfd = -1;
     conns[i]->trusted = 0;
+    conns[i]->peer_trusted = 0;
+    conns[i]->local = 0;
+    conns[i]->ring = NULL;
     conns[i]->connbuf_insize = 0;
     conns[i]->connbuf_outsize = 0;
     conns[i]->connbuf_out = NULL;
     conns[i]->connbuf_outptr = NULL;
+    conns[i]->pending = 0;
+    conns[i]->deadline_us = 0;
+    conns[i]->finish = 0;
+    conns[i]->running = 0;
+    conns[i]->done = 0;
+    conns[i]->leader = NULL;
+    conns[i]->reply = NULL;
+    conns[i]->arena = dsarena_create(DSARENA_CHUNK_SIZE);
+    if(!conns[i]->arena)
+      dsdie("Cannot allocate command arena");
   }
 
   // Listen socket init
@@ -309,20 +2109,63 @@ void process_conns(const char *address, int port)
   if (rc < 0)
     dsdierr(errno, "Failed to mark connection being listen");
   
-  // Polling init
-  struct pollfd pollfds[POLL_QUEUE_SIZE];
+  // Polling init, the last one wakes loop when lane finished command
+  struct pollfd pollfds[POLL_QUEUE_SIZE + 1];
   bzero((char *) &pollfds, sizeof(pollfds));
   
   pollfds[0].fd = listenfd;
   pollfds[0].events = POLLIN;
+
+  if(g_unix_path)
+  {
+    pollfds[1].fd = listen_unix(g_unix_path);
+    pollfds[1].events = POLLIN;
+    g_listen_num = 2;
+  }
+
+  if(g_admin_port)
+  {
+    g_admin_fd = listen_admin(g_admin_port);
+    pollfds[g_listen_num].fd = g_admin_fd;
+    pollfds[g_listen_num].events = POLLIN;
+    g_listen_num++;
+  }
+
+  if(g_uring && dsuring_init(DSURING_ENTRIES))
+  {
+    dslogw("Main loop falls back to poll");
+    g_uring = 0;
+  }
+
+  for(i = 0; g_uring && i < g_listen_num; i++)
+    if(dsuring_listen(pollfds[i].fd))
+      dsdie("Cannot accept connections by io_uring");
+  if(g_uring)
+    dslog("Main loop runs on io_uring");
+  if(g_spin_us)
+    dslog("Main loop spins %d us after activity", g_spin_us);
+  pin_loop();
+  dsstats_thread(0);
+  g_started_us = dsclock_us();
   
   // Accept&Process loop
-  int conns_num = 1;
+  int conns_num = g_listen_num;
+  int deferred = 0;
   g_service_working = 1;
   while(g_service_working)
   {
+    dscache_poll();
+
     clock_t start = times(NULL);
-    rc = poll(pollfds, conns_num, POLL_TIMEOUT_MS);
+    int wake = g_lanes_num > 1;
+    if(wake)
+    {
+      pollfds[conns_num].fd = dslane_fd();
+      pollfds[conns_num].events = POLLIN;
+      pollfds[conns_num].revents = 0;
+    }
+
+    rc = loop_poll(pollfds, conns_num + wake, deferred ? 0 : POLL_TIMEOUT_MS);
     if (rc < 0)
     {
       dslogerr(errno, "Poll call failed");
@@ -335,7 +2178,7 @@ void process_conns(const char *address, int port)
     for(i = 0; i < conns_num; i++)
     {
       // accept new connection
-      if(pollfds[i].fd == listenfd)
+      if(i < g_listen_num)
       {
         if(pollfds[i].revents == 0)
           continue;
@@ -348,7 +2191,11 @@ void process_conns(const char *address, int port)
 
         int newfd;
         do {
-          newfd = accept(listenfd, NULL, NULL);
+          struct sockaddr_storage peer;
+          socklen_t peer_size = sizeof(peer);
+          memset(&peer, 0, sizeof(peer));
+
+          newfd = loop_accept(pollfds[i].fd, &peer, &peer_size);
 
           if(newfd < 0)
           {
@@ -367,21 +2214,36 @@ void process_conns(const char *address, int port)
             }
             else
             {
-              rc = fcntl(newfd, F_GETFL, 0);
-              if(rc >= 0)
-                rc = fcntl(newfd, F_SETFL, rc | O_NONBLOCK);
-              if(rc < 0)
+              if(g_uring && peer.ss_family != AF_UNIX && dsuring_stream(newfd))
               {
                 close(newfd);
-                dslogerr(errno, "Failed to set new connection to non-blocking mode");
+                dslog("Drop connection not received by io_uring");
               }
               else
               {
+                // kernel stamps arrival of requests for queue delay
+                int on = 1;
+                if(g_codel && setsockopt(newfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+                  dslogerr(errno, "Cannot enable receive timestamps");
+
+                // raising it above net.core.busy_read needs CAP_NET_ADMIN
+                if(g_busy_poll_us && peer.ss_family != AF_UNIX &&
+                   setsockopt(newfd, SOL_SOCKET, SO_BUSY_POLL, &g_busy_poll_us, sizeof(g_busy_poll_us)))
+                {
+                  dslogerr(errno, "Cannot enable busy poll, it is off from now");
+                  g_busy_poll_us = 0;
+                }
+
                 pollfds[conns_num].fd = newfd;
                 pollfds[conns_num].events = POLLIN;
                 pollfds[conns_num].revents = 0;
                 conns[conns_num]->sockfd = newfd;
                 conns[conns_num]->connbuf_insize = 0;
+                accept_peer(conns[conns_num], &peer);
+                conns[conns_num]->admin = pollfds[i].fd == g_admin_fd;
+                if(conns[conns_num]->admin)
+                  conns[conns_num]->peer_trusted = 1;
+                dsstats_count(DSSTATS_ACCEPTED, 1);
                 conns[conns_num]->conn_timeout_ms = CONNECTION_TIMEOUT_MS + gap_ms; // gap_ms will be decremented 
                 conns_num++;
               }
@@ -397,16 +2259,76 @@ void process_conns(const char *address, int port)
         conns[i]->conn_timeout_ms -= gap_ms;
         dstrace("Connection %d have %d ms till timeout", pollfds[i].fd, conns[i]->conn_timeout_ms);
 
-        if(pollfds[i].revents & POLLIN)
+        // ring wakes its eventfd both for the next command and for room
+        // to write the answer
+        int revents = pollfds[i].revents;
+        if(conns[i]->ring && (revents & POLLIN))
+        {
+          dsring_drain(conns[i]->ring);
+          if(conns[i]->connbuf_outptr)
+            revents = POLLOUT;
+        }
+
+        if(revents & POLLIN)
         {
           dstrace("Incoming event on %d", pollfds[i].fd);
 
           do {
-            rc = recv(pollfds[i].fd, buffer, sizeof(buffer), 0);
+            struct iovec iov = { buffer, sizeof(buffer) };
+            char control[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(DSRING_FDS * sizeof(int))];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if(conns[i]->ring)
+            {
+              msg.msg_controllen = 0;
+              rc = dsring_recv(conns[i]->ring, buffer, sizeof(buffer));
+            }
+            else if(loop_streamed(conns[i]))
+            {
+              msg.msg_controllen = 0;
+              rc = dsuring_recv(pollfds[i].fd, buffer, sizeof(buffer));
+            }
+            else
+            {
+              g_loop_syscalls++;
+              rc = recvmsg(pollfds[i].fd, &msg, MSG_CMSG_CLOEXEC);
+            }
+
+            /* RING REGISTERED */
+            if(rc > 0 && conns[i]->local && !conns[i]->ring && !conns[i]->connbuf_insize && dsring_frame(buffer, rc))
+            {
+              if(attach_ring(conns[i], &msg, buffer, rc))
+              {
+                close_conn = 1;
+                close_force = 1;
+              }
+              else
+              {
+                pollfds[i].fd = dsring_fd(conns[i]->ring);
+                conns[i]->conn_timeout_ms = CONNECTION_TIMEOUT_MS;
+              }
+              break;
+            }
+
             /* DATA RECEIVED */
             if(rc > 0)
             {
               dstrace("Received %d bytes", rc);
+              dsstats_count(DSSTATS_BYTES_IN, rc);
+
+              // descriptors are taken with ring registration only
+              int fds[DSRING_FDS];
+              int fds_num = conns[i]->local && !conns[i]->ring ? received_fds(&msg, fds, DSRING_FDS) : 0;
+              while(fds_num)
+                close(fds[--fds_num]);
+
+              if(!conns[i]->connbuf_insize)
+                conns[i]->received_us = received_time(&msg);
 
               int size = rc;
               if(size > READ_BUFFER_SIZE - conns[i]->connbuf_insize - 1)
@@ -436,22 +2358,21 @@ void process_conns(const char *address, int port)
             /* UPCOMING DATA or DONE */
             else if(rc < 0 && errno == EWOULDBLOCK)
             {
-              int rc1 = try_command(conns[i]->connbuf_in, conns[i]->connbuf_insize, &conns[i]->connbuf_out, &conns[i]->connbuf_outsize);
-              if(!rc1)
+              int rc1 = try_command(conns[i]->arena, conns[i]->peer_trusted, conns[i]->connbuf_in, conns[i]->connbuf_insize, &conns[i]->cmd, &conns[i]->deadline_us, &conns[i]->priority, &conns[i]->digest_only, &conns[i]->accept_zip);
+              if(!rc1 && conns[i]->admin && conns[i]->cmd && !service_name(conns[i]->cmd))
+              {
+                dslogw("Database command on admin port is refused");
+                dsstats_count(DSSTATS_BAD_PACKETS, 1);
+                close_conn = 1;
+                close_force = 1;
+              }
+              else if(!rc1)
               {
+                dstrace("Command is queued for execution");
+                g_loop_commands++;
                 conns[i]->trusted = 1;
-                if(!conns[i]->connbuf_out)
-                {
-                  dstrace("Command is processed, nothing to send, closing connection");
-                  close_conn = 1;
-                }
-                else
-                {
-                  dstrace("Command is processed, poll to send an answer");
-                  pollfds[i].events = POLLOUT;
-                  conns[i]->connbuf_outptr = conns[i]->connbuf_out;
-                  conns[i]->connbuf_insize = 0; // reset for safety
-                }
+                conns[i]->pending = 1;
+                pollfds[i].events = 0;
               }
               else if(rc1 > 0)
               {
@@ -476,15 +2397,29 @@ void process_conns(const char *address, int port)
           } while(rc > 0);
         } // POLLIN
 
-        else if(pollfds[i].revents & POLLOUT)
+        else if(revents & POLLOUT)
         {
           dstrace("Outgoing event on %d", pollfds[i].fd);
-          do {
-            rc = send(pollfds[i].fd, conns[i]->connbuf_outptr, conns[i]->connbuf_outsize, 0);
+          if(!conns[i]->connbuf_out)
+          {
+            dstrace("Nothing to send, closing connection");
+            close_conn = 1;
+          }
+          else do {
+            if(conns[i]->ring)
+              rc = dsring_send(conns[i]->ring, conns[i]->connbuf_outptr, conns[i]->connbuf_outsize);
+            else if(loop_streamed(conns[i]))
+              rc = dsuring_send(pollfds[i].fd, conns[i]->connbuf_outptr, conns[i]->connbuf_outsize);
+            else
+            {
+              g_loop_syscalls++;
+              rc = send(pollfds[i].fd, conns[i]->connbuf_outptr, conns[i]->connbuf_outsize, 0);
+            }
             /* DATA block sent */
             if(rc > 0)
             {
               dstrace("Sent %d bytes of answer", rc);
+              dsstats_count(DSSTATS_BYTES_OUT, rc);
               
               conns[i]->connbuf_outptr += rc;
               conns[i]->connbuf_outsize -= rc;
@@ -501,6 +2436,10 @@ void process_conns(const char *address, int port)
             else if (rc < 0 && errno == EWOULDBLOCK && conns[i]->connbuf_outsize > 0)
             {
               dstrace("Continue to poll %d with outgoing data", pollfds[i].fd);
+
+              // eventfd is always writable, driver wakes it once it frees room
+              if(conns[i]->ring)
+                pollfds[i].events = POLLIN;
             }
             else
             {
@@ -515,9 +2454,10 @@ void process_conns(const char *address, int port)
           } while(rc > 0);
         } // POLLOUT
 
-        if(conns[i]->conn_timeout_ms <= 0)
+        if(conns[i]->conn_timeout_ms <= 0 && !conns[i]->running)
         {
           dslogw("Connection %d timeout", pollfds[i].fd);
+          dsstats_count(DSSTATS_TIMEOUTS, 1);
           close_conn = 1;
           close_force = 1;
         }
@@ -526,8 +2466,12 @@ void process_conns(const char *address, int port)
         {
           dstrace("Cleanup connection context %d", pollfds[i].fd);
 
-          if(conns[i]->connbuf_out)
-            free(conns[i]->connbuf_out);
+          // answer buffer and everything built for it goes at once
+          dsarena_reset(conns[i]->arena);
+          release_reply(conns[i]);
+          conns[i]->pending = 0;
+          conns[i]->finish = 0;
+          conns[i]->leader = NULL;
 
           conns[i]->connbuf_insize = 0;
           conns[i]->connbuf_outsize = 0;
@@ -539,13 +2483,19 @@ void process_conns(const char *address, int port)
           {
             dstrace("Close connection %d", pollfds[i].fd);
 
-            close(pollfds[i].fd);
+            loop_forget(&pollfds[i], conns[i]);
+            dsstats_count(DSSTATS_CLOSED, 1);
+            dsring_free(conns[i]->ring);
+            conns[i]->ring = NULL;
+            dsarena_release(conns[i]->arena);
+            close(conns[i]->sockfd);
             conns[i]->sockfd = -1;
 
             if(i < conns_num-1)
             {
               // switch with latest in pool
               pollfds[i].fd = pollfds[conns_num-1].fd;
+              pollfds[i].events = pollfds[conns_num-1].events;
               pollfds[i].revents = pollfds[conns_num-1].revents;
 
               PDRV_CONNECTION ptr = conns[i];
@@ -563,14 +2513,31 @@ void process_conns(const char *address, int port)
         }
       } // not listenfd
     } // for conns_num
+
+    deferred = process_pending(pollfds, conns, conns_num);
+    report_loop();
   } // while(1)
 
+  if(g_uring)
+    dsuring_release();
+
   close(listenfd);
+  if(g_unix_path)
+  {
+    close(pollfds[1].fd);
+    unlink(g_unix_path);
+  }
+  if(g_admin_fd >= 0)
+    close(g_admin_fd);
+
   for(i = 0; i < POLL_QUEUE_SIZE; i++)
+  {
+    dsarena_destroy(conns[i]->arena);
     free(conns[i]);
+  }
 }
 
-// Usage ./dbsyncd [-b 127.0.0.1] [-p 1111] [-s public_key_path] [-d db_addresses] [-c]
+// Usage ./dbsyncd [-b 127.0.0.1] [-p 1111] [-s public_key_path] [-d db_addresses] [-c] [-r] [-h] [-m cache_mb] [-k cached_commands] [-j journal_dir] [-o fail|skip] [-q target_ms[,interval_ms]] [-l client_commands] [-w weights] [-n lanes] [-v] [-z zip_min_bytes] [-u unix_socket_path] [-t uid[,uid]] [-i] [-y spin_us[,busy_poll_us[,cpu]]] [-a admin_port]
 int main(int argc, char *argv[])
 {
   openlog("dbsyncd", LOG_PID, LOG_DAEMON);
@@ -579,9 +2546,12 @@ int main(int argc, char *argv[])
   
   char *listen_address = "127.0.0.1";
   char *listen_port = "1111";
+  long long cache_mb = 0;
+  char *cache_commands = CACHE_COMMANDS;
+  char *journal_dir = NULL;
 
   int c;
-  while ((c = getopt (argc, argv, "b:p:s:d:c:")) != -1)
+  while ((c = getopt (argc, argv, "b:p:s:d:crhm:k:j:o:q:l:w:n:vz:u:t:iy:a:")) != -1)
   {
     switch(c)
     {
@@ -603,16 +2573,220 @@ int main(int argc, char *argv[])
       case 'c':
         g_keepalive = 0;
         break;
+      case 'r':
+        g_read_routing = 1;
+        break;
+      case 'h':
+        g_sharding = 1;
+        break;
+      case 'm':
+        cache_mb = atoll(optarg);
+        break;
+      case 'k':
+        cache_commands = optarg;
+        break;
+      case 'j':
+        journal_dir = optarg;
+        break;
+      case 'o':
+        if(!strcmp(optarg, "skip"))
+          g_open_skip = 1;
+        else if(strcmp(optarg, "fail"))
+          dsdie("Bad failing database policy \"%s\"", optarg);
+        break;
+      case 'q':
+      {
+        int target_ms = atoi(optarg);
+        char *interval = strchr(optarg, ',');
+        g_codel = target_ms > 0;
+        dscodel_init(target_ms, interval ? atoi(interval + 1) : DSCODEL_INTERVAL_MS);
+        break;
+      }
+      case 'l':
+        g_client_limit = atoi(optarg);
+        break;
+      case 'w':
+        if(dssched_init(optarg))
+          return -1;
+        break;
+      case 'v':
+        g_consensus = 1;
+        break;
+      case 'z':
+        g_zip_min = atoi(optarg);
+        break;
+      case 'u':
+        g_unix_path = optarg;
+        break;
+      case 't':
+        parse_trusted_uids(optarg);
+        break;
+      case 'i':
+        g_uring = 1;
+        break;
+      case 'y':
+        parse_spin(optarg);
+        break;
+      case 'a':
+        g_admin_port = atoi(optarg);
+        if(g_admin_port <= 0 || g_admin_port > 65535)
+          dsdie("Bad admin port %s", optarg);
+        break;
+      case 'n':
+        g_lanes_num = atoi(optarg);
+        if(g_lanes_num < 1 || g_lanes_num > DSLANE_MAX)
+          dsdie("Lanes number should be from 1 to %d", DSLANE_MAX);
+        break;
     }
   }
   
   if(!g_db_addresses)
     parse_db_addresses("redis:127.0.0.1:6379");
+
+  PDB_ADDRESS db_address;
+  for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+  {
+    if(!strcmp(db_address->db, "rediscluster"))
+    {
+      if(g_sharding)
+        dsdie("Redis cluster %s:%d cannot be sharded", db_address->address, db_address->port);
+
+      db_address->cluster = dscluster_create(db_address->address, db_address->port);
+      if(!db_address->cluster)
+        return -1;
+    }
+  }
+
+  if(journal_dir)
+  {
+    if(dsjournal_init(journal_dir))
+      return -1;
+
+    for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+    {
+      if(g_sharding || strcmp(db_address->db, "redis"))
+        dslogw("Journal is not used for %s:%s:%d", db_address->db, db_address->address, db_address->port);
+      else if(!(db_address->journal = dsjournal_open(db_address->address, db_address->port)))
+        return -1;
+    }
+
+    if(dsjournal_start())
+      return -1;
+  }
+
+  int sync_num = 0;
+  for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+  {
+    if(!db_address->async)
+      sync_num++;
+    else if(g_sharding || strcmp(db_address->db, "redis"))
+      dsdie("Database %s:%s:%d cannot be asynchronous", db_address->db, db_address->address, db_address->port);
+    else if(!(db_address->queue = dsasync_open(db_address->address, db_address->port, db_address->journal)))
+      return -1;
+  }
+  if(!sync_num)
+    dsdie("At least one database has to be synchronous");
+
+  // database without tracker would never invalidate cached answers
+  for(db_address = g_db_addresses; cache_mb > 0 && db_address; db_address = db_address->next)
+  {
+    if(strcmp(db_address->db, "redis"))
+      dsdie("Read cache cannot track keys of %s:%s:%d", db_address->db, db_address->address, db_address->port);
+  }
+
+  if(g_sharding)
+  {
+    if(g_read_routing)
+      dslogw("Read routing is not used for sharded databases");
+
+    char name[256];
+    for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+    {
+      snprintf(name, sizeof(name), "%s:%d", db_address->address, db_address->port);
+      if(dsshard_add(name, db_address))
+        return -1;
+    }
+  }
+
+  // asynchronous targets are retried by their senders
+  for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+  {
+    if(!db_address->async && !(db_address->health = dshealth_open(db_address->address, db_address->port)))
+      return -1;
+  }
+
+  if(dshealth_start())
+    return -1;
+
+  if(cache_mb > 0)
+  {
+    if(dscache_init(cache_mb * 1024 * 1024, cache_commands))
+      return -1;
+
+    for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+      db_address->tracker = dscache_tracker(db_address->address, db_address->port);
+  }
+  
+  // read cache and cluster nodes keep single connection to database
+  for(db_address = g_db_addresses; g_lanes_num > 1 && db_address; db_address = db_address->next)
+  {
+    if(db_address->cluster || db_address->tracker)
+    {
+      dslogw("Single lane is used with %s", db_address->cluster ? "redis cluster" : "read cache");
+      g_lanes_num = 1;
+    }
+  }
+
+  int lane;
+  g_pools = (void ***)malloc(g_lanes_num * sizeof(void **));
+  for(lane = 0; g_pools && lane < g_lanes_num; lane++)
+    if(!(g_pools[lane] = (void **)calloc(g_db_count, sizeof(void *))))
+      dsdie("Cannot allocate connection pool");
+  if(!g_pools)
+    dsdie("Cannot allocate connection pool");
+  g_pool = g_pools[0];
+
+  g_zips = (void **)malloc(g_lanes_num * sizeof(void *));
+  for(lane = 0; g_zips && lane < g_lanes_num; lane++)
+    if(!(g_zips[lane] = dszip_create()))
+      dsdie("Cannot allocate compression context");
+  if(!g_zips || !(g_unzip = dszip_create()))
+    dsdie("Cannot allocate compression context");
+  g_zip = g_zips[0];
+
+  // main loop is thread 0 of statistics, lanes follow it
+  if(dsstats_init(g_db_count, g_lanes_num + 1))
+    return -1;
+
+  if(g_lanes_num > 1 && dslane_start(g_lanes_num, run_lane))
+    return -1;
+
+  // service commands run in main loop beside lane 0
+  if(g_lanes_num > 1)
+    g_zip = g_unzip;
   
   g_clocks_per_second = sysconf(_SC_CLK_TCK);
 
   process_conns(listen_address, atoi(listen_port));
 
+  dslane_release();
+  for(lane = 0; lane < g_lanes_num; lane++)
+  {
+    for(db_address = g_db_addresses; db_address; db_address = db_address->next)
+      dsredis_free(g_pools[lane][db_address->index]);
+    free(g_pools[lane]);
+    dszip_free(g_zips[lane]);
+  }
+  free(g_pools);
+  free(g_zips);
+  dszip_free(g_unzip);
+
+  dsstats_release();
+  dshealth_release();
+  dsasync_release();
+  dsjournal_release();
+  dscache_release();
+  dsshard_release();
   free_db_addresses();
   dscrypto_keyfree(NULL);
   dscrypto_cleanup();
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <hiredis/hiredis.h>
+
+#include "dsasync.h"
+#include "dsjournal.h"
+#include "dsredis.h"
+#include "dsmisc.h"
+
+
+
+#define SEND_BATCH        64    // commands in one pipeline
+#define SEND_RETRY_MS     1000  // unreachable target is not tried meanwhile
+
+
+typedef struct _async_queue {
+  char *address;
+  int port;
+  void *journal;        // takes commands while target is unreachable
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char **cmds;          // ring of DSASYNC_QUEUE_SIZE
+  int head;
+  int count;
+  int running;
+  int sending;          // batch of sender is older than journal entries, replay waits for it
+  int overtaken;        // queue overflowed into journal while batch is sent
+
+  long long sent;
+  long long failed;
+  long long dropped;
+  long long spilled;
+
+  pthread_t thread;
+  struct _async_queue *next;
+
+} ASYNC_QUEUE, *PASYNC_QUEUE;
+
+
+static PASYNC_QUEUE g_queues = NULL;
+
+
+
+// Called with queue lock held, nothing gets into journal meanwhile
+static void _spill(PASYNC_QUEUE queue, char **batch, int num)
+{
+  int i;
+
+  for(i = 0; i < num; i++)
+  {
+    if(!dsjournal_append(queue->journal, batch[i]))
+      queue->spilled++;
+    else
+      queue->dropped++;
+    free(batch[i]);
+  }
+}
+
+
+// Queued commands go to journal ahead of the new one, called with queue
+// lock held
+static int _overflow(PASYNC_QUEUE queue, const char *cmd)
+{
+  while(queue->count)
+  {
+    if(dsjournal_append(queue->journal, queue->cmds[queue->head]))
+      return -1;
+
+    free(queue->cmds[queue->head]);
+    queue->head = (queue->head + 1) % DSASYNC_QUEUE_SIZE;
+    queue->count--;
+    queue->spilled++;
+  }
+
+  if(dsjournal_append(queue->journal, cmd))
+    return -1;
+
+  queue->spilled++;
+  queue->overtaken = queue->sending;
+
+  return 0;
+}
+
+
+// Batch goes in one pipeline, returns number of answered commands
+static int _send(PASYNC_QUEUE queue, redisContext *c, char **batch, int num)
+{
+  int i, failed = 0;
+
+  for(i = 0; i < num; i++)
+    redisAppendCommand(c, batch[i]);
+
+  for(i = 0; i < num; i++)
+  {
+    redisReply *reply = NULL;
+
+    if(redisGetReply(c, (void **)&reply) != REDIS_OK)
+    {
+      dslog("Connection to %s:%d broken, %d of %d commands sent", queue->address, queue->port, i, num);
+      break;
+    }
+
+    if(reply->type == REDIS_REPLY_ERROR)
+    {
+      dslogw("Command \"%s\" failed on %s:%d: %s", batch[i], queue->address, queue->port, reply->str);
+      failed++;
+    }
+    freeReplyObject(reply);
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->sent += i;
+  queue->failed += failed;
+  pthread_mutex_unlock(&queue->lock);
+
+  return i;
+}
+
+
+// Commands taken from queue are kept until target answers them, so only the
+// batch in flight may be applied twice when connection breaks. Batch taken
+// while journal is empty is sent ahead of journal entries made meanwhile.
+static void* _sender(void *arg)
+{
+  PASYNC_QUEUE queue = (PASYNC_QUEUE)arg;
+  char *batch[SEND_BATCH];
+  int i, num = 0;
+  void *redis_ctx = NULL;
+
+  while(1)
+  {
+    pthread_mutex_lock(&queue->lock);
+
+    while(queue->running && !queue->count && !num)
+      pthread_cond_wait(&queue->cond, &queue->lock);
+
+    // commands queued after overflow are newer than journal entries
+    int running = queue->running;
+    while(num < SEND_BATCH && queue->count && !queue->overtaken)
+    {
+      batch[num++] = queue->cmds[queue->head];
+      queue->head = (queue->head + 1) % DSASYNC_QUEUE_SIZE;
+      queue->count--;
+    }
+
+    // journal keeps the order once target failed
+    int spilled = 0;
+    if(num && queue->journal && !queue->sending)
+    {
+      if(dsjournal_pending(queue->journal))
+      {
+        _spill(queue, batch, num);
+        num = 0;
+        spilled = 1;
+      }
+      else
+      {
+        queue->sending = 1;
+        dsjournal_hold(queue->journal, 1);
+      }
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if(!num)
+    {
+      if(spilled)
+        continue;
+      break;
+    }
+
+    if(redis_ctx && dsredis_broken(redis_ctx))
+    {
+      dsredis_free(redis_ctx);
+      redis_ctx = NULL;
+    }
+
+    if(!redis_ctx)
+      redis_ctx = dsredis_connect(queue->address, queue->port);
+
+    int done = 0;
+    if(redis_ctx)
+      done = _send(queue, (redisContext *)redis_ctx, batch, num);
+
+    for(i = 0; i < done; i++)
+      free(batch[i]);
+    for(i = done; i < num; i++)
+      batch[i - done] = batch[i];
+    num -= done;
+
+    // the rest of batch follows journal entries unless they are newer
+    pthread_mutex_lock(&queue->lock);
+    if(queue->sending && (!num || !queue->overtaken))
+    {
+      _spill(queue, batch, num);
+      num = 0;
+      queue->sending = 0;
+      queue->overtaken = 0;
+      dsjournal_hold(queue->journal, 0);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if(!num)
+      continue;
+
+    if(!running)
+    {
+      for(i = 0; i < num; i++)
+        free(batch[i]);
+
+      pthread_mutex_lock(&queue->lock);
+      num += queue->count;
+      queue->dropped += num;
+      while(queue->count--)
+      {
+        free(queue->cmds[queue->head]);
+        queue->head = (queue->head + 1) % DSASYNC_QUEUE_SIZE;
+      }
+      queue->count = 0;
+      pthread_mutex_unlock(&queue->lock);
+
+      dslog("%d commands for %s:%d are lost on exit", num, queue->address, queue->port);
+      break;
+    }
+    else
+      usleep(SEND_RETRY_MS * 1000);
+  }
+
+  dsredis_free(redis_ctx);
+
+  return NULL;
+}
+
+
+void* dsasync_open(const char *address, int port, void *journal)
+{
+  PASYNC_QUEUE queue = (PASYNC_QUEUE)calloc(1, sizeof(ASYNC_QUEUE));
+  if(!queue)
+  {
+    dslogerr(errno, "Cannot allocate queue");
+    return NULL;
+  }
+
+  queue->cmds = (char **)malloc(DSASYNC_QUEUE_SIZE * sizeof(char *));
+  if(!queue->cmds)
+  {
+    dslogerr(errno, "Cannot allocate queue");
+    free(queue);
+    return NULL;
+  }
+
+  queue->address = strdup(address);
+  queue->port = port;
+  queue->journal = journal;
+  queue->running = 1;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+
+  int rc = pthread_create(&queue->thread, NULL, _sender, queue);
+  if(rc)
+  {
+    dslogerr(rc, "Cannot start sender thread for %s:%d", address, port);
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->address);
+    free(queue->cmds);
+    free(queue);
+    return NULL;
+  }
+
+  queue->next = g_queues;
+  g_queues = queue;
+
+  return queue;
+}
+
+
+// Full queue is moved to journal along with the command, without journal
+// the command is dropped. Main loop never waits for sender.
+int dsasync_push(void *queue, const char *cmd)
+{
+  PASYNC_QUEUE _queue = (PASYNC_QUEUE)queue;
+  char *copy = NULL;
+  int rc = -1;
+
+  pthread_mutex_lock(&_queue->lock);
+
+  if(_queue->count < DSASYNC_QUEUE_SIZE && (copy = strdup(cmd)))
+  {
+    _queue->cmds[(_queue->head + _queue->count) % DSASYNC_QUEUE_SIZE] = copy;
+    _queue->count++;
+    pthread_cond_signal(&_queue->cond);
+    rc = 0;
+  }
+  else if(_queue->journal && !_overflow(_queue, cmd))
+  {
+    dstrace("Queue of %s:%d is full, moved to journal", _queue->address, _queue->port);
+    rc = 0;
+  }
+  else
+    _queue->dropped++;
+
+  pthread_mutex_unlock(&_queue->lock);
+
+  return rc;
+}
+
+
+void dsasync_stats(void *queue, PDSASYNC_STATS stats)
+{
+  PASYNC_QUEUE _queue = (PASYNC_QUEUE)queue;
+
+  pthread_mutex_lock(&_queue->lock);
+
+  stats->queued = _queue->count;
+  stats->sent = _queue->sent;
+  stats->failed = _queue->failed;
+  stats->dropped = _queue->dropped;
+  stats->spilled = _queue->spilled;
+
+  pthread_mutex_unlock(&_queue->lock);
+}
+
+
+// Queued commands are sent before exit while target is reachable
+void dsasync_release(void)
+{
+  while(g_queues)
+  {
+    PASYNC_QUEUE queue = g_queues;
+    g_queues = queue->next;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->running = 0;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->thread, NULL);
+
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->address);
+    free(queue->cmds);
+    free(queue);
+  }
+}
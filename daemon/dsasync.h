@@ -0,0 +1,20 @@
+#ifndef DSASYNC_H
+#define DSASYNC_H
+
+#define DSASYNC_QUEUE_SIZE 65536 // commands waiting for asynchronous target
+
+typedef struct _dsasync_stats {
+  long long queued;   // waiting in queue
+  long long sent;
+  long long failed;   // answered with error
+  long long dropped;  // queue was full
+  long long spilled;  // moved to journal
+
+} DSASYNC_STATS, *PDSASYNC_STATS;
+
+void* dsasync_open(const char *address, int port, void *journal);
+int   dsasync_push(void *queue, const char *cmd);
+void  dsasync_stats(void *queue, PDSASYNC_STATS stats);
+void  dsasync_release(void);
+
+#endif /* DSASYNC_H */
@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <poll.h>
+
+#include <hiredis/hiredis.h>
+
+#include "dscache.h"
+#include "dsredis.h"
+#include "dscmd.h"
+#include "dsmisc.h"
+
+
+
+#define CACHE_BUCKETS_MIN   1024
+#define TRACKER_RETRY_MS    1000
+#define INVALIDATE_CHANNEL  "__redis__:invalidate"
+
+
+typedef struct _cache_entry {
+  unsigned long long hash;      // of the command
+  unsigned long long key_hash;  // of the Redis key
+  int size;                     // accounted memory
+
+  char *cmd;
+  char *key;
+  int key_len;
+  unsigned char *value;
+  int value_size;
+
+  struct _cache_entry *next;     // command hash chain
+  struct _cache_entry *key_next; // key hash chain
+  struct _cache_entry *lru_prev;
+  struct _cache_entry *lru_next;
+
+} CACHE_ENTRY, *PCACHE_ENTRY;
+
+// Every Redis target has a pair of connections. Cache misses are read
+// through the tracked one so Redis remembers the keys, invalidation
+// messages for them are redirected to the subscribed one.
+typedef struct _cache_tracker {
+  char *address;
+  int port;
+  redisContext *ctl;
+  redisContext *sub;
+  long long retry_us;
+
+  struct _cache_tracker *next;
+
+} CACHE_TRACKER, *PCACHE_TRACKER;
+
+
+static int            g_enabled = 0;
+static long long      g_max_memory = 0;
+static char         **g_commands = NULL;
+static int            g_commands_num = 0;
+static PCACHE_ENTRY  *g_buckets = NULL;
+static PCACHE_ENTRY  *g_key_buckets = NULL;
+static int            g_buckets_num = 0;
+static PCACHE_ENTRY   g_lru_head = NULL; // most recently used
+static PCACHE_ENTRY   g_lru_tail = NULL;
+static PCACHE_TRACKER g_trackers = NULL;
+static DSCACHE_STATS  g_stats;
+
+// key of the command being fetched, its result is not stored if the key
+// was invalidated while waiting for the answer
+static const char    *g_fetch_key = NULL;
+static int            g_fetch_key_len = 0;
+static int            g_fetch_invalidated = 0;
+
+
+static void _lru_unlink(PCACHE_ENTRY entry)
+{
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    g_lru_head = entry->lru_next;
+
+  if(entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    g_lru_tail = entry->lru_prev;
+
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+
+static void _lru_push(PCACHE_ENTRY entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = g_lru_head;
+  if(g_lru_head)
+    g_lru_head->lru_prev = entry;
+  g_lru_head = entry;
+  if(!g_lru_tail)
+    g_lru_tail = entry;
+}
+
+
+static void _entry_remove(PCACHE_ENTRY entry)
+{
+  PCACHE_ENTRY *pptr;
+
+  pptr = &g_buckets[entry->hash % g_buckets_num];
+  while(*pptr != entry)
+    pptr = &(*pptr)->next;
+  *pptr = entry->next;
+
+  pptr = &g_key_buckets[entry->key_hash % g_buckets_num];
+  while(*pptr != entry)
+    pptr = &(*pptr)->key_next;
+  *pptr = entry->key_next;
+
+  _lru_unlink(entry);
+
+  g_stats.entries--;
+  g_stats.memory -= entry->size;
+
+  free(entry);
+}
+
+
+static void _flush(void)
+{
+  while(g_lru_head)
+    _entry_remove(g_lru_head);
+
+  g_stats.flushes++;
+  g_fetch_invalidated = 1;
+
+  dstrace("Cache flushed");
+}
+
+
+static void _invalidate_key(const char *key, int key_len)
+{
+  if(g_fetch_key && g_fetch_key_len == key_len && !memcmp(g_fetch_key, key, key_len))
+    g_fetch_invalidated = 1;
+
+  if(!g_stats.entries)
+    return;
+
+  unsigned long long key_hash = dshash(key, key_len);
+  PCACHE_ENTRY entry = g_key_buckets[key_hash % g_buckets_num];
+  while(entry)
+  {
+    PCACHE_ENTRY next = entry->key_next;
+
+    if(entry->key_hash == key_hash && entry->key_len == key_len && !memcmp(entry->key, key, key_len))
+    {
+      dstrace("Cache invalidate \"%s\"", entry->cmd);
+      _entry_remove(entry);
+      g_stats.invalidations++;
+    }
+
+    entry = next;
+  }
+}
+
+
+static int _resize(int buckets_num)
+{
+  PCACHE_ENTRY *buckets = (PCACHE_ENTRY *)calloc(buckets_num, sizeof(PCACHE_ENTRY));
+  PCACHE_ENTRY *key_buckets = (PCACHE_ENTRY *)calloc(buckets_num, sizeof(PCACHE_ENTRY));
+  if(!buckets || !key_buckets)
+  {
+    dslogerr(errno, "Cannot allocate cache index of %d buckets", buckets_num);
+    free(buckets);
+    free(key_buckets);
+    return -1;
+  }
+
+  PCACHE_ENTRY entry;
+  for(entry = g_lru_head; entry; entry = entry->lru_next)
+  {
+    entry->next = buckets[entry->hash % buckets_num];
+    buckets[entry->hash % buckets_num] = entry;
+    entry->key_next = key_buckets[entry->key_hash % buckets_num];
+    key_buckets[entry->key_hash % buckets_num] = entry;
+  }
+
+  free(g_buckets);
+  free(g_key_buckets);
+  g_buckets = buckets;
+  g_key_buckets = key_buckets;
+  g_buckets_num = buckets_num;
+
+  return 0;
+}
+
+
+static PCACHE_ENTRY _lookup(const char *cmd, unsigned long long hash)
+{
+  PCACHE_ENTRY entry;
+
+  for(entry = g_buckets[hash % g_buckets_num]; entry; entry = entry->next)
+    if(entry->hash == hash && !strcmp(entry->cmd, cmd))
+      return entry;
+
+  return NULL;
+}
+
+
+static void _store(const char *cmd, const void *value, int value_size)
+{
+  const char *key;
+  int key_len;
+
+  if(dscmd_arg(cmd, 1, &key, &key_len))
+    return;
+
+  int cmd_len = strlen(cmd);
+  int size = sizeof(CACHE_ENTRY) + cmd_len + 1 + key_len + 1 + value_size;
+  if(size > g_max_memory)
+    return;
+
+  unsigned long long hash = dshash(cmd, cmd_len);
+  PCACHE_ENTRY entry = _lookup(cmd, hash);
+  if(entry)
+    _entry_remove(entry);
+
+  // least recently used entries make room for the new one
+  while(g_lru_tail && g_stats.memory + size > g_max_memory)
+  {
+    dstrace("Cache evict \"%s\"", g_lru_tail->cmd);
+    _entry_remove(g_lru_tail);
+    g_stats.evictions++;
+  }
+
+  if(g_stats.entries >= g_buckets_num * 2)
+    _resize(g_buckets_num * 2);
+
+  entry = (PCACHE_ENTRY)malloc(size);
+  if(!entry)
+  {
+    dslogerr(errno, "Cannot allocate cache entry");
+    return;
+  }
+
+  entry->hash = hash;
+  entry->key_hash = dshash(key, key_len);
+  entry->size = size;
+  entry->cmd = (char *)(entry + 1);
+  memcpy(entry->cmd, cmd, cmd_len + 1);
+  entry->key = entry->cmd + cmd_len + 1;
+  memcpy(entry->key, key, key_len);
+  entry->key[key_len] = 0;
+  entry->key_len = key_len;
+  entry->value = (unsigned char *)entry->key + key_len + 1;
+  memcpy(entry->value, value, value_size);
+  entry->value_size = value_size;
+
+  entry->next = g_buckets[hash % g_buckets_num];
+  g_buckets[hash % g_buckets_num] = entry;
+  entry->key_next = g_key_buckets[entry->key_hash % g_buckets_num];
+  g_key_buckets[entry->key_hash % g_buckets_num] = entry;
+  _lru_push(entry);
+
+  g_stats.entries++;
+  g_stats.memory += size;
+  g_stats.stores++;
+
+  dstrace("Cache store \"%s\", %d bytes", cmd, value_size);
+}
+
+
+static void _tracker_reset(PCACHE_TRACKER tracker)
+{
+  dsredis_free(tracker->ctl);
+  dsredis_free(tracker->sub);
+  tracker->ctl = NULL;
+  tracker->sub = NULL;
+  tracker->retry_us = dsclock_us() + TRACKER_RETRY_MS * 1000;
+
+  // nothing tells us about changes anymore
+  _flush();
+}
+
+
+static int _tracker_connect(PCACHE_TRACKER tracker)
+{
+  redisReply *reply;
+  long long id = -1;
+  char buf[64];
+
+  tracker->sub = dsredis_connect(tracker->address, tracker->port);
+  if(tracker->sub)
+  {
+    reply = redisCommand(tracker->sub, "CLIENT ID");
+    if(reply && reply->type == REDIS_REPLY_INTEGER)
+      id = reply->integer;
+    if(reply)
+      freeReplyObject(reply);
+  }
+
+  if(id >= 0)
+  {
+    reply = redisCommand(tracker->sub, "SUBSCRIBE " INVALIDATE_CHANNEL);
+    if(!reply || reply->type != REDIS_REPLY_ARRAY)
+      id = -1;
+    if(reply)
+      freeReplyObject(reply);
+  }
+
+  if(id >= 0)
+    tracker->ctl = dsredis_connect(tracker->address, tracker->port);
+
+  if(tracker->ctl)
+  {
+    snprintf(buf, sizeof(buf), "CLIENT TRACKING on REDIRECT %lld", id);
+    reply = redisCommand(tracker->ctl, buf);
+    if(!reply || reply->type != REDIS_REPLY_STATUS)
+    {
+      dslogw("REDIS %s:%d does not support client tracking", tracker->address, tracker->port);
+      id = -1;
+    }
+    if(reply)
+      freeReplyObject(reply);
+  }
+
+  if(id < 0 || !tracker->ctl)
+  {
+    dslogw("Cache tracking connection to %s:%d failed", tracker->address, tracker->port);
+    _tracker_reset(tracker);
+    return -1;
+  }
+
+  struct timeval timeout = { 1, 500000 }; // 1.5 seconds
+  redisSetTimeout(tracker->ctl, timeout);
+
+  dslog("Cache tracking connected to %s:%d", tracker->address, tracker->port);
+
+  // changes could be missed while disconnected
+  _flush();
+
+  return 0;
+}
+
+
+static void _tracker_message(redisReply *reply)
+{
+  if(reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+      reply->element[0]->type != REDIS_REPLY_STRING || strcmp(reply->element[0]->str, "message"))
+    return;
+
+  redisReply *keys = reply->element[2];
+  if(keys->type == REDIS_REPLY_NIL)
+  {
+    _flush(); // FLUSHALL or FLUSHDB on the server
+  }
+  else if(keys->type == REDIS_REPLY_ARRAY)
+  {
+    int i;
+    for(i = 0; i < keys->elements; i++)
+      if(keys->element[i]->type == REDIS_REPLY_STRING)
+        _invalidate_key(keys->element[i]->str, keys->element[i]->len);
+  }
+  else if(keys->type == REDIS_REPLY_STRING)
+  {
+    _invalidate_key(keys->str, keys->len);
+  }
+}
+
+
+static void _tracker_drain(PCACHE_TRACKER tracker)
+{
+  struct pollfd pfd;
+  void *reply;
+
+  pfd.fd = tracker->sub->fd;
+  pfd.events = POLLIN;
+
+  while(poll(&pfd, 1, 0) > 0)
+  {
+    if(redisBufferRead(tracker->sub) != REDIS_OK)
+    {
+      dslogw("Cache tracking connection to %s:%d lost", tracker->address, tracker->port);
+      _tracker_reset(tracker);
+      return;
+    }
+
+    do {
+      reply = NULL;
+      if(redisReaderGetReply(tracker->sub->reader, &reply) != REDIS_OK)
+      {
+        dslogw("Cache tracking protocol error from %s:%d", tracker->address, tracker->port);
+        _tracker_reset(tracker);
+        return;
+      }
+
+      if(reply)
+      {
+        _tracker_message((redisReply *)reply);
+        freeReplyObject(reply);
+      }
+    } while(reply);
+  }
+}
+
+
+int dscache_init(long long max_memory, const char *commands)
+{
+  char *_commands = strdup(commands);
+  char *pos, *saveptr = NULL;
+
+  memset(&g_stats, 0, sizeof(g_stats));
+  g_max_memory = max_memory;
+
+  for(pos = strtok_r(_commands, ",", &saveptr); pos; pos = strtok_r(NULL, ",", &saveptr))
+  {
+    if(dscmd_class(pos) != DSCMD_READ)
+      dsdie("Command %s cannot be cached because it is not read-only", pos);
+    if(dscmd_keys(pos) != DSCMD_KEY_SINGLE)
+      dsdie("Command %s cannot be cached because it is not single key", pos);
+
+    g_commands = (char **)realloc(g_commands, (g_commands_num + 1) * sizeof(char *));
+    if(!g_commands)
+      dsdie("Cannot allocate cached commands list");
+    g_commands[g_commands_num++] = strdup(pos);
+  }
+
+  free(_commands);
+
+  if(_resize(CACHE_BUCKETS_MIN))
+    return -1;
+
+  g_enabled = 1;
+
+  dslog("Cache of %lld bytes enabled for %s", max_memory, commands);
+
+  return 0;
+}
+
+
+void dscache_release(void)
+{
+  int i;
+
+  if(!g_enabled)
+    return;
+
+  dslog("Cache hits %lld, misses %lld, invalidations %lld, evictions %lld",
+    g_stats.hits, g_stats.misses, g_stats.invalidations, g_stats.evictions);
+
+  while(g_trackers)
+  {
+    PCACHE_TRACKER tracker = g_trackers;
+    g_trackers = g_trackers->next;
+
+    dsredis_free(tracker->ctl);
+    dsredis_free(tracker->sub);
+    free(tracker->address);
+    free(tracker);
+  }
+
+  while(g_lru_head)
+    _entry_remove(g_lru_head);
+
+  for(i = 0; i < g_commands_num; i++)
+    free(g_commands[i]);
+  free(g_commands);
+  free(g_buckets);
+  free(g_key_buckets);
+
+  g_commands = NULL;
+  g_commands_num = 0;
+  g_buckets = g_key_buckets = NULL;
+  g_enabled = 0;
+}
+
+
+void* dscache_tracker(const char *address, int port)
+{
+  if(!g_enabled)
+    return NULL;
+
+  PCACHE_TRACKER tracker = (PCACHE_TRACKER)malloc(sizeof(CACHE_TRACKER));
+  if(!tracker)
+    dsdierr(errno, "Cannot allocate cache tracker");
+
+  tracker->address = strdup(address);
+  tracker->port = port;
+  tracker->ctl = NULL;
+  tracker->sub = NULL;
+  tracker->retry_us = 0;
+  tracker->next = g_trackers;
+  g_trackers = tracker;
+
+  _tracker_connect(tracker);
+
+  return tracker;
+}
+
+
+// Only configured commands are cached, and only while every target
+// is able to tell about changes
+int dscache_cacheable(const char *cmd)
+{
+  const char *name;
+  int i, name_len;
+
+  if(!g_enabled)
+    return 0;
+
+  PCACHE_TRACKER tracker;
+  for(tracker = g_trackers; tracker; tracker = tracker->next)
+    if(!tracker->ctl)
+      return 0;
+
+  if(dscmd_arg(cmd, 0, &name, &name_len))
+    return 0;
+
+  for(i = 0; i < g_commands_num; i++)
+    if(strlen(g_commands[i]) == name_len && !strncasecmp(g_commands[i], name, name_len))
+      return 1;
+
+  return 0;
+}
+
+
+int dscache_get(PDSARENA arena, const char *cmd, void **res, int *res_size)
+{
+  dscache_poll();
+
+  PCACHE_ENTRY entry = _lookup(cmd, dshash(cmd, strlen(cmd)));
+  if(!entry)
+  {
+    g_stats.misses++;
+    return 1;
+  }
+
+  *res = dsarena_alloc(arena, entry->value_size);
+  if(!*res)
+    return -1;
+
+  memcpy(*res, entry->value, entry->value_size);
+  *res_size = entry->value_size;
+
+  _lru_unlink(entry);
+  _lru_push(entry);
+  g_stats.hits++;
+
+  dstrace("Cache hit \"%s\"", cmd);
+
+  return 0;
+}
+
+
+void dscache_fetch_begin(const char *cmd)
+{
+  if(dscmd_arg(cmd, 1, &g_fetch_key, &g_fetch_key_len))
+    g_fetch_key = NULL;
+  g_fetch_invalidated = 0;
+}
+
+
+void dscache_fetch_end(const char *cmd, const void *res, int res_size)
+{
+  // invalidations which came during the fetch cancel the store
+  dscache_poll();
+
+  if(!g_fetch_invalidated && g_fetch_key && res && res_size > 0 && dscache_cacheable(cmd))
+    _store(cmd, res, res_size);
+
+  g_fetch_key = NULL;
+}
+
+
+int dscache_run(void *tracker, PDSARENA arena, const char *cmd, unsigned char **res, int *res_size)
+{
+  PCACHE_TRACKER _tracker = (PCACHE_TRACKER)tracker;
+
+  if(!_tracker->ctl)
+    return DSREDIS_UNREACHABLE;
+
+  int rc = dsredis_run(arena, _tracker->ctl, cmd, res, res_size);
+  if(dsredis_broken(_tracker->ctl))
+  {
+    dslogw("Cache tracked connection to %s:%d lost", _tracker->address, _tracker->port);
+    _tracker_reset(_tracker);
+  }
+
+  return rc;
+}
+
+
+// Keys touched by write passing through the daemon are dropped right away.
+// Every argument is taken as a key, extra invalidation is harmless.
+void dscache_invalidate_cmd(const char *cmd)
+{
+  const char *arg;
+  int i, arg_len;
+
+  if(!g_enabled || dscmd_arg(cmd, 0, &arg, &arg_len))
+    return;
+
+  if((arg_len == 8 && !strncasecmp(arg, "FLUSHALL", 8)) ||
+      (arg_len == 7 && !strncasecmp(arg, "FLUSHDB", 7)) ||
+      (arg_len == 6 && !strncasecmp(arg, "SWAPDB", 6)))
+  {
+    _flush();
+    return;
+  }
+
+  for(i = 1; !dscmd_arg(cmd, i, &arg, &arg_len); i++)
+    _invalidate_key(arg, arg_len);
+}
+
+
+void dscache_poll(void)
+{
+  PCACHE_TRACKER tracker;
+
+  if(!g_enabled)
+    return;
+
+  for(tracker = g_trackers; tracker; tracker = tracker->next)
+  {
+    if(tracker->sub)
+      _tracker_drain(tracker);
+    else if(dsclock_us() >= tracker->retry_us)
+      _tracker_connect(tracker);
+  }
+}
+
+
+void dscache_stats(PDSCACHE_STATS stats)
+{
+  *stats = g_stats;
+}
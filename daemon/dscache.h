@@ -0,0 +1,30 @@
+#ifndef DSCACHE_H
+#define DSCACHE_H
+
+#include "dsarena.h"
+
+typedef struct _dscache_stats {
+  long long hits;
+  long long misses;
+  long long stores;
+  long long invalidations;
+  long long evictions;
+  long long flushes;
+  long long entries;
+  long long memory;
+
+} DSCACHE_STATS, *PDSCACHE_STATS;
+
+int   dscache_init(long long max_memory, const char *commands);
+void  dscache_release(void);
+void* dscache_tracker(const char *address, int port);
+int   dscache_cacheable(const char *cmd);
+int   dscache_get(PDSARENA arena, const char *cmd, void **res, int *res_size);
+void  dscache_fetch_begin(const char *cmd);
+void  dscache_fetch_end(const char *cmd, const void *res, int res_size);
+int   dscache_run(void *tracker, PDSARENA arena, const char *cmd, unsigned char **res, int *res_size);
+void  dscache_invalidate_cmd(const char *cmd);
+void  dscache_poll(void);
+void  dscache_stats(PDSCACHE_STATS stats);
+
+#endif /* DSCACHE_H */
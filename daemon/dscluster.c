@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <hiredis/hiredis.h>
+
+#include "dscluster.h"
+#include "dsredis.h"
+#include "dscmd.h"
+#include "dsmisc.h"
+
+
+
+#define CLUSTER_SLOTS       16384
+#define CLUSTER_REDIRECTS   5
+#define CLUSTER_REFRESH_MS  1000 // slot map is not reloaded more often
+
+
+typedef struct _cluster_node {
+  char *address;
+  int port;
+  void *redis_ctx;  // kept open between commands
+  int slots_num;    // node is master when it owns slots
+  struct _cluster_node *next;
+
+} CLUSTER_NODE, *PCLUSTER_NODE;
+
+typedef struct _cluster {
+  PCLUSTER_NODE nodes; // seed node goes first
+  PCLUSTER_NODE slots[CLUSTER_SLOTS];
+  int stale;           // slot map is to be reloaded
+  long long refreshed_us;
+
+} CLUSTER, *PCLUSTER;
+
+// Keys of multi-key command which share the slot
+typedef struct _cluster_group {
+  int slot;
+  int size;
+  char *cmd;
+  int cmd_len;
+  int cursor;
+  PCLUSTER_NODE node;
+  int batch;
+  redisReply *reply;
+  char **elements;
+  int elements_num;
+
+} CLUSTER_GROUP, *PCLUSTER_GROUP;
+
+typedef struct _cluster_key {
+  const char *arg; // key with value for pairs
+  int len;
+  int group;
+
+} CLUSTER_KEY, *PCLUSTER_KEY;
+
+
+// CRC16-XMODEM the same way Redis Cluster computes key slots
+static int _slot(const char *key, int key_len)
+{
+  int i;
+  unsigned int crc = 0;
+
+  dscmd_keytag(&key, &key_len);
+
+  while(key_len-- > 0)
+  {
+    crc ^= (unsigned int)(unsigned char)*key++ << 8;
+    for(i = 0; i < 8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+
+  return (crc & 0xffff) % CLUSTER_SLOTS;
+}
+
+
+static PCLUSTER_NODE _node(PCLUSTER cluster, const char *address, int port)
+{
+  PCLUSTER_NODE node, *pnext = &cluster->nodes;
+
+  for(node = cluster->nodes; node; node = node->next)
+  {
+    if(node->port == port && !strcmp(node->address, address))
+      return node;
+    pnext = &node->next;
+  }
+
+  node = (PCLUSTER_NODE)malloc(sizeof(CLUSTER_NODE));
+  if(!node)
+  {
+    dslogerr(errno, "Cannot allocate cluster node");
+    return NULL;
+  }
+
+  node->address = strdup(address);
+  node->port = port;
+  node->redis_ctx = NULL;
+  node->slots_num = 0;
+  node->next = NULL;
+  *pnext = node;
+
+  dstrace("Cluster node %s:%d added", address, port);
+
+  return node;
+}
+
+
+static void _assign(PCLUSTER cluster, int slot, PCLUSTER_NODE node)
+{
+  if(cluster->slots[slot])
+    cluster->slots[slot]->slots_num--;
+
+  cluster->slots[slot] = node;
+
+  if(node)
+    node->slots_num++;
+}
+
+
+// Connection of node is reused, broken one is reopened
+static redisContext* _connection(PCLUSTER_NODE node)
+{
+  if(node->redis_ctx && dsredis_broken(node->redis_ctx))
+  {
+    dsredis_free(node->redis_ctx);
+    node->redis_ctx = NULL;
+  }
+
+  if(!node->redis_ctx)
+    node->redis_ctx = dsredis_connect(node->address, node->port);
+
+  return (redisContext *)node->redis_ctx;
+}
+
+
+static int _load_slots(PCLUSTER cluster, PCLUSTER_NODE node)
+{
+  int i, slot;
+
+  redisContext *c = _connection(node);
+  if(!c)
+    return -1;
+
+  redisReply *reply = redisCommand(c, "CLUSTER SLOTS");
+  if(!reply || reply->type != REDIS_REPLY_ARRAY)
+  {
+    dslog("CLUSTER SLOTS failed on %s:%d", node->address, node->port);
+    if(reply)
+      freeReplyObject(reply);
+    return -1;
+  }
+
+  for(slot = 0; slot < CLUSTER_SLOTS; slot++)
+    _assign(cluster, slot, NULL);
+
+  // [start, end, [address, port, id], replicas...]
+  for(i = 0; i < reply->elements; i++)
+  {
+    redisReply *range = reply->element[i];
+    if(range->type != REDIS_REPLY_ARRAY || range->elements < 3)
+      continue;
+
+    redisReply *master = range->element[2];
+    if(master->type != REDIS_REPLY_ARRAY || master->elements < 2)
+      continue;
+
+    const char *address = master->element[0]->str;
+    if(!address || !*address)
+      address = node->address;
+
+    PCLUSTER_NODE owner = _node(cluster, address, master->element[1]->integer);
+    if(!owner)
+      break;
+
+    for(slot = range->element[0]->integer; slot <= range->element[1]->integer && slot < CLUSTER_SLOTS; slot++)
+      _assign(cluster, slot, owner);
+  }
+
+  int rc = i < reply->elements ? -1 : 0;
+
+  freeReplyObject(reply);
+
+  return rc;
+}
+
+
+// Slot map is reloaded from any node which answers, seed node is asked first
+static void _refresh(PCLUSTER cluster)
+{
+  long long now_us = dsclock_us();
+  if(!cluster->stale || now_us < cluster->refreshed_us + CLUSTER_REFRESH_MS * 1000)
+    return;
+
+  cluster->refreshed_us = now_us;
+
+  PCLUSTER_NODE node;
+  for(node = cluster->nodes; node; node = node->next)
+  {
+    if(!_load_slots(cluster, node))
+    {
+      dstrace("Cluster slot map loaded from %s:%d", node->address, node->port);
+      cluster->stale = 0;
+      return;
+    }
+  }
+
+  dslogw("Cannot load slot map of cluster %s:%d", cluster->nodes->address, cluster->nodes->port);
+}
+
+
+static PCLUSTER_NODE _slot_node(PCLUSTER cluster, int slot)
+{
+  if(!cluster->slots[slot])
+  {
+    cluster->stale = 1;
+    _refresh(cluster);
+  }
+
+  // unknown owner redirects to the right one
+  return cluster->slots[slot] ? cluster->slots[slot] : cluster->nodes;
+}
+
+
+static int _redirected(redisReply *reply)
+{
+  return reply && reply->type == REDIS_REPLY_ERROR &&
+         (!strncmp(reply->str, "MOVED ", 6) || !strncmp(reply->str, "ASK ", 4));
+}
+
+
+// MOVED <slot> <address>:<port> updates slot map, ASK <slot> <address>:<port>
+// is a single command redirect while slot migrates
+static PCLUSTER_NODE _redirect(PCLUSTER cluster, redisReply *reply, int *ask)
+{
+  char address[256];
+
+  if(!_redirected(reply))
+    return NULL;
+
+  *ask = reply->str[0] == 'A';
+
+  const char *pos = strchr(reply->str, ' ') + 1;
+  int slot = atoi(pos);
+
+  pos = strchr(pos, ' ');
+  const char *colon = pos ? strrchr(pos, ':') : NULL;
+  if(!colon || colon - pos - 1 >= sizeof(address) || slot < 0 || slot >= CLUSTER_SLOTS)
+  {
+    dslog("Bad cluster redirect \"%s\"", reply->str);
+    return NULL;
+  }
+
+  memcpy(address, pos + 1, colon - pos - 1);
+  address[colon - pos - 1] = 0;
+
+  PCLUSTER_NODE node = _node(cluster, address, atoi(colon + 1));
+  if(node && !*ask)
+  {
+    _assign(cluster, slot, node);
+    cluster->stale = 1;
+  }
+
+  return node;
+}
+
+
+// Single command follows redirects
+static redisReply* _run(PCLUSTER cluster, PCLUSTER_NODE node, const char *cmd)
+{
+  int i, ask = 0;
+
+  for(i = 0; i <= CLUSTER_REDIRECTS; i++)
+  {
+    redisContext *c = _connection(node);
+    if(!c)
+    {
+      cluster->stale = 1;
+      return NULL;
+    }
+
+    redisReply *reply = NULL;
+    if(ask)
+    {
+      redisAppendCommand(c, "ASKING");
+      redisAppendCommand(c, cmd);
+      if(redisGetReply(c, (void **)&reply) == REDIS_OK)
+      {
+        freeReplyObject(reply);
+        reply = NULL;
+        redisGetReply(c, (void **)&reply);
+      }
+    }
+    else
+      reply = redisCommand(c, cmd);
+
+    PCLUSTER_NODE next = _redirect(cluster, reply, &ask);
+    if(!next)
+      return reply;
+
+    dstrace("Command redirected from %s:%d to %s:%d", node->address, node->port, next->address, next->port);
+
+    freeReplyObject(reply);
+    node = next;
+  }
+
+  dslog("Too many redirects for command %s", cmd);
+
+  return NULL;
+}
+
+
+// Keyless command goes to every master. Counts and keys of the whole
+// keyspace are merged, otherwise the first answer is returned.
+static int _run_all(PDSARENA arena, PCLUSTER cluster, const char *cmd, int merge, unsigned char **res, int *res_size)
+{
+  int rc = 0, first = 1;
+  long long count = 0;
+  PCLUSTER_NODE node;
+
+  *res = NULL;
+  *res_size = 0;
+
+  for(node = cluster->nodes; !rc && node; node = node->next)
+  {
+    if(!node->slots_num && (node != cluster->nodes || !cluster->stale))
+      continue;
+
+    redisReply *reply = _run(cluster, node, cmd);
+    if(!reply || reply->type == REDIS_REPLY_ERROR)
+    {
+      dstrace("Command %s failed on %s:%d", cmd, node->address, node->port);
+      rc = reply ? DSREDIS_ERROR : DSREDIS_UNREACHABLE;
+    }
+    else if(merge == DSCMD_KEY_COUNT)
+    {
+      count += reply->integer;
+    }
+    else if(merge == DSCMD_KEY_ALL)
+    {
+      unsigned char *part = NULL;
+      int part_size = 0;
+
+      rc = dsredis_reply(arena, reply, &part, &part_size);
+      if(!rc)
+        rc = dsredis_join(arena, res, res_size, part, part_size);
+    }
+    else if(first)
+    {
+      rc = dsredis_reply(arena, reply, res, res_size);
+    }
+    first = 0;
+
+    if(reply)
+      freeReplyObject(reply);
+  }
+
+  if(!rc && merge == DSCMD_KEY_COUNT)
+  {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld", count);
+
+    *res = (unsigned char *)dsarena_strdup(arena, buf);
+    *res_size = strlen(buf) + 1;
+    if(!*res)
+      rc = -1;
+  }
+
+  return rc;
+}
+
+
+// Keys of different slots cannot go in one command. Command is split by
+// slot and the parts for the same node are sent in one pipeline.
+static int _run_split(PDSARENA arena, PCLUSTER cluster, const char *cmd, int keyspec, unsigned char **res, int *res_size)
+{
+  int i, j, rc = 0;
+  int step = keyspec == DSCMD_KEY_PAIRS ? 2 : 1;
+  int cmd_len = strlen(cmd);
+  int keys_num = 0, groups_num = 0;
+
+  const char *name;
+  int name_len;
+  dscmd_arg(cmd, 0, &name, &name_len);
+
+  PCLUSTER_KEY keys = (PCLUSTER_KEY)dsarena_alloc(arena, (cmd_len / 2 + 1) * sizeof(CLUSTER_KEY));
+  PCLUSTER_GROUP groups = (PCLUSTER_GROUP)dsarena_alloc(arena, (cmd_len / 2 + 1) * sizeof(CLUSTER_GROUP));
+  unsigned short *slot_groups = (unsigned short *)dsarena_alloc(arena, CLUSTER_SLOTS * sizeof(unsigned short));
+  if(!keys || !groups || !slot_groups)
+    return -1;
+  memset(slot_groups, 0, CLUSTER_SLOTS * sizeof(unsigned short));
+
+  const char *pos = name + name_len;
+  while(1)
+  {
+    while(*pos == ' ')
+      pos++;
+    if(!*pos)
+      break;
+
+    PCLUSTER_KEY key = &keys[keys_num++];
+    key->arg = pos;
+
+    const char *end = pos;
+    for(i = 0; i < step && *pos; i++)
+    {
+      while(*pos == ' ')
+        pos++;
+      end = strchr(pos, ' ');
+      if(!end)
+        end = pos + strlen(pos);
+      pos = end;
+    }
+    key->len = end - key->arg;
+
+    const char *key_end = memchr(key->arg, ' ', key->len);
+    int slot = _slot(key->arg, key_end ? key_end - key->arg : key->len);
+
+    if(!slot_groups[slot])
+    {
+      PCLUSTER_GROUP group = &groups[groups_num];
+      group->slot = slot;
+      group->size = name_len;
+      group->cursor = 0;
+      group->batch = -1;
+      group->reply = NULL;
+      slot_groups[slot] = ++groups_num;
+    }
+
+    key->group = slot_groups[slot] - 1;
+    groups[key->group].size += 1 + key->len;
+  }
+
+  if(groups_num <= 1)
+  {
+    // all keys in one slot, command goes whole
+    redisReply *reply = _run(cluster, _slot_node(cluster, keys_num ? groups[0].slot : 0), cmd);
+    rc = dsredis_reply(arena, reply, res, res_size);
+    if(reply)
+      freeReplyObject(reply);
+    return rc;
+  }
+
+  for(i = 0; i < groups_num; i++)
+  {
+    groups[i].cmd = (char *)dsarena_alloc(arena, groups[i].size + 1);
+    if(!groups[i].cmd)
+      return -1;
+    memcpy(groups[i].cmd, name, name_len);
+    groups[i].cmd_len = name_len;
+    groups[i].node = _slot_node(cluster, groups[i].slot);
+  }
+
+  for(i = 0; i < keys_num; i++)
+  {
+    PCLUSTER_GROUP group = &groups[keys[i].group];
+    group->cmd[group->cmd_len++] = ' ';
+    memcpy(group->cmd + group->cmd_len, keys[i].arg, keys[i].len);
+    group->cmd_len += keys[i].len;
+    group->cmd[group->cmd_len] = 0;
+  }
+
+  // one pipeline per node
+  for(i = 0; i < groups_num; i++)
+  {
+    if(groups[i].batch >= 0)
+      continue;
+
+    PCLUSTER_NODE node = groups[i].node;
+    redisContext *c = _connection(node);
+    int batch_num = 0;
+
+    for(j = i; j < groups_num; j++)
+    {
+      if(groups[j].batch < 0 && groups[j].node == node)
+      {
+        groups[j].batch = i;
+        batch_num++;
+        if(c)
+          redisAppendCommand(c, groups[j].cmd);
+      }
+    }
+
+    for(j = i; c && j < groups_num; j++)
+    {
+      if(groups[j].batch == i && redisGetReply(c, (void **)&groups[j].reply) != REDIS_OK)
+        break;
+    }
+
+    if(!c || j < groups_num)
+      cluster->stale = 1;
+
+    dstrace("Pipeline of %d commands to %s:%d", batch_num, node->address, node->port);
+  }
+
+  // moved slots are retried one by one
+  for(i = 0; i < groups_num; i++)
+  {
+    if(_redirected(groups[i].reply))
+    {
+      freeReplyObject(groups[i].reply);
+      groups[i].reply = _run(cluster, groups[i].node, groups[i].cmd);
+    }
+
+    if(!groups[i].reply || groups[i].reply->type == REDIS_REPLY_ERROR)
+    {
+      dstrace("Command %s failed in cluster", groups[i].cmd);
+      rc = groups[i].reply ? DSREDIS_ERROR : DSREDIS_UNREACHABLE;
+    }
+    else if(!rc && keyspec == DSCMD_KEY_ALL)
+    {
+      rc = dsredis_reply_elements(arena, groups[i].reply, &groups[i].elements, &groups[i].elements_num);
+    }
+  }
+
+  long long count = 0;
+  int size = 0;
+
+  for(i = 0; !rc && i < keys_num; i++)
+  {
+    PCLUSTER_GROUP group = &groups[keys[i].group];
+    if(keyspec == DSCMD_KEY_ALL)
+    {
+      if(group->cursor >= group->elements_num)
+        rc = -1;
+      else
+      {
+        const char *element = group->elements[group->cursor++];
+        size += (element ? strlen(element) : 0) + 1;
+      }
+    }
+    else if(keyspec == DSCMD_KEY_COUNT && !group->cursor++)
+    {
+      count += group->reply->integer;
+    }
+  }
+
+  if(!rc)
+  {
+    char buf[32];
+
+    if(keyspec == DSCMD_KEY_ALL)
+    {
+      // same new line joined form as single array answer
+      *res = (unsigned char *)dsarena_alloc(arena, size);
+      *res_size = size;
+      if(!*res)
+        rc = -1;
+
+      int offset = 0;
+      for(i = 0; i < groups_num; i++)
+        groups[i].cursor = 0;
+      for(i = 0; !rc && i < keys_num; i++)
+      {
+        PCLUSTER_GROUP group = &groups[keys[i].group];
+        const char *element = group->elements[group->cursor++];
+        int len = element ? strlen(element) : 0;
+        if(len)
+          memcpy(*res + offset, element, len);
+        offset += len;
+        (*res)[offset++] = i < keys_num - 1 ? '\n' : 0;
+      }
+    }
+    else
+    {
+      if(keyspec == DSCMD_KEY_COUNT)
+        snprintf(buf, sizeof(buf), "%lld", count);
+      else
+        snprintf(buf, sizeof(buf), "OK");
+
+      *res = (unsigned char *)dsarena_strdup(arena, buf);
+      *res_size = strlen(buf) + 1;
+      if(!*res)
+        rc = -1;
+    }
+  }
+
+  for(i = 0; i < groups_num; i++)
+    if(groups[i].reply)
+      freeReplyObject(groups[i].reply);
+
+  return rc;
+}
+
+
+void* dscluster_create(const char *address, int port)
+{
+  PCLUSTER cluster = (PCLUSTER)calloc(1, sizeof(CLUSTER));
+  if(!cluster)
+  {
+    dslogerr(errno, "Cannot allocate cluster");
+    return NULL;
+  }
+
+  if(!_node(cluster, address, port))
+  {
+    free(cluster);
+    return NULL;
+  }
+
+  // cluster which is down at start is loaded later
+  cluster->stale = 1;
+  _refresh(cluster);
+
+  return cluster;
+}
+
+
+void dscluster_free(void *cluster_ctx)
+{
+  PCLUSTER cluster = (PCLUSTER)cluster_ctx;
+  if(!cluster)
+    return;
+
+  while(cluster->nodes)
+  {
+    PCLUSTER_NODE node = cluster->nodes;
+    cluster->nodes = node->next;
+
+    dsredis_free(node->redis_ctx);
+    free(node->address);
+    free(node);
+  }
+
+  free(cluster);
+}
+
+
+int dscluster_run(PDSARENA arena, void *cluster_ctx, const char *cmd, unsigned char **res, int *res_size)
+{
+  PCLUSTER cluster = (PCLUSTER)cluster_ctx;
+  DSCMD_KEYITER keys;
+  const char *key;
+  int key_len;
+
+  _refresh(cluster);
+
+  int keyspec = dscmd_keys_begin(cmd, &keys);
+  if(keyspec == DSCMD_KEY_UNKNOWN)
+  {
+    dscmd_arg(cmd, 0, &key, &key_len);
+    dslogw("Command %.*s cannot be sent to cluster, its keys are unknown", key_len, key);
+    return DSREDIS_ERROR;
+  }
+
+  if(keyspec == DSCMD_KEY_NONE || dscmd_keys_next(&keys, &key, &key_len))
+  {
+    int merge = dscmd_keyspace(cmd);
+    if(merge == DSCMD_KEY_UNKNOWN)
+    {
+      dscmd_arg(cmd, 0, &key, &key_len);
+      dslogw("Command %.*s cannot be sent to cluster, its answer holds for one node", key_len, key);
+      return DSREDIS_ERROR;
+    }
+
+    return _run_all(arena, cluster, cmd, merge, res, res_size);
+  }
+
+  // node refuses keys of other slots itself
+  if(keyspec != DSCMD_KEY_SINGLE && keyspec != DSCMD_KEY_MULTI)
+    return _run_split(arena, cluster, cmd, keyspec, res, res_size);
+
+  redisReply *reply = _run(cluster, _slot_node(cluster, _slot(key, key_len)), cmd);
+
+  int rc = dsredis_reply(arena, reply, res, res_size);
+
+  if(reply)
+    freeReplyObject(reply);
+
+  return rc;
+}
@@ -0,0 +1,10 @@
+#ifndef DSCLUSTER_H
+#define DSCLUSTER_H
+
+#include "dsarena.h"
+
+void* dscluster_create(const char *address, int port);
+void  dscluster_free(void *cluster);
+int   dscluster_run(PDSARENA arena, void *cluster, const char *cmd, unsigned char **res, int *res_size);
+
+#endif /* DSCLUSTER_H */
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dscodel.h"
+#include "dsmisc.h"
+
+
+
+// CoDel as RFC 8289 describes it, checked when command leaves the queue
+
+
+static long long g_target_us = DSCODEL_TARGET_MS * 1000;
+static long long g_interval_us = DSCODEL_INTERVAL_MS * 1000;
+
+static long long g_first_above_us = 0; // delay stays above target since then
+static long long g_drop_next_us = 0;
+static int       g_dropping = 0;
+static int       g_count = 0;          // drops in current dropping state
+static int       g_lastcount = 0;
+
+static long long g_dropped = 0;
+static long long g_sojourn_us = 0;
+
+
+
+static long long _isqrt(long long n)
+{
+  long long x = n, y = (x + 1) / 2;
+
+  while(y < x)
+  {
+    x = y;
+    y = (x + n / x) / 2;
+  }
+
+  return x;
+}
+
+
+// drops go more often while delay stays high
+static long long _control_law(long long t_us, int count)
+{
+  return t_us + g_interval_us * 1000 / _isqrt((long long)count * 1000000);
+}
+
+
+void dscodel_init(int target_ms, int interval_ms)
+{
+  g_target_us = target_ms * 1000LL;
+  g_interval_us = interval_ms * 1000LL;
+}
+
+
+// true when command should be answered as overloaded
+int dscodel_drop(long long sojourn_us, long long now_us)
+{
+  int ok_to_drop = 0;
+
+  g_sojourn_us = sojourn_us;
+
+  if(sojourn_us < g_target_us)
+  {
+    g_first_above_us = 0;
+  }
+  else if(!g_first_above_us)
+  {
+    g_first_above_us = now_us + g_interval_us;
+  }
+  else if(now_us >= g_first_above_us)
+  {
+    ok_to_drop = 1;
+  }
+
+  if(g_dropping)
+  {
+    if(!ok_to_drop)
+    {
+      g_dropping = 0;
+      dslog("Queue delay is back under %lld ms", g_target_us / 1000);
+    }
+    else if(now_us >= g_drop_next_us)
+    {
+      g_count++;
+      g_drop_next_us = _control_law(g_drop_next_us, g_count);
+      g_dropped++;
+      return 1;
+    }
+  }
+  else if(ok_to_drop)
+  {
+    // recent dropping state continues with its rate
+    int delta = g_count - g_lastcount;
+    g_count = delta > 1 && now_us - g_drop_next_us < 16 * g_interval_us ? delta : 1;
+    g_drop_next_us = _control_law(now_us, g_count);
+    g_lastcount = g_count;
+    g_dropping = 1;
+    g_dropped++;
+
+    dslogw("Queue delay %lld ms is above %lld ms, shedding load", sojourn_us / 1000, g_target_us / 1000);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+void dscodel_stats(PDSCODEL_STATS stats)
+{
+  stats->dropped = g_dropped;
+  stats->sojourn_us = g_sojourn_us;
+  stats->dropping = g_dropping;
+}
@@ -0,0 +1,18 @@
+#ifndef DSCODEL_H
+#define DSCODEL_H
+
+#define DSCODEL_TARGET_MS   5   // acceptable standing queue delay
+#define DSCODEL_INTERVAL_MS 100 // delay has to stay above target that long
+
+typedef struct _dscodel_stats {
+  long long dropped;
+  long long sojourn_us; // queue delay of the last command
+  int dropping;
+
+} DSCODEL_STATS, *PDSCODEL_STATS;
+
+void dscodel_init(int target_ms, int interval_ms);
+int  dscodel_drop(long long sojourn_us, long long now_us);
+void dscodel_stats(PDSCODEL_STATS stats);
+
+#endif /* DSCODEL_H */
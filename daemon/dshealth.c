@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <hiredis/hiredis.h>
+
+#include "dshealth.h"
+#include "dsredis.h"
+#include "dsmisc.h"
+
+
+
+#define WINDOW_SIZE       20   // last outcomes kept per target
+#define OPEN_FAILURES     3    // consecutive failures open breaker
+#define OPEN_FAILURE_PCT  50   // so does this share of failures in full window
+#define SLOW_MS           500  // slower answer counts as failure
+#define PROBE_INTERVAL_MS 500
+#define PROBE_TIMEOUT_MS  250
+#define LATENCY_WEIGHT    8    // new sample weights 1/8
+
+
+typedef struct _breaker {
+  char *address;
+  int port;
+
+  int state;
+  unsigned int history; // bit per outcome, set for failure
+  int outcomes;         // in history
+  int consecutive;      // failures in a row
+  int trial;            // command of half-open breaker is in flight
+  long long latency_us; // average of answered commands
+
+  long long failures;
+  long long opened;
+  long long rejected;
+  long long probes;
+  long long probe_us;
+
+  void *probe_ctx;      // belongs to probe thread
+  struct _breaker *next;
+
+} BREAKER, *PBREAKER;
+
+
+static PBREAKER         g_breakers = NULL;
+static pthread_mutex_t  g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        g_thread;
+static volatile int     g_running = 0;
+
+
+
+static void _set_state(PBREAKER breaker, int state)
+{
+  if(breaker->state == state)
+    return;
+
+  if(state == DSHEALTH_OPEN)
+  {
+    breaker->opened++;
+    dslogw("Database %s:%d is failing, commands are rejected", breaker->address, breaker->port);
+  }
+  else if(state == DSHEALTH_HALF_OPEN)
+  {
+    dslog("Database %s:%d answers probes, trying commands", breaker->address, breaker->port);
+  }
+  else
+  {
+    dslog("Database %s:%d is back", breaker->address, breaker->port);
+    breaker->history = 0;
+    breaker->outcomes = 0;
+    breaker->consecutive = 0;
+  }
+
+  breaker->state = state;
+  breaker->trial = 0;
+}
+
+
+// Called under lock
+static void _record(PBREAKER breaker, int failed)
+{
+  breaker->history = ((breaker->history << 1) | (failed ? 1 : 0)) & ((1u << WINDOW_SIZE) - 1);
+  if(breaker->outcomes < WINDOW_SIZE)
+    breaker->outcomes++;
+  breaker->consecutive = failed ? breaker->consecutive + 1 : 0;
+  if(failed)
+    breaker->failures++;
+
+  if(breaker->state == DSHEALTH_HALF_OPEN)
+  {
+    _set_state(breaker, failed ? DSHEALTH_OPEN : DSHEALTH_CLOSED);
+  }
+  else if(breaker->state == DSHEALTH_CLOSED && failed)
+  {
+    int count = __builtin_popcount(breaker->history);
+    if(breaker->consecutive >= OPEN_FAILURES ||
+       (breaker->outcomes == WINDOW_SIZE && count * 100 >= OPEN_FAILURE_PCT * WINDOW_SIZE))
+      _set_state(breaker, DSHEALTH_OPEN);
+  }
+}
+
+
+// Open breaker is half-opened by successful probe, closed one counts probe
+// as any other command. Half-open breaker waits for its trial command.
+static void _probe(PBREAKER breaker)
+{
+  pthread_mutex_lock(&g_lock);
+  int state = breaker->state;
+  pthread_mutex_unlock(&g_lock);
+
+  if(state == DSHEALTH_HALF_OPEN)
+    return;
+
+  long long start_us = dsclock_us();
+
+  if(breaker->probe_ctx && dsredis_broken(breaker->probe_ctx))
+  {
+    dsredis_free(breaker->probe_ctx);
+    breaker->probe_ctx = NULL;
+  }
+
+  if(!breaker->probe_ctx)
+    breaker->probe_ctx = dsredis_connect_timeout(breaker->address, breaker->port, PROBE_TIMEOUT_MS);
+
+  int ok = 0;
+  if(breaker->probe_ctx)
+  {
+    redisReply *reply = redisCommand((redisContext *)breaker->probe_ctx, "PING");
+    ok = reply && reply->type == REDIS_REPLY_STATUS;
+    if(reply)
+      freeReplyObject(reply);
+  }
+
+  long long latency_us = dsclock_us() - start_us;
+  int failed = !ok || latency_us > SLOW_MS * 1000;
+
+  pthread_mutex_lock(&g_lock);
+
+  breaker->probes++;
+  if(ok)
+    breaker->probe_us = latency_us;
+
+  if(breaker->state == DSHEALTH_OPEN)
+  {
+    if(!failed)
+      _set_state(breaker, DSHEALTH_HALF_OPEN);
+  }
+  else if(breaker->state == DSHEALTH_CLOSED)
+    _record(breaker, failed);
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+static void* _probe_thread(void *arg)
+{
+  PBREAKER breaker;
+
+  while(g_running)
+  {
+    for(breaker = g_breakers; g_running && breaker; breaker = breaker->next)
+      _probe(breaker);
+
+    usleep(PROBE_INTERVAL_MS * 1000);
+  }
+
+  return NULL;
+}
+
+
+void* dshealth_open(const char *address, int port)
+{
+  PBREAKER breaker = (PBREAKER)calloc(1, sizeof(BREAKER));
+  if(!breaker)
+  {
+    dslogerr(errno, "Cannot allocate breaker");
+    return NULL;
+  }
+
+  breaker->address = strdup(address);
+  breaker->port = port;
+  breaker->state = DSHEALTH_CLOSED;
+
+  breaker->next = g_breakers;
+  g_breakers = breaker;
+
+  return breaker;
+}
+
+
+int dshealth_start(void)
+{
+  if(!g_breakers)
+    return 0;
+
+  g_running = 1;
+
+  int rc = pthread_create(&g_thread, NULL, _probe_thread, NULL);
+  if(rc)
+  {
+    g_running = 0;
+    dslogerr(rc, "Cannot start probe thread");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Half-open breaker lets single command through, its result is reported
+int dshealth_allow(void *breaker)
+{
+  PBREAKER _breaker = (PBREAKER)breaker;
+  int allowed = 1;
+
+  if(!_breaker)
+    return 1;
+
+  pthread_mutex_lock(&g_lock);
+
+  if(_breaker->state == DSHEALTH_OPEN)
+  {
+    allowed = 0;
+  }
+  else if(_breaker->state == DSHEALTH_HALF_OPEN)
+  {
+    allowed = !_breaker->trial;
+    _breaker->trial = 1;
+  }
+
+  if(!allowed)
+    _breaker->rejected++;
+
+  pthread_mutex_unlock(&g_lock);
+
+  return allowed;
+}
+
+
+int dshealth_closed(void *breaker)
+{
+  PBREAKER _breaker = (PBREAKER)breaker;
+
+  if(!_breaker)
+    return 1;
+
+  pthread_mutex_lock(&g_lock);
+  int closed = _breaker->state == DSHEALTH_CLOSED;
+  pthread_mutex_unlock(&g_lock);
+
+  return closed;
+}
+
+
+// Error answered by database is success here, target itself works.
+// Command cut by its deadline tells nothing about target.
+void dshealth_report(void *breaker, int rc, long long latency_us)
+{
+  PBREAKER _breaker = (PBREAKER)breaker;
+
+  if(!_breaker)
+    return;
+
+  pthread_mutex_lock(&g_lock);
+
+  if(rc == DSREDIS_EXPIRED)
+    _breaker->trial = 0;
+  else if(_breaker->state != DSHEALTH_OPEN)
+    _record(_breaker, rc == DSREDIS_UNREACHABLE || latency_us > SLOW_MS * 1000);
+
+  // command cut by deadline took at least that long
+  if(rc != DSREDIS_UNREACHABLE && (rc != DSREDIS_EXPIRED || latency_us > _breaker->latency_us))
+  {
+    if(_breaker->latency_us)
+      _breaker->latency_us += (latency_us - _breaker->latency_us) / LATENCY_WEIGHT;
+    else
+      _breaker->latency_us = latency_us;
+  }
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+// Expected time of command on target, 0 while unknown
+long long dshealth_latency(void *breaker)
+{
+  PBREAKER _breaker = (PBREAKER)breaker;
+
+  if(!_breaker)
+    return 0;
+
+  pthread_mutex_lock(&g_lock);
+  long long latency_us = _breaker->latency_us;
+  pthread_mutex_unlock(&g_lock);
+
+  return latency_us;
+}
+
+
+void dshealth_stats(void *breaker, PDSHEALTH_STATS stats)
+{
+  PBREAKER _breaker = (PBREAKER)breaker;
+
+  pthread_mutex_lock(&g_lock);
+
+  stats->state = _breaker->state;
+  stats->failures = _breaker->failures;
+  stats->opened = _breaker->opened;
+  stats->rejected = _breaker->rejected;
+  stats->probes = _breaker->probes;
+  stats->probe_us = _breaker->probe_us;
+  stats->latency_us = _breaker->latency_us;
+
+  pthread_mutex_unlock(&g_lock);
+}
+
+
+void dshealth_release(void)
+{
+  if(g_running)
+  {
+    g_running = 0;
+    pthread_join(g_thread, NULL);
+  }
+
+  while(g_breakers)
+  {
+    PBREAKER breaker = g_breakers;
+    g_breakers = breaker->next;
+
+    dsredis_free(breaker->probe_ctx);
+    free(breaker->address);
+    free(breaker);
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef DSHEALTH_H
+#define DSHEALTH_H
+
+#define DSHEALTH_CLOSED    0  // commands go to target
+#define DSHEALTH_OPEN      1  // target is failing, commands are not sent
+#define DSHEALTH_HALF_OPEN 2  // single trial command decides
+
+#define DSHEALTH_REJECTED  -3 // command is not sent to open target
+
+typedef struct _dshealth_stats {
+  int state;
+  long long failures;  // unreachable or slow answers
+  long long opened;    // times breaker was opened
+  long long rejected;  // commands failed fast
+  long long probes;
+  long long probe_us;  // latency of the last successful probe
+  long long latency_us; // average of answered commands
+
+} DSHEALTH_STATS, *PDSHEALTH_STATS;
+
+void* dshealth_open(const char *address, int port);
+int   dshealth_start(void);
+int   dshealth_allow(void *breaker);
+int   dshealth_closed(void *breaker);
+void  dshealth_report(void *breaker, int rc, long long latency_us);
+long long dshealth_latency(void *breaker);
+void  dshealth_stats(void *breaker, PDSHEALTH_STATS stats);
+void  dshealth_release(void);
+
+#endif /* DSHEALTH_H */
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE // mremap
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <hiredis/hiredis.h>
+
+#include "dsjournal.h"
+#include "dsredis.h"
+#include "dsmisc.h"
+
+
+
+#define JOURNAL_MAGIC         0x314a5344 // DSJ1
+#define JOURNAL_HEADER_SIZE   4096
+#define JOURNAL_INITIAL_SIZE  (1024 * 1024)
+#define JOURNAL_MAX_SIZE      (1024LL * 1024 * 1024)
+
+#define REPLAY_BATCH          64    // commands in one pipeline
+#define REPLAY_INTERVAL_MS    100   // journals are checked and synced to disk
+#define REPLAY_RETRY_MS       1000  // unreachable target is not tried meanwhile
+#define REPLAY_REPORT_MS      10000 // backlog is logged while it exists
+
+#define ENTRY_SIZE(size) ((sizeof(JOURNAL_ENTRY) + (size) + 7) & ~7LL)
+
+
+typedef struct _journal_header {
+  unsigned int magic;
+  unsigned int reserved;
+  long long read_off;  // the oldest entry not replayed yet
+  long long write_off; // end of the latest entry
+
+} JOURNAL_HEADER, *PJOURNAL_HEADER;
+
+typedef struct _journal_entry {
+  unsigned int size;   // of command with trailing 0
+  unsigned int crc;    // of time and command
+  long long time_us;   // wall clock of append
+  char cmd[];
+
+} JOURNAL_ENTRY, *PJOURNAL_ENTRY;
+
+typedef struct _journal {
+  char *address;
+  int port;
+  char *path;
+  int fd;
+
+  pthread_mutex_t lock; // map may move while it grows
+  unsigned char *map;
+  long long map_size;
+  PJOURNAL_HEADER header;
+  long long entries;
+  long long replayed;
+  long long failed;
+
+  void *redis_ctx;      // used by replay thread only
+  int held;             // writer sends commands older than entries made meanwhile
+  long long retry_us;
+  long long reported_us;
+  long long synced_off;
+
+  struct _journal *next;
+
+} JOURNAL, *PJOURNAL;
+
+
+static char          *g_dir = NULL;
+static PJOURNAL       g_journals = NULL;
+static unsigned int   g_crc_table[256];
+static pthread_t      g_thread;
+static volatile int   g_running = 0;
+
+
+
+static long long _time_us(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+// CRC-32 (IEEE)
+static void _crc_init(void)
+{
+  unsigned int i, j, crc;
+
+  for(i = 0; i < 256; i++)
+  {
+    crc = i;
+    for(j = 0; j < 8; j++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    g_crc_table[i] = crc;
+  }
+}
+
+
+static unsigned int _crc(unsigned int crc, const void *data, int size)
+{
+  const unsigned char *ptr = data;
+
+  crc = ~crc;
+  while(size-- > 0)
+    crc = g_crc_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+
+static unsigned int _entry_crc(PJOURNAL_ENTRY entry)
+{
+  unsigned int crc = _crc(0, &entry->time_us, sizeof(entry->time_us));
+
+  return _crc(crc, entry->cmd, entry->size);
+}
+
+
+static void _reset(PJOURNAL journal)
+{
+  journal->header->magic = JOURNAL_MAGIC;
+  journal->header->read_off = JOURNAL_HEADER_SIZE;
+  journal->header->write_off = JOURNAL_HEADER_SIZE;
+  journal->entries = 0;
+}
+
+
+// Entries are checked from the oldest one, journal is cut at the first
+// broken entry left by interrupted append
+static void _recover(PJOURNAL journal)
+{
+  PJOURNAL_HEADER header = journal->header;
+
+  if(header->magic != JOURNAL_MAGIC ||
+     header->read_off < JOURNAL_HEADER_SIZE || header->read_off > header->write_off ||
+     header->write_off > journal->map_size)
+  {
+    if(header->magic)
+      dslogw("Journal %s has bad header, dropped", journal->path);
+    _reset(journal);
+    return;
+  }
+
+  long long off = header->read_off;
+  while(off < header->write_off)
+  {
+    PJOURNAL_ENTRY entry = (PJOURNAL_ENTRY)(journal->map + off);
+    if(header->write_off - off < sizeof(JOURNAL_ENTRY) ||
+       header->write_off - off < ENTRY_SIZE(entry->size) ||
+       !entry->size || entry->cmd[entry->size - 1] ||
+       entry->crc != _entry_crc(entry))
+    {
+      dslogw("Journal %s is cut at broken entry %lld", journal->path, journal->entries);
+      header->write_off = off;
+      break;
+    }
+
+    off += ENTRY_SIZE(entry->size);
+    journal->entries++;
+  }
+
+  if(journal->entries)
+    dslog("Journal %s has %lld entries to replay", journal->path, journal->entries);
+}
+
+
+static int _resize(PJOURNAL journal, long long size)
+{
+  if(ftruncate(journal->fd, size))
+  {
+    dslogerr(errno, "Cannot resize journal %s", journal->path);
+    return -1;
+  }
+
+  void *map = mremap(journal->map, journal->map_size, size, MREMAP_MAYMOVE);
+  if(map == MAP_FAILED)
+  {
+    dslogerr(errno, "Cannot remap journal %s", journal->path);
+    return -1;
+  }
+
+  journal->map = map;
+  journal->map_size = size;
+  journal->header = (PJOURNAL_HEADER)map;
+
+  return 0;
+}
+
+
+// Called under lock
+static int _reserve(PJOURNAL journal, long long size)
+{
+  long long need = journal->header->write_off + size;
+  if(need <= journal->map_size)
+    return 0;
+
+  long long map_size = journal->map_size;
+  while(map_size < need)
+    map_size *= 2;
+
+  if(map_size > JOURNAL_MAX_SIZE)
+  {
+    dslog("Journal %s is full", journal->path);
+    return -1;
+  }
+
+  return _resize(journal, map_size);
+}
+
+
+// Entries are sent in pipelined batches in the order of append. Entry is
+// removed once the target answered it, so only the batch in flight may be
+// applied twice when connection breaks.
+static void _replay(PJOURNAL journal)
+{
+  char *batch = NULL;
+  long long batch_size = 0;
+
+  if(__atomic_load_n(&journal->held, __ATOMIC_ACQUIRE) || dsclock_us() < journal->retry_us || !dsjournal_pending(journal))
+    return;
+
+  if(journal->redis_ctx && dsredis_broken(journal->redis_ctx))
+  {
+    dsredis_free(journal->redis_ctx);
+    journal->redis_ctx = NULL;
+  }
+
+  if(!journal->redis_ctx)
+  {
+    journal->redis_ctx = dsredis_connect(journal->address, journal->port);
+    if(!journal->redis_ctx)
+    {
+      journal->retry_us = dsclock_us() + REPLAY_RETRY_MS * 1000;
+      return;
+    }
+    dslog("Replay journal %s, %lld entries", journal->path, journal->entries);
+  }
+
+  redisContext *c = (redisContext *)journal->redis_ctx;
+
+  while(g_running)
+  {
+    int i, num = 0, acked = 0, failed = 0;
+    long long size = 0, done = 0;
+
+    // batch is copied out, map may move while main thread appends
+    pthread_mutex_lock(&journal->lock);
+
+    long long off = journal->header->read_off;
+    while(off + size < journal->header->write_off && num < REPLAY_BATCH)
+    {
+      size += ENTRY_SIZE(((PJOURNAL_ENTRY)(journal->map + off + size))->size);
+      num++;
+    }
+
+    if(size > batch_size)
+    {
+      char *ptr = (char *)realloc(batch, size);
+      if(!ptr)
+        num = 0;
+      else
+      {
+        batch = ptr;
+        batch_size = size;
+      }
+    }
+
+    if(num)
+      memcpy(batch, journal->map + off, size);
+
+    pthread_mutex_unlock(&journal->lock);
+
+    if(!num)
+      break;
+
+    for(i = 0, off = 0; i < num; i++)
+    {
+      PJOURNAL_ENTRY entry = (PJOURNAL_ENTRY)(batch + off);
+      redisAppendCommand(c, entry->cmd);
+      off += ENTRY_SIZE(entry->size);
+    }
+
+    for(i = 0; i < num; i++)
+    {
+      PJOURNAL_ENTRY entry = (PJOURNAL_ENTRY)(batch + done);
+      redisReply *reply = NULL;
+
+      if(redisGetReply(c, (void **)&reply) != REDIS_OK)
+        break;
+
+      if(reply->type == REDIS_REPLY_ERROR)
+      {
+        dslogw("Replayed command \"%s\" failed on %s:%d: %s", entry->cmd, journal->address, journal->port, reply->str);
+        failed++;
+      }
+      freeReplyObject(reply);
+
+      done += ENTRY_SIZE(entry->size);
+      acked++;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+
+    journal->header->read_off += done;
+    journal->entries -= acked;
+    journal->replayed += acked;
+    journal->failed += failed;
+
+    if(journal->header->read_off == journal->header->write_off)
+    {
+      _reset(journal);
+      if(journal->map_size > JOURNAL_INITIAL_SIZE)
+        _resize(journal, JOURNAL_INITIAL_SIZE);
+      journal->synced_off = 0;
+      dslog("Journal %s is replayed, %lld entries in total", journal->path, journal->replayed);
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+
+    if(acked < num)
+    {
+      dslog("Replay connection to %s:%d broken, %d entries done", journal->address, journal->port, acked);
+      journal->retry_us = dsclock_us() + REPLAY_RETRY_MS * 1000;
+      break;
+    }
+  }
+
+  free(batch);
+}
+
+
+static void _report(PJOURNAL journal)
+{
+  DSJOURNAL_STATS stats;
+  long long now_us = dsclock_us();
+
+  if(now_us < journal->reported_us + REPLAY_REPORT_MS * 1000)
+    return;
+
+  dsjournal_stats(journal, &stats);
+  if(!stats.entries)
+    return;
+
+  journal->reported_us = now_us;
+  dslogw("Journal %s has %lld entries, %lld bytes, lag %lld ms", journal->path, stats.entries, stats.size, stats.lag_ms);
+}
+
+
+// Appended entries reach disk in groups, not one by one
+static void _sync(PJOURNAL journal)
+{
+  pthread_mutex_lock(&journal->lock);
+  long long write_off = journal->header->write_off;
+  pthread_mutex_unlock(&journal->lock);
+
+  if(write_off == journal->synced_off)
+    return;
+
+  if(fdatasync(journal->fd))
+    dslogerr(errno, "Cannot sync journal %s", journal->path);
+  else
+    journal->synced_off = write_off;
+}
+
+
+static void* _replay_thread(void *arg)
+{
+  PJOURNAL journal;
+
+  while(g_running)
+  {
+    for(journal = g_journals; journal; journal = journal->next)
+    {
+      _sync(journal);
+      _replay(journal);
+      _report(journal);
+    }
+
+    usleep(REPLAY_INTERVAL_MS * 1000);
+  }
+
+  return NULL;
+}
+
+
+int dsjournal_init(const char *dir)
+{
+  struct stat st;
+
+  if(stat(dir, &st) || !S_ISDIR(st.st_mode))
+  {
+    dslog("Journal directory %s does not exist", dir);
+    return -1;
+  }
+
+  g_dir = strdup(dir);
+  _crc_init();
+
+  return 0;
+}
+
+
+void* dsjournal_open(const char *address, int port)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "%s/%s_%d.journal", g_dir, address, port);
+
+  PJOURNAL journal = (PJOURNAL)calloc(1, sizeof(JOURNAL));
+  if(!journal)
+  {
+    dslogerr(errno, "Cannot allocate journal");
+    return NULL;
+  }
+
+  journal->fd = open(path, O_RDWR | O_CREAT, 0600);
+  if(journal->fd < 0 || fstat(journal->fd, &st))
+  {
+    dslogerr(errno, "Cannot open journal %s", path);
+    if(journal->fd >= 0)
+      close(journal->fd);
+    free(journal);
+    return NULL;
+  }
+
+  journal->map_size = st.st_size;
+  if(journal->map_size < JOURNAL_INITIAL_SIZE)
+  {
+    journal->map_size = JOURNAL_INITIAL_SIZE;
+    if(ftruncate(journal->fd, journal->map_size))
+      dslogerr(errno, "Cannot resize journal %s", path);
+  }
+
+  journal->map = mmap(NULL, journal->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  if(journal->map == MAP_FAILED)
+  {
+    dslogerr(errno, "Cannot map journal %s", path);
+    close(journal->fd);
+    free(journal);
+    return NULL;
+  }
+
+  journal->header = (PJOURNAL_HEADER)journal->map;
+  journal->address = strdup(address);
+  journal->port = port;
+  journal->path = strdup(path);
+  pthread_mutex_init(&journal->lock, NULL);
+
+  _recover(journal);
+
+  journal->next = g_journals;
+  g_journals = journal;
+
+  return journal;
+}
+
+
+int dsjournal_start(void)
+{
+  if(!g_journals)
+    return 0;
+
+  g_running = 1;
+  int rc = pthread_create(&g_thread, NULL, _replay_thread, NULL);
+  if(rc)
+  {
+    dslogerr(rc, "Cannot start journal replay thread");
+    g_running = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// true when entries wait for replay, new writes have to follow them
+int dsjournal_pending(void *journal)
+{
+  PJOURNAL _journal = (PJOURNAL)journal;
+
+  pthread_mutex_lock(&_journal->lock);
+  int pending = _journal->header->read_off != _journal->header->write_off;
+  pthread_mutex_unlock(&_journal->lock);
+
+  return pending;
+}
+
+
+// Replay waits while writer of the target has commands in flight
+void dsjournal_hold(void *journal, int hold)
+{
+  __atomic_store_n(&((PJOURNAL)journal)->held, hold, __ATOMIC_RELEASE);
+}
+
+
+int dsjournal_append(void *journal, const char *cmd)
+{
+  PJOURNAL _journal = (PJOURNAL)journal;
+  int size = strlen(cmd) + 1;
+
+  pthread_mutex_lock(&_journal->lock);
+
+  int rc = _reserve(_journal, ENTRY_SIZE(size));
+  if(!rc)
+  {
+    PJOURNAL_ENTRY entry = (PJOURNAL_ENTRY)(_journal->map + _journal->header->write_off);
+    entry->size = size;
+    entry->time_us = _time_us();
+    memcpy(entry->cmd, cmd, size);
+    entry->crc = _entry_crc(entry);
+
+    // entry is complete before it becomes visible in header
+    __sync_synchronize();
+    _journal->header->write_off += ENTRY_SIZE(size);
+    _journal->entries++;
+
+    dstrace("Command spilled to journal %s, %lld entries", _journal->path, _journal->entries);
+  }
+
+  pthread_mutex_unlock(&_journal->lock);
+
+  return rc;
+}
+
+
+void dsjournal_stats(void *journal, PDSJOURNAL_STATS stats)
+{
+  PJOURNAL _journal = (PJOURNAL)journal;
+
+  pthread_mutex_lock(&_journal->lock);
+
+  PJOURNAL_HEADER header = _journal->header;
+  stats->entries = _journal->entries;
+  stats->size = header->write_off - header->read_off;
+  stats->lag_ms = 0;
+  if(stats->entries)
+    stats->lag_ms = (_time_us() - ((PJOURNAL_ENTRY)(_journal->map + header->read_off))->time_us) / 1000;
+  stats->replayed = _journal->replayed;
+  stats->failed = _journal->failed;
+
+  pthread_mutex_unlock(&_journal->lock);
+}
+
+
+void dsjournal_release(void)
+{
+  if(g_running)
+  {
+    g_running = 0;
+    pthread_join(g_thread, NULL);
+  }
+
+  while(g_journals)
+  {
+    PJOURNAL journal = g_journals;
+    g_journals = journal->next;
+
+    msync(journal->map, journal->map_size, MS_SYNC);
+    munmap(journal->map, journal->map_size);
+    close(journal->fd);
+    dsredis_free(journal->redis_ctx);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->address);
+    free(journal->path);
+    free(journal);
+  }
+
+  free(g_dir);
+  g_dir = NULL;
+}
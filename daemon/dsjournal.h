@@ -0,0 +1,22 @@
+#ifndef DSJOURNAL_H
+#define DSJOURNAL_H
+
+typedef struct _dsjournal_stats {
+  long long entries;  // waiting for replay
+  long long size;     // bytes waiting for replay
+  long long lag_ms;   // age of the oldest waiting entry
+  long long replayed;
+  long long failed;   // replayed entries answered with error
+
+} DSJOURNAL_STATS, *PDSJOURNAL_STATS;
+
+int   dsjournal_init(const char *dir);
+void* dsjournal_open(const char *address, int port);
+int   dsjournal_start(void);
+int   dsjournal_pending(void *journal);
+void  dsjournal_hold(void *journal, int hold);
+int   dsjournal_append(void *journal, const char *cmd);
+void  dsjournal_stats(void *journal, PDSJOURNAL_STATS stats);
+void  dsjournal_release(void);
+
+#endif /* DSJOURNAL_H */
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "dslane.h"
+#include "dsmisc.h"
+
+
+
+// Lane is a thread running one job at a time. Main loop gives a job only
+// to idle lane and learns about finished jobs from the event descriptor.
+
+
+typedef struct _lane {
+  int index;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  void *job;            // given, not finished yet
+  int running;
+
+  long long jobs;
+  long long busy_us;
+
+  pthread_t thread;
+
+} LANE, *PLANE;
+
+
+static PLANE      g_lanes = NULL;
+static int        g_lanes_num = 0;
+static int        g_eventfd = -1;
+static DSLANE_RUN g_run = NULL;
+
+
+
+static void* _lane_thread(void *arg)
+{
+  PLANE lane = (PLANE)arg;
+  unsigned long long one = 1;
+
+  pthread_mutex_lock(&lane->lock);
+
+  while(1)
+  {
+    while(lane->running && !lane->job)
+      pthread_cond_wait(&lane->cond, &lane->lock);
+
+    if(!lane->job)
+      break;
+
+    void *job = lane->job;
+    pthread_mutex_unlock(&lane->lock);
+
+    long long start_us = dsclock_us();
+    g_run(job, lane->index);
+    long long busy_us = dsclock_us() - start_us;
+
+    pthread_mutex_lock(&lane->lock);
+    lane->job = NULL;
+    lane->jobs++;
+    lane->busy_us += busy_us;
+
+    if(write(g_eventfd, &one, sizeof(one)) < 0)
+      dslogerr(errno, "Cannot wake main loop");
+  }
+
+  pthread_mutex_unlock(&lane->lock);
+
+  return NULL;
+}
+
+
+int dslane_start(int lanes_num, DSLANE_RUN run)
+{
+  int i;
+
+  g_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(g_eventfd < 0)
+  {
+    dslogerr(errno, "Cannot create lane event");
+    return -1;
+  }
+
+  g_lanes = (PLANE)calloc(lanes_num, sizeof(LANE));
+  if(!g_lanes)
+  {
+    dslogerr(errno, "Cannot allocate lanes");
+    return -1;
+  }
+
+  g_run = run;
+
+  for(i = 0; i < lanes_num; i++)
+  {
+    PLANE lane = &g_lanes[i];
+
+    lane->index = i;
+    lane->running = 1;
+    pthread_mutex_init(&lane->lock, NULL);
+    pthread_cond_init(&lane->cond, NULL);
+
+    int rc = pthread_create(&lane->thread, NULL, _lane_thread, lane);
+    if(rc)
+    {
+      dslogerr(rc, "Cannot start lane thread");
+      pthread_cond_destroy(&lane->cond);
+      pthread_mutex_destroy(&lane->lock);
+      return -1;
+    }
+
+    g_lanes_num++;
+  }
+
+  dslog("%d lanes started", lanes_num);
+
+  return 0;
+}
+
+
+// Readable when any job is finished
+int dslane_fd(void)
+{
+  return g_eventfd;
+}
+
+
+int dslane_busy(int lane)
+{
+  pthread_mutex_lock(&g_lanes[lane].lock);
+  int busy = g_lanes[lane].job != NULL;
+  pthread_mutex_unlock(&g_lanes[lane].lock);
+
+  return busy;
+}
+
+
+int dslane_idle(void)
+{
+  int i;
+
+  for(i = 0; i < g_lanes_num; i++)
+    if(dslane_busy(i))
+      return 0;
+
+  return 1;
+}
+
+
+void dslane_push(int lane, void *job)
+{
+  pthread_mutex_lock(&g_lanes[lane].lock);
+  g_lanes[lane].job = job;
+  pthread_cond_signal(&g_lanes[lane].cond);
+  pthread_mutex_unlock(&g_lanes[lane].lock);
+}
+
+
+void dslane_drain(void)
+{
+  unsigned long long count;
+
+  while(read(g_eventfd, &count, sizeof(count)) > 0);
+}
+
+
+void dslane_stats(int lane, PDSLANE_STATS stats)
+{
+  pthread_mutex_lock(&g_lanes[lane].lock);
+
+  stats->busy = g_lanes[lane].job != NULL;
+  stats->jobs = g_lanes[lane].jobs;
+  stats->busy_us = g_lanes[lane].busy_us;
+
+  pthread_mutex_unlock(&g_lanes[lane].lock);
+}
+
+
+// Jobs given before are finished first
+void dslane_release(void)
+{
+  int i;
+
+  for(i = 0; i < g_lanes_num; i++)
+  {
+    PLANE lane = &g_lanes[i];
+
+    pthread_mutex_lock(&lane->lock);
+    lane->running = 0;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
+
+    pthread_join(lane->thread, NULL);
+
+    pthread_cond_destroy(&lane->cond);
+    pthread_mutex_destroy(&lane->lock);
+  }
+
+  free(g_lanes);
+  g_lanes = NULL;
+  g_lanes_num = 0;
+
+  if(g_eventfd >= 0)
+    close(g_eventfd);
+  g_eventfd = -1;
+}
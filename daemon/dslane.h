@@ -0,0 +1,24 @@
+#ifndef DSLANE_H
+#define DSLANE_H
+
+#define DSLANE_MAX 64
+
+typedef void (*DSLANE_RUN)(void *job, int lane);
+
+typedef struct _dslane_stats {
+  int busy;
+  long long jobs;
+  long long busy_us;  // time spent running jobs
+
+} DSLANE_STATS, *PDSLANE_STATS;
+
+int  dslane_start(int lanes_num, DSLANE_RUN run);
+int  dslane_fd(void);
+int  dslane_busy(int lane);
+int  dslane_idle(void);
+void dslane_push(int lane, void *job);
+void dslane_drain(void);
+void dslane_stats(int lane, PDSLANE_STATS stats);
+void dslane_release(void);
+
+#endif /* DSLANE_H */
@@ -2,19 +2,67 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 
 #include <hiredis/hiredis.h>
 
+#include "dsredis.h"
 #include "dsmisc.h"
 
 
 
-int dsredis(const char *hostname, int port, const char *cmd, unsigned char **res, int *res_size)
+static __thread long long g_deadline_us = 0; // of command run by the thread
+
+
+
+// Text of array element, nil one is empty
+static const char* _element(redisReply *element, char *buf)
+{
+  if(element->type == REDIS_REPLY_INTEGER)
+  {
+    snprintf(buf, 32, "%lld", element->integer);
+    return buf;
+  }
+
+  return element->str ? element->str : "";
+}
+
+
+// Timeout is cut to the time left till deadline of the thread command
+static int _timeout_ms(int timeout_ms)
+{
+  if(!g_deadline_us)
+    return timeout_ms;
+
+  long long left_ms = (g_deadline_us - dsclock_us()) / 1000;
+  if(left_ms < timeout_ms)
+    timeout_ms = left_ms > 1 ? left_ms : 1;
+
+  return timeout_ms;
+}
+
+
+static void _set_timeout(redisContext *c, int timeout_ms)
+{
+  struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+  redisSetTimeout(c, timeout);
+}
+
+
+// Commands of the calling thread are not waited for after deadline
+void dsredis_deadline(long long deadline_us)
+{
+  g_deadline_us = deadline_us;
+}
+
+
+// Timeout covers connection and every command, so hung server cannot block
+void* dsredis_connect_timeout(const char *hostname, int port, int timeout_ms)
 {
   redisContext *c;
-  redisReply *reply;
 
-  struct timeval timeout = { 1, 500000 }; // 1.5 seconds
+  int connect_ms = _timeout_ms(timeout_ms);
+  struct timeval timeout = { connect_ms / 1000, (connect_ms % 1000) * 1000 };
   c = redisConnectWithTimeout(hostname, port, timeout);
   if (c == NULL || c->err)
   {
@@ -28,53 +76,105 @@ int dsredis(const char *hostname, int port, const char *cmd, unsigned char **res
       dslog("REDIS connection error: can't allocate redis context");
     }
 
-    return -1;
+    return NULL;
   }
 
-  dstrace("Run redis command: \"%s\"", cmd);
+  _set_timeout(c, timeout_ms);
+
+  return c;
+}
+
+
+void* dsredis_connect(const char *hostname, int port)
+{
+  return dsredis_connect_timeout(hostname, port, DSREDIS_TIMEOUT_MS);
+}
+
+
+void dsredis_free(void *redis_ctx)
+{
+  if(redis_ctx)
+    redisFree((redisContext *)redis_ctx);
+}
+
+
+// true when connection is not usable anymore
+int dsredis_broken(void *redis_ctx)
+{
+  return ((redisContext *)redis_ctx)->err != 0;
+}
+
+
+// Idle connection closed by server reads as ready, command sent over it
+// would fail
+int dsredis_stale(void *redis_ctx)
+{
+  struct pollfd pfd;
 
-  reply = redisCommand(c, cmd);
+  pfd.fd = ((redisContext *)redis_ctx)->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  return poll(&pfd, 1, 0) != 0;
+}
+
+
+// Converts answer to text, array elements are joined by new line
+int dsredis_reply(PDSARENA arena, void *redis_reply, unsigned char **res, int *res_size)
+{
+  redisReply *reply = (redisReply *)redis_reply;
 
   int i, rc = 0;
   if(!reply)
   {
     dstrace("Redis NO result");
-    rc = -1;
+    rc = DSREDIS_UNREACHABLE;
   }
   else if(reply->type == REDIS_REPLY_ERROR)
   {
     dstrace("Redis ERROR result: \"%s\"", reply->str);
-    rc = -1;
+    rc = DSREDIS_ERROR;
   }
   else if(reply->type == REDIS_REPLY_ARRAY)
   {
+    char buf[32];
+
     *res_size = 0;
     for(i = 0; i < reply->elements; i++)
     {
-      dstrace("Redis ARRAY result #%d: \"%s\"", i, reply->element[i]->str);
-      *res_size += strlen(reply->element[i]->str) + 1;
+      dstrace("Redis ARRAY result #%d: \"%s\"", i, _element(reply->element[i], buf));
+      *res_size += strlen(_element(reply->element[i], buf)) + 1;
     }
-    *res = (unsigned char *)malloc(*res_size);
-    *res[0] = 0;
-    for(i = 0; i < reply->elements; i++)
+    *res = (unsigned char *)dsarena_alloc(arena, *res_size);
+    if(*res)
     {
-      strcat((char *)*res, reply->element[i]->str);
-      if(i < reply->elements - 1)
-        strcat((char *)*res, "\n");
+      // elements joined by new line, last one is followed by trailing 0
+      int len, offset = 0;
+      **res = 0;
+      for(i = 0; i < reply->elements; i++)
+      {
+        const char *str = _element(reply->element[i], buf);
+        len = strlen(str);
+        memcpy(*res + offset, str, len);
+        offset += len;
+        (*res)[offset++] = (i < reply->elements - 1) ? '\n' : 0;
+      }
     }
+    else
+      rc = -1;
   }
   else if(reply->type == REDIS_REPLY_STRING)
   {
     dstrace("Redis STRING result: \"%s\"", reply->str);
     
-    *res = (unsigned char *)strdup(reply->str);
+    *res = (unsigned char *)dsarena_strdup(arena, reply->str);
     *res_size = strlen(reply->str) + 1;
   }
   else if(reply->type == REDIS_REPLY_STATUS)
   {
     dstrace("Redis STATUS result: \"%s\"", reply->str);
     
-    *res = (unsigned char *)strdup(reply->str);
+    *res = (unsigned char *)dsarena_strdup(arena, reply->str);
     *res_size = strlen(reply->str) + 1;
   }
   else if(reply->type == REDIS_REPLY_INTEGER)
@@ -83,7 +183,7 @@ int dsredis(const char *hostname, int port, const char *cmd, unsigned char **res
     
     char buf[32];
     snprintf(buf, sizeof(buf), "%lld", reply->integer);
-    *res = (unsigned char *)strdup(buf);
+    *res = (unsigned char *)dsarena_strdup(arena, buf);
     *res_size = strlen(buf) + 1;
   }
   else if(reply->type == REDIS_REPLY_NIL)
@@ -92,10 +192,138 @@ int dsredis(const char *hostname, int port, const char *cmd, unsigned char **res
     *res_size = 0;
   }
 
+  return rc;
+}
+
+
+// Array answer in joined form is appended to another one, part stays in
+// arena as answer when it is the first
+int dsredis_join(PDSARENA arena, unsigned char **res, int *res_size, unsigned char *part, int part_size)
+{
+  if(part_size <= 0)
+    return 0;
+
+  if(*res_size <= 0)
+  {
+    *res = part;
+    *res_size = part_size;
+    return 0;
+  }
+
+  unsigned char *joined = (unsigned char *)dsarena_realloc(arena, *res, *res_size, *res_size + part_size);
+  if(!joined)
+    return -1;
+
+  joined[*res_size - 1] = '\n';
+  memcpy(joined + *res_size, part, part_size);
+  *res = joined;
+  *res_size += part_size;
+
+  return 0;
+}
+
+
+// Array answer is returned element by element, nil element is NULL
+int dsredis_reply_elements(PDSARENA arena, void *redis_reply, char ***elements, int *elements_num)
+{
+  redisReply *reply = (redisReply *)redis_reply;
+
+  int i, rc = 0;
+  char buf[32];
+  if(!reply)
+  {
+    dstrace("Redis NO result");
+    rc = DSREDIS_UNREACHABLE;
+  }
+  else if(reply->type != REDIS_REPLY_ARRAY)
+  {
+    dstrace("Redis result is not array: %d", reply->type);
+    rc = -1;
+  }
+  else
+  {
+    *elements_num = reply->elements;
+    *elements = (char **)dsarena_alloc(arena, reply->elements * sizeof(char *));
+    for(i = 0; *elements && i < reply->elements; i++)
+    {
+      if(reply->element[i]->type == REDIS_REPLY_NIL)
+        (*elements)[i] = NULL;
+      else if(!((*elements)[i] = dsarena_strdup(arena, _element(reply->element[i], buf))))
+        break;
+    }
+    if(!*elements || i < reply->elements)
+      rc = -1;
+  }
+
+  return rc;
+}
+
+
+int dsredis_run(PDSARENA arena, void *redis_ctx, const char *cmd, unsigned char **res, int *res_size)
+{
+  dstrace("Run redis command: \"%s\"", cmd);
+
+  if(g_deadline_us)
+    _set_timeout((redisContext *)redis_ctx, _timeout_ms(DSREDIS_TIMEOUT_MS));
+
+  redisReply *reply = redisCommand((redisContext *)redis_ctx, cmd);
+
+  if(g_deadline_us)
+    _set_timeout((redisContext *)redis_ctx, DSREDIS_TIMEOUT_MS);
+
+  int rc = dsredis_reply(arena, reply, res, res_size);
+
+  if(reply)
+    freeReplyObject(reply);
+
+  return rc;
+}
+
+
+int dsredis_run_elements(PDSARENA arena, void *redis_ctx, const char *cmd, char ***elements, int *elements_num)
+{
+  dstrace("Run redis command: \"%s\"", cmd);
+
+  if(g_deadline_us)
+    _set_timeout((redisContext *)redis_ctx, _timeout_ms(DSREDIS_TIMEOUT_MS));
+
+  redisReply *reply = redisCommand((redisContext *)redis_ctx, cmd);
+
+  if(g_deadline_us)
+    _set_timeout((redisContext *)redis_ctx, DSREDIS_TIMEOUT_MS);
+
+  int rc = dsredis_reply_elements(arena, reply, elements, elements_num);
+
   if(reply)
     freeReplyObject(reply);
 
-  redisFree(c);
+  return rc;
+}
+
+
+int dsredis(PDSARENA arena, const char *hostname, int port, const char *cmd, unsigned char **res, int *res_size)
+{
+  void *c = dsredis_connect(hostname, port);
+  if(!c)
+    return DSREDIS_UNREACHABLE;
+
+  int rc = dsredis_run(arena, c, cmd, res, res_size);
+
+  dsredis_free(c);
+
+  return rc;
+}
+
+
+int dsredis_elements(PDSARENA arena, const char *hostname, int port, const char *cmd, char ***elements, int *elements_num)
+{
+  void *c = dsredis_connect(hostname, port);
+  if(!c)
+    return DSREDIS_UNREACHABLE;
+
+  int rc = dsredis_run_elements(arena, c, cmd, elements, elements_num);
+
+  dsredis_free(c);
 
   return rc;
 }
@@ -1,6 +1,27 @@
 #ifndef DSREDIS_H
 #define DSREDIS_H
 
-int dsredis(const char *hostname, int port, const char *cmd, unsigned char **res, int *res_size);
+#include "dsarena.h"
+
+#define DSREDIS_ERROR       -1 // database answered with error
+#define DSREDIS_UNREACHABLE -2 // no connection or it broke
+#define DSREDIS_EXPIRED     -4 // deadline of command passed
+
+#define DSREDIS_TIMEOUT_MS  1500
+
+void  dsredis_deadline(long long deadline_us);
+void* dsredis_connect(const char *hostname, int port);
+void* dsredis_connect_timeout(const char *hostname, int port, int timeout_ms);
+void  dsredis_free(void *redis_ctx);
+int   dsredis_broken(void *redis_ctx);
+int   dsredis_stale(void *redis_ctx);
+int   dsredis_reply(PDSARENA arena, void *redis_reply, unsigned char **res, int *res_size);
+int   dsredis_join(PDSARENA arena, unsigned char **res, int *res_size, unsigned char *part, int part_size);
+int   dsredis_reply_elements(PDSARENA arena, void *redis_reply, char ***elements, int *elements_num);
+int   dsredis_run(PDSARENA arena, void *redis_ctx, const char *cmd, unsigned char **res, int *res_size);
+int   dsredis_run_elements(PDSARENA arena, void *redis_ctx, const char *cmd, char ***elements, int *elements_num);
+int   dsredis(PDSARENA arena, const char *hostname, int port, const char *cmd, unsigned char **res, int *res_size);
+
+int   dsredis_elements(PDSARENA arena, const char *hostname, int port, const char *cmd, char ***elements, int *elements_num);
 
 #endif /* DSREDIS_H */
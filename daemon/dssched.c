@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dssched.h"
+#include "dsmisc.h"
+
+
+
+// Weighted fair queuing of priority classes. Command gets finish tag when
+// it is queued and commands run in order of their tags. Virtual time is the
+// tag of the latest started command (self-clocked fair queuing), so class
+// coming back after idle time does not get credit for it.
+
+
+#define COMMAND_COST 1000000 // virtual time of command at weight 1
+
+
+static int       g_weights[DSPRIO_CLASSES] = { 8, 4, 1 };
+static long long g_virtual = 0;
+static long long g_finish[DSPRIO_CLASSES]; // latest tag given in class
+
+static long long g_commands[DSPRIO_CLASSES];
+static long long g_deferred = 0;
+
+
+
+// Comma separated weights from interactive to batch class
+int dssched_init(const char *weights)
+{
+  int i;
+  const char *pstr = weights;
+
+  for(i = 0; i < DSPRIO_CLASSES; i++)
+  {
+    int weight = atoi(pstr);
+    if(weight <= 0 || weight > COMMAND_COST)
+    {
+      dslog("Error: Bad weight of priority class %d in \"%s\"", i, weights);
+      return -1;
+    }
+
+    g_weights[i] = weight;
+
+    pstr = strchr(pstr, ',');
+    if(!pstr)
+      break;
+    pstr++;
+  }
+
+  // missing classes get the weight of the last given one
+  for(i++; i < DSPRIO_CLASSES; i++)
+    g_weights[i] = g_weights[i - 1];
+
+  return 0;
+}
+
+
+long long dssched_tag(int priority)
+{
+  long long start = g_finish[priority] > g_virtual ? g_finish[priority] : g_virtual;
+
+  g_finish[priority] = start + COMMAND_COST / g_weights[priority];
+
+  return g_finish[priority];
+}
+
+
+void dssched_start(int priority, long long tag)
+{
+  if(tag > g_virtual)
+    g_virtual = tag;
+
+  g_commands[priority]++;
+}
+
+
+void dssched_defer(void)
+{
+  g_deferred++;
+}
+
+
+void dssched_stats(PDSSCHED_STATS stats)
+{
+  memcpy(stats->weights, g_weights, sizeof(g_weights));
+  memcpy(stats->commands, g_commands, sizeof(g_commands));
+  stats->deferred = g_deferred;
+}
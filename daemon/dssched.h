@@ -0,0 +1,19 @@
+#ifndef DSSCHED_H
+#define DSSCHED_H
+
+#include "dspack.h"
+
+typedef struct _dssched_stats {
+  int weights[DSPRIO_CLASSES];
+  long long commands[DSPRIO_CLASSES]; // started in class
+  long long deferred;                 // left for the next poll pass
+
+} DSSCHED_STATS, *PDSSCHED_STATS;
+
+int  dssched_init(const char *weights);
+long long dssched_tag(int priority);
+void dssched_start(int priority, long long tag);
+void dssched_defer(void);
+void dssched_stats(PDSSCHED_STATS stats);
+
+#endif /* DSSCHED_H */
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "dsshard.h"
+#include "dscmd.h"
+#include "dsmisc.h"
+
+
+typedef struct _ring_point {
+  unsigned long long hash;
+  void *target;
+
+} RING_POINT, *PRING_POINT;
+
+
+static PRING_POINT g_ring = NULL;
+static int         g_ring_size = 0;
+
+
+// FNV-1a spreads similar short strings poorly, finalizer mixes the bits
+static unsigned long long _hash(const void *data, int size)
+{
+  unsigned long long hash = dshash(data, size);
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+
+static int _compare(const void *a, const void *b)
+{
+  unsigned long long ha = ((PRING_POINT)a)->hash;
+  unsigned long long hb = ((PRING_POINT)b)->hash;
+
+  return ha < hb ? -1 : ha > hb;
+}
+
+
+// Ring points depend on target name only, so adding or removing target
+// moves keys of that target and leaves others in place
+int dsshard_add(const char *name, void *target)
+{
+  int i;
+  char point[256];
+
+  PRING_POINT ring = (PRING_POINT)realloc(g_ring, (g_ring_size + DSSHARD_VNODES) * sizeof(RING_POINT));
+  if(!ring)
+  {
+    dslogerr(errno, "Cannot allocate hash ring");
+    return -1;
+  }
+  g_ring = ring;
+
+  for(i = 0; i < DSSHARD_VNODES; i++)
+  {
+    int len = snprintf(point, sizeof(point), "%s#%d", name, i);
+    g_ring[g_ring_size].hash = _hash(point, len);
+    g_ring[g_ring_size].target = target;
+    g_ring_size++;
+  }
+
+  qsort(g_ring, g_ring_size, sizeof(RING_POINT), _compare);
+
+  dstrace("Shard %s added, ring size %d", name, g_ring_size);
+
+  return 0;
+}
+
+
+// Key hash tag is honored, see dscmd_keytag
+void* dsshard_target(const char *key, int key_len)
+{
+  if(!g_ring_size)
+    return NULL;
+
+  dscmd_keytag(&key, &key_len);
+
+  unsigned long long hash = _hash(key, key_len);
+
+  // first point clockwise from the key hash
+  int lo = 0, hi = g_ring_size;
+  while(lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if(g_ring[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return g_ring[lo < g_ring_size ? lo : 0].target;
+}
+
+
+void dsshard_release(void)
+{
+  free(g_ring);
+  g_ring = NULL;
+  g_ring_size = 0;
+}
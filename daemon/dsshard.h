@@ -0,0 +1,10 @@
+#ifndef DSSHARD_H
+#define DSSHARD_H
+
+#define DSSHARD_VNODES 160 // ring points per target
+
+int   dsshard_add(const char *name, void *target);
+void* dsshard_target(const char *key, int key_len);
+void  dsshard_release(void);
+
+#endif /* DSSHARD_H */
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dsstats.h"
+#include "dshist.h"
+#include "dsmisc.h"
+
+
+
+// Every thread counts into its own block, so counting takes neither lock
+// nor locked instruction. Owner thread is the only writer of its block,
+// readers sum blocks of all threads with relaxed loads. Latency histograms
+// have log-linear buckets of dshist.
+
+
+typedef struct _histogram {
+  long long errors;
+  long long max_us;
+  long long buckets[DSHIST_BUCKETS];
+
+} HISTOGRAM, *PHISTOGRAM;
+
+typedef struct _thread_stats {
+  long long counters[DSSTATS_COUNTERS];
+  HISTOGRAM queue;
+  HISTOGRAM verify;
+  HISTOGRAM classes[DSSTATS_CLASSES];
+  HISTOGRAM targets[];
+
+} THREAD_STATS, *PTHREAD_STATS;
+
+
+static PTHREAD_STATS *g_threads = NULL;
+static int            g_threads_num = 0;
+static int            g_targets_num = 0;
+static __thread PTHREAD_STATS g_mine = NULL; // of the calling thread, threads not bound count nothing
+
+
+
+// only the owner thread writes, readers never see torn values
+static void _add(long long *value, long long n)
+{
+  __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+
+static long long _load(const long long *value)
+{
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+
+static void _record(PHISTOGRAM histogram, int failed, long long latency_us)
+{
+  if(failed)
+    _add(&histogram->errors, 1);
+
+  if(latency_us < 0)
+    return;
+
+  _add(&histogram->buckets[dshist_bucket(latency_us)], 1);
+  if(latency_us > histogram->max_us)
+    __atomic_store_n(&histogram->max_us, latency_us, __ATOMIC_RELAXED);
+}
+
+
+// Histogram at the same offset of every thread block is summed
+static void _latency(size_t offset, PDSSTATS_LATENCY latency)
+{
+  long long buckets[DSHIST_BUCKETS];
+  int t, i;
+
+  memset(latency, 0, sizeof(DSSTATS_LATENCY));
+  memset(buckets, 0, sizeof(buckets));
+
+  for(t = 0; t < g_threads_num; t++)
+  {
+    PHISTOGRAM histogram = (PHISTOGRAM)((char *)g_threads[t] + offset);
+
+    latency->errors += _load(&histogram->errors);
+    long long max_us = _load(&histogram->max_us);
+    if(max_us > latency->max_us)
+      latency->max_us = max_us;
+
+    for(i = 0; i < DSHIST_BUCKETS; i++)
+    {
+      long long n = _load(&histogram->buckets[i]);
+      buckets[i] += n;
+      latency->count += n;
+    }
+  }
+
+  latency->p50_us = dshist_quantile(buckets, latency->count, latency->max_us, 500);
+  latency->p99_us = dshist_quantile(buckets, latency->count, latency->max_us, 990);
+  latency->p999_us = dshist_quantile(buckets, latency->count, latency->max_us, 999);
+}
+
+
+// Thread 0 is the main loop, lanes follow it
+int dsstats_init(int targets_num, int threads_num)
+{
+  int t;
+  size_t size = sizeof(THREAD_STATS) + targets_num * sizeof(HISTOGRAM);
+
+  size = (size + 63) & ~(size_t)63; // blocks of threads do not share cache lines
+
+  g_threads = (PTHREAD_STATS *)calloc(threads_num, sizeof(PTHREAD_STATS));
+  if(!g_threads)
+  {
+    dslogerr(errno, "Cannot allocate statistics");
+    return -1;
+  }
+
+  for(t = 0; t < threads_num; t++)
+  {
+    g_threads[t] = (PTHREAD_STATS)aligned_alloc(64, size);
+    if(!g_threads[t])
+    {
+      dslogerr(errno, "Cannot allocate statistics");
+      dsstats_release();
+      return -1;
+    }
+
+    memset(g_threads[t], 0, size);
+    g_threads_num++;
+  }
+
+  g_targets_num = targets_num;
+
+  return 0;
+}
+
+
+void dsstats_thread(int thread)
+{
+  g_mine = thread < g_threads_num ? g_threads[thread] : NULL;
+}
+
+
+void dsstats_count(int counter, long long value)
+{
+  if(g_mine)
+    _add(&g_mine->counters[counter], value);
+}
+
+
+void dsstats_command(int cmdclass, int failed, long long latency_us)
+{
+  if(g_mine)
+    _record(&g_mine->classes[cmdclass], failed, latency_us);
+}
+
+
+// Negative latency counts error of command not sent to target
+void dsstats_target(int target, int rc, long long latency_us)
+{
+  if(g_mine && target < g_targets_num)
+    _record(&g_mine->targets[target], rc != 0, latency_us);
+}
+
+
+void dsstats_queue(long long sojourn_us)
+{
+  if(g_mine)
+    _record(&g_mine->queue, 0, sojourn_us);
+}
+
+
+void dsstats_verify(int failed, long long latency_us)
+{
+  if(g_mine)
+    _record(&g_mine->verify, failed, latency_us);
+}
+
+
+long long dsstats_counter(int counter)
+{
+  long long value = 0;
+  int t;
+
+  for(t = 0; t < g_threads_num; t++)
+    value += _load(&g_threads[t]->counters[counter]);
+
+  return value;
+}
+
+
+void dsstats_class_latency(int cmdclass, PDSSTATS_LATENCY latency)
+{
+  _latency(offsetof(THREAD_STATS, classes) + cmdclass * sizeof(HISTOGRAM), latency);
+}
+
+
+void dsstats_target_latency(int target, PDSSTATS_LATENCY latency)
+{
+  _latency(sizeof(THREAD_STATS) + target * sizeof(HISTOGRAM), latency);
+}
+
+
+void dsstats_queue_latency(PDSSTATS_LATENCY latency)
+{
+  _latency(offsetof(THREAD_STATS, queue), latency);
+}
+
+
+void dsstats_verify_latency(PDSSTATS_LATENCY latency)
+{
+  _latency(offsetof(THREAD_STATS, verify), latency);
+}
+
+
+void dsstats_release(void)
+{
+  int t;
+
+  for(t = 0; t < g_threads_num; t++)
+    free(g_threads[t]);
+  free(g_threads);
+
+  g_threads = NULL;
+  g_threads_num = 0;
+  g_targets_num = 0;
+}
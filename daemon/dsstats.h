@@ -0,0 +1,39 @@
+#ifndef DSSTATS_H
+#define DSSTATS_H
+
+#define DSSTATS_CLASSES 3 // of commands, indexed by dscmd class
+
+// counters of the main loop
+#define DSSTATS_ACCEPTED    0
+#define DSSTATS_CLOSED      1
+#define DSSTATS_TIMEOUTS    2 // connections closed idle
+#define DSSTATS_BAD_PACKETS 3 // malformed or failed signature check
+#define DSSTATS_BYTES_IN    4
+#define DSSTATS_BYTES_OUT   5
+#define DSSTATS_COUNTERS    6
+
+typedef struct _dsstats_latency {
+  long long count;
+  long long errors;
+  long long p50_us;
+  long long p99_us;
+  long long p999_us;
+  long long max_us;
+
+} DSSTATS_LATENCY, *PDSSTATS_LATENCY;
+
+int  dsstats_init(int targets_num, int threads_num);
+void dsstats_thread(int thread);
+void dsstats_count(int counter, long long value);
+void dsstats_command(int cmdclass, int failed, long long latency_us);
+void dsstats_target(int target, int rc, long long latency_us);
+void dsstats_queue(long long sojourn_us);
+void dsstats_verify(int failed, long long latency_us);
+long long dsstats_counter(int counter);
+void dsstats_class_latency(int cmdclass, PDSSTATS_LATENCY latency);
+void dsstats_target_latency(int target, PDSSTATS_LATENCY latency);
+void dsstats_queue_latency(PDSSTATS_LATENCY latency);
+void dsstats_verify_latency(PDSSTATS_LATENCY latency);
+void dsstats_release(void);
+
+#endif /* DSSTATS_H */
@@ -0,0 +1,811 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/io_uring.h>
+
+#include "dsuring.h"
+#include "dsmisc.h"
+
+
+
+// Engine keeps poll view of descriptors for main loop while io_uring does
+// the work: listeners accept in multishot mode, driver sockets receive in
+// multishot mode into buffers provided to the ring, answers are sent by the
+// ring. Other descriptors are watched by one-shot poll requests. Completions
+// are reaped from shared memory, single io_uring_enter submits everything
+// queued by the loop pass and waits for the next completion.
+//
+// Kernel work for completions is deferred till io_uring_enter, otherwise it
+// interrupts blocking database calls of main loop with EINTR.
+//
+// Request carries descriptor and its generation, generation is bumped once
+// descriptor is forgotten, so completions for closed descriptor are dropped.
+
+
+#define BUFS_NUM   1024 // power of 2
+#define BUF_SIZE   4096
+#define BUF_GROUP  0
+#define SLOTS_STEP 1024
+#define GEN_MASK   0xffffff
+
+#define OP_POLL      1
+#define OP_ACCEPT    2
+#define OP_RECV      3
+#define OP_SEND      4
+#define OP_SEND_POLL 5 // waits for room, send is linked to it
+#define OP_CANCEL    6
+
+#define KIND_POLL   0
+#define KIND_LISTEN 1
+#define KIND_STREAM 2
+
+
+typedef struct _slot {
+  int kind;
+  unsigned int gen;        // of descriptor, bumped once it is forgotten
+  unsigned int poll_gen;   // of the last poll request
+  int poll_mask;           // events of poll request in flight, 0 for none
+  int ready;               // events of finished poll request
+
+  int armed;               // multishot accept or receive is in flight
+
+  int *accepted;           // descriptors accepted by listener
+  int accepted_num;
+  int accepted_size;
+
+  int head;                // received buffers, -1 for none
+  int tail;
+  int offset;              // taken from head buffer
+  int eof;
+  int err;
+
+  int sending;             // send is in flight
+  int sent;                // send finished, its result is not taken yet
+  int send_res;
+  const void *send_buf;
+  int send_size;
+
+} SLOT, *PSLOT;
+
+
+static int            g_fd = -1;
+static void          *g_ring = MAP_FAILED;
+static size_t         g_ring_size = 0;
+static struct io_uring_sqe *g_sqes = MAP_FAILED;
+static size_t         g_sqes_size = 0;
+
+static unsigned int  *g_sq_khead;
+static unsigned int  *g_sq_ktail;
+static unsigned int  *g_sq_array;
+static unsigned int   g_sq_mask;
+static unsigned int   g_sq_entries;
+static unsigned int   g_sq_tail;        // queued, published to kernel before enter
+
+static unsigned int  *g_cq_khead;
+static unsigned int  *g_cq_ktail;
+static unsigned int   g_cq_mask;
+static struct io_uring_cqe *g_cqes;
+
+static struct io_uring_buf_ring *g_br = MAP_FAILED;
+static unsigned short g_br_tail = 0;
+static unsigned char *g_bufs = NULL;
+static int           *g_lens = NULL;    // received into buffer
+static int           *g_next = NULL;    // buffer received after this one
+static int            g_free_bufs = 0;  // owned by kernel
+
+static PSLOT          g_slots = NULL;   // indexed by descriptor
+static int            g_slots_num = 0;
+
+static DSURING_STATS  g_stats;
+
+
+
+static unsigned long long _data(int op, unsigned int gen, int fd)
+{
+  return (unsigned long long)op << 56 | (unsigned long long)(gen & GEN_MASK) << 32 | (unsigned int)fd;
+}
+
+
+static PSLOT _slot(int fd)
+{
+  if(fd >= g_slots_num)
+  {
+    int num = (fd / SLOTS_STEP + 1) * SLOTS_STEP;
+    PSLOT slots = (PSLOT)realloc(g_slots, num * sizeof(SLOT));
+    if(!slots)
+    {
+      dslogerr(errno, "Cannot allocate io_uring descriptors");
+      return NULL;
+    }
+
+    memset(slots + g_slots_num, 0, (num - g_slots_num) * sizeof(SLOT));
+    for(int i = g_slots_num; i < num; i++)
+      slots[i].head = slots[i].tail = -1;
+
+    g_slots = slots;
+    g_slots_num = num;
+  }
+
+  return &g_slots[fd];
+}
+
+
+static unsigned int _queued(void)
+{
+  return g_sq_tail - __atomic_load_n(g_sq_khead, __ATOMIC_ACQUIRE);
+}
+
+
+// Submits queued requests, runs deferred completions and waits for
+// min_complete of them unless 0
+static int _enter(unsigned int min_complete, int timeout_ms)
+{
+  unsigned int to_submit = _queued();
+  __atomic_store_n(g_sq_ktail, g_sq_tail, __ATOMIC_RELEASE);
+
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  memset(&arg, 0, sizeof(arg));
+
+  if(min_complete && timeout_ms >= 0)
+  {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = (unsigned long long)(unsigned long)&ts;
+  }
+
+  g_stats.syscalls++;
+  int rc = syscall(__NR_io_uring_enter, g_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg));
+  if(rc < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+    return -1;
+
+  return 0;
+}
+
+
+static int _room(unsigned int n)
+{
+  if(_queued() + n <= g_sq_entries)
+    return 0;
+
+  _enter(0, 0);
+  if(_queued() + n <= g_sq_entries)
+    return 0;
+
+  dslogw("Submission queue of io_uring is full");
+  return -1;
+}
+
+
+static struct io_uring_sqe* _sqe(int op, unsigned int gen, int fd)
+{
+  if(_room(1))
+    return NULL;
+
+  unsigned int index = g_sq_tail & g_sq_mask;
+  struct io_uring_sqe *sqe = &g_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = fd;
+  sqe->user_data = _data(op, gen, fd);
+  g_sq_array[index] = index;
+  g_sq_tail++;
+
+  return sqe;
+}
+
+
+static void _cancel(unsigned long long user_data)
+{
+  struct io_uring_sqe *sqe = _sqe(OP_CANCEL, 0, -1);
+  if(!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data;
+}
+
+
+// Buffer goes back to kernel
+static void _recycle(int bid)
+{
+  struct io_uring_buf *buf = &g_br->bufs[g_br_tail & (BUFS_NUM - 1)];
+  buf->addr = (unsigned long)(g_bufs + bid * BUF_SIZE);
+  buf->len = BUF_SIZE;
+  buf->bid = bid;
+
+  g_br_tail++;
+  __atomic_store_n(&g_br->tail, g_br_tail, __ATOMIC_RELEASE);
+  g_free_bufs++;
+}
+
+
+static void _poll(int fd, PSLOT slot, int mask)
+{
+  if(slot->poll_mask)
+    _cancel(_data(OP_POLL, slot->poll_gen, fd));
+  slot->poll_mask = 0;
+
+  struct io_uring_sqe *sqe = _sqe(OP_POLL, slot->poll_gen + 1, fd);
+  if(!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->poll32_events = mask;
+
+  slot->poll_gen++;
+  slot->poll_mask = mask;
+  slot->ready = 0;
+}
+
+
+static void _accept(int fd, PSLOT slot)
+{
+  struct io_uring_sqe *sqe = _sqe(OP_ACCEPT, slot->gen, fd);
+  if(!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+
+  slot->armed = 1;
+}
+
+
+static void _recv(int fd, PSLOT slot)
+{
+  struct io_uring_sqe *sqe = _sqe(OP_RECV, slot->gen, fd);
+  if(!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+
+  slot->armed = 1;
+}
+
+
+// Send found full socket is retried once socket is writable, poll and send
+// are linked to go in one submission
+static int _send(int fd, PSLOT slot, int wait_room)
+{
+  struct io_uring_sqe *sqe;
+
+  if(_room(wait_room ? 2 : 1))
+    return -1;
+
+  if(wait_room)
+  {
+    sqe = _sqe(OP_SEND_POLL, slot->gen, fd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+  }
+
+  sqe = _sqe(OP_SEND, slot->gen, fd);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->addr = (unsigned long)slot->send_buf;
+  sqe->len = slot->send_size;
+  sqe->msg_flags = MSG_NOSIGNAL;
+
+  slot->sending = 1;
+  return 0;
+}
+
+
+static void _complete(struct io_uring_cqe *cqe)
+{
+  int op = cqe->user_data >> 56;
+  unsigned int gen = (cqe->user_data >> 32) & GEN_MASK;
+  int fd = (int)(cqe->user_data & 0xffffffff);
+  int res = cqe->res;
+  int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  g_stats.completions++;
+  if(bid >= 0)
+    g_free_bufs--;
+
+  PSLOT slot = fd >= 0 && fd < g_slots_num ? &g_slots[fd] : NULL;
+  int current = slot && (slot->gen & GEN_MASK) == gen;
+
+  switch(op)
+  {
+    case OP_POLL:
+      if(slot && (slot->poll_gen & GEN_MASK) == gen)
+      {
+        slot->poll_mask = 0;
+        slot->ready |= res >= 0 ? res : POLLERR;
+      }
+      break;
+
+    case OP_ACCEPT:
+      if(!current || slot->kind != KIND_LISTEN)
+      {
+        if(res >= 0)
+          close(res);
+        break;
+      }
+
+      if(!more)
+        slot->armed = 0;
+
+      if(res >= 0)
+      {
+        if(slot->accepted_num == slot->accepted_size)
+        {
+          int size = slot->accepted_size ? slot->accepted_size * 2 : 64;
+          int *accepted = (int *)realloc(slot->accepted, size * sizeof(int));
+          if(!accepted)
+          {
+            dslogerr(errno, "Cannot keep accepted connection");
+            close(res);
+            break;
+          }
+          slot->accepted = accepted;
+          slot->accepted_size = size;
+        }
+        slot->accepted[slot->accepted_num++] = res;
+      }
+      else if(res != -ECANCELED && res != -EAGAIN)
+        dslogerr(-res, "Fail to accept new connection");
+      break;
+
+    case OP_RECV:
+      if(!current || slot->kind != KIND_STREAM)
+      {
+        if(bid >= 0)
+          _recycle(bid);
+        break;
+      }
+
+      if(!more)
+        slot->armed = 0;
+
+      if(res > 0 && bid >= 0)
+      {
+        g_lens[bid] = res;
+        g_next[bid] = -1;
+        if(slot->tail >= 0)
+          g_next[slot->tail] = bid;
+        else
+          slot->head = bid;
+        slot->tail = bid;
+        break;
+      }
+
+      if(bid >= 0)
+        _recycle(bid);
+
+      // out of buffers receive is armed again once they are back
+      if(res == 0)
+        slot->eof = 1;
+      else if(res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -ECANCELED)
+        slot->err = -res;
+      break;
+
+    case OP_SEND:
+      if(!current || !slot->sending)
+        break;
+
+      slot->sending = 0;
+      if(res == -EAGAIN && !_send(fd, slot, 1))
+        break;
+
+      slot->sent = 1;
+      slot->send_res = res;
+      break;
+  }
+}
+
+
+static void _reap(void)
+{
+  unsigned int head = *g_cq_khead;
+  unsigned int tail = __atomic_load_n(g_cq_ktail, __ATOMIC_ACQUIRE);
+
+  while(head != tail)
+    _complete(&g_cqes[head++ & g_cq_mask]);
+
+  __atomic_store_n(g_cq_khead, head, __ATOMIC_RELEASE);
+}
+
+
+// Fills revents as poll does and queues requests for descriptors to watch
+static int _ready(struct pollfd *pollfds, int nfds)
+{
+  int ready = 0;
+
+  for(int i = 0; i < nfds; i++)
+  {
+    struct pollfd *pollfd = &pollfds[i];
+    pollfd->revents = 0;
+    if(pollfd->fd < 0)
+      continue;
+
+    PSLOT slot = _slot(pollfd->fd);
+    if(!slot)
+    {
+      pollfd->revents = POLLERR;
+      ready++;
+      continue;
+    }
+
+    if(slot->kind == KIND_LISTEN)
+    {
+      if(!slot->armed)
+        _accept(pollfd->fd, slot);
+      if(slot->accepted_num)
+        pollfd->revents = pollfd->events & POLLIN;
+    }
+    else if(slot->kind == KIND_STREAM)
+    {
+      if(!slot->armed && !slot->eof && !slot->err && g_free_bufs > 0)
+        _recv(pollfd->fd, slot);
+      if(slot->head >= 0 || slot->eof || slot->err)
+        pollfd->revents |= pollfd->events & POLLIN;
+      if(!slot->sending)
+        pollfd->revents |= pollfd->events & POLLOUT;
+    }
+    else
+    {
+      int wanted = pollfd->events & (POLLIN | POLLOUT);
+      if(slot->ready & (wanted | POLLERR | POLLHUP))
+      {
+        pollfd->revents = slot->ready & (wanted | POLLERR | POLLHUP);
+        slot->ready = 0;
+      }
+      else if(wanted && (slot->poll_mask & wanted) != wanted)
+        _poll(pollfd->fd, slot, wanted);
+    }
+
+    if(pollfd->revents)
+      ready++;
+  }
+
+  return ready;
+}
+
+
+// Multishot receive needs 6.0 and deferred completions 6.1, wait timeout
+// and provided buffer ring are checked by setup
+int dsuring_init(int entries)
+{
+  struct utsname un;
+  int major = 0, minor = 0;
+
+  if(uname(&un) || sscanf(un.release, "%d.%d", &major, &minor) != 2 || major < 6 || (major == 6 && minor < 1))
+  {
+    dslogw("Kernel %s is older than 6.1 needed by io_uring", un.release);
+    return -1;
+  }
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER |
+                 IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = entries * 4;
+
+  g_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if(g_fd < 0)
+  {
+    dslogerr(errno, "Cannot set up io_uring");
+    return -1;
+  }
+
+  if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+     !(params.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    dslogw("io_uring lacks features of kernel 6.1");
+    goto fail;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  g_ring_size = sq_size > cq_size ? sq_size : cq_size;
+  g_ring = mmap(NULL, g_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_fd, IORING_OFF_SQ_RING);
+  g_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  g_sqes = (struct io_uring_sqe *)mmap(NULL, g_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, g_fd, IORING_OFF_SQES);
+  if(g_ring == MAP_FAILED || g_sqes == MAP_FAILED)
+  {
+    dslogerr(errno, "Cannot map io_uring");
+    goto fail;
+  }
+
+  unsigned char *ring = (unsigned char *)g_ring;
+  g_sq_khead = (unsigned int *)(ring + params.sq_off.head);
+  g_sq_ktail = (unsigned int *)(ring + params.sq_off.tail);
+  g_sq_array = (unsigned int *)(ring + params.sq_off.array);
+  g_sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+  g_sq_entries = params.sq_entries;
+  g_sq_tail = *g_sq_ktail;
+  g_cq_khead = (unsigned int *)(ring + params.cq_off.head);
+  g_cq_ktail = (unsigned int *)(ring + params.cq_off.tail);
+  g_cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+  g_cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+  g_br = (struct io_uring_buf_ring *)mmap(NULL, BUFS_NUM * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  g_bufs = (unsigned char *)malloc(BUFS_NUM * BUF_SIZE);
+  g_lens = (int *)malloc(BUFS_NUM * sizeof(int));
+  g_next = (int *)malloc(BUFS_NUM * sizeof(int));
+  if(g_br == MAP_FAILED || !g_bufs || !g_lens || !g_next)
+  {
+    dslogerr(errno, "Cannot allocate receive buffers");
+    goto fail;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)g_br;
+  reg.ring_entries = BUFS_NUM;
+  reg.bgid = BUF_GROUP;
+  if(syscall(__NR_io_uring_register, g_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+  {
+    dslogerr(errno, "Cannot register receive buffers");
+    goto fail;
+  }
+
+  g_br_tail = 0;
+  g_free_bufs = 0;
+  for(int bid = 0; bid < BUFS_NUM; bid++)
+    _recycle(bid);
+
+  memset(&g_stats, 0, sizeof(g_stats));
+  return 0;
+
+fail:
+  dsuring_release();
+  return -1;
+}
+
+
+int dsuring_listen(int fd)
+{
+  PSLOT slot = _slot(fd);
+  if(!slot)
+    return -1;
+
+  slot->kind = KIND_LISTEN;
+  return 0;
+}
+
+
+// Socket data is received by the ring from now on
+int dsuring_stream(int fd)
+{
+  PSLOT slot = _slot(fd);
+  if(!slot)
+    return -1;
+
+  slot->kind = KIND_STREAM;
+  return 0;
+}
+
+
+// Called before descriptor is closed. Send in flight is stopped by shutdown
+// as cancel may come after memory of answer is reused.
+void dsuring_forget(int fd)
+{
+  if(fd < 0 || fd >= g_slots_num)
+    return;
+
+  PSLOT slot = &g_slots[fd];
+
+  if(slot->poll_mask)
+    _cancel(_data(OP_POLL, slot->poll_gen, fd));
+  if(slot->armed)
+    _cancel(_data(slot->kind == KIND_LISTEN ? OP_ACCEPT : OP_RECV, slot->gen, fd));
+  if(slot->sending)
+  {
+    _cancel(_data(OP_SEND_POLL, slot->gen, fd));
+    _cancel(_data(OP_SEND, slot->gen, fd));
+    g_stats.syscalls++;
+    shutdown(fd, SHUT_RDWR);
+  }
+
+  while(slot->head >= 0)
+  {
+    int bid = slot->head;
+    slot->head = g_next[bid];
+    _recycle(bid);
+  }
+
+  for(int i = 0; i < slot->accepted_num; i++)
+    close(slot->accepted[i]);
+  free(slot->accepted);
+
+  unsigned int gen = slot->gen + 1;
+  unsigned int poll_gen = slot->poll_gen + 1;
+  memset(slot, 0, sizeof(SLOT));
+  slot->gen = gen;
+  slot->poll_gen = poll_gen;
+  slot->head = slot->tail = -1;
+}
+
+
+// Call is saved while descriptors are ready and nothing is queued
+int dsuring_poll(struct pollfd *pollfds, int nfds, int timeout_ms)
+{
+  _reap();
+  int ready = _ready(pollfds, nfds);
+
+  if(!ready || _queued())
+  {
+    if(_enter(ready ? 0 : 1, ready ? 0 : timeout_ms))
+      return -1;
+
+    if(!ready)
+    {
+      _reap();
+      ready = _ready(pollfds, nfds);
+    }
+  }
+
+  return ready;
+}
+
+
+// Takes connection accepted by the ring, EWOULDBLOCK when there is none
+int dsuring_accept(int fd, struct sockaddr *peer, socklen_t *peer_size)
+{
+  PSLOT slot = fd < g_slots_num ? &g_slots[fd] : NULL;
+  if(!slot || !slot->accepted_num)
+  {
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+
+  int newfd = slot->accepted[0];
+  memmove(slot->accepted, slot->accepted + 1, --slot->accepted_num * sizeof(int));
+
+  g_stats.syscalls++;
+  if(getpeername(newfd, peer, peer_size))
+  {
+    int err = errno;
+    close(newfd);
+    errno = err;
+    return -1;
+  }
+
+  return newfd;
+}
+
+
+// Returns as recv does, from buffers received by the ring
+int dsuring_recv(int fd, void *buf, int size)
+{
+  PSLOT slot = fd < g_slots_num ? &g_slots[fd] : NULL;
+  int n = 0;
+
+  if(!slot)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  while(slot->head >= 0 && n < size)
+  {
+    int bid = slot->head;
+    int chunk = g_lens[bid] - slot->offset;
+    if(chunk > size - n)
+      chunk = size - n;
+
+    memcpy((unsigned char *)buf + n, g_bufs + bid * BUF_SIZE + slot->offset, chunk);
+    n += chunk;
+    slot->offset += chunk;
+
+    if(slot->offset == g_lens[bid])
+    {
+      slot->head = g_next[bid];
+      if(slot->head < 0)
+        slot->tail = -1;
+      slot->offset = 0;
+      _recycle(bid);
+    }
+  }
+
+  if(n)
+    return n;
+
+  if(slot->err)
+  {
+    errno = slot->err;
+    return -1;
+  }
+
+  if(slot->eof)
+    return 0;
+
+  errno = EWOULDBLOCK;
+  return -1;
+}
+
+
+// Returns as send does. The first call submits send and gets EWOULDBLOCK,
+// the call after completion gets its result, so buffer has to stay the same
+// till then.
+int dsuring_send(int fd, const void *buf, int size)
+{
+  PSLOT slot = fd < g_slots_num ? &g_slots[fd] : NULL;
+
+  if(!slot)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  if(slot->sent)
+  {
+    slot->sent = 0;
+    if(slot->send_res < 0)
+    {
+      errno = -slot->send_res;
+      return -1;
+    }
+    return slot->send_res;
+  }
+
+  if(!slot->sending)
+  {
+    slot->send_buf = buf;
+    slot->send_size = size;
+    if(_send(fd, slot, 0))
+    {
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+
+  errno = EWOULDBLOCK;
+  return -1;
+}
+
+
+void dsuring_stats(PDSURING_STATS stats)
+{
+  *stats = g_stats;
+}
+
+
+void dsuring_release(void)
+{
+  for(int fd = 0; fd < g_slots_num; fd++)
+  {
+    for(int i = 0; i < g_slots[fd].accepted_num; i++)
+      close(g_slots[fd].accepted[i]);
+    free(g_slots[fd].accepted);
+  }
+  free(g_slots);
+  g_slots = NULL;
+  g_slots_num = 0;
+
+  if(g_ring != MAP_FAILED)
+    munmap(g_ring, g_ring_size);
+  if(g_sqes != MAP_FAILED)
+    munmap(g_sqes, g_sqes_size);
+  if(g_fd >= 0)
+    close(g_fd);
+  g_ring = MAP_FAILED;
+  g_sqes = MAP_FAILED;
+  g_fd = -1;
+
+  if(g_br != MAP_FAILED)
+    munmap(g_br, BUFS_NUM * sizeof(struct io_uring_buf));
+  g_br = MAP_FAILED;
+  free(g_bufs);
+  free(g_lens);
+  free(g_next);
+  g_bufs = NULL;
+  g_lens = NULL;
+  g_next = NULL;
+}
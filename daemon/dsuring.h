@@ -0,0 +1,26 @@
+#ifndef DSURING_H
+#define DSURING_H
+
+#include <sys/poll.h>
+#include <sys/socket.h>
+
+#define DSURING_ENTRIES 4096 // submission queue, completion queue is 4 times longer
+
+typedef struct _dsuring_stats {
+  long long syscalls;    // io_uring_enter and socket calls made by engine
+  long long completions;
+
+} DSURING_STATS, *PDSURING_STATS;
+
+int  dsuring_init(int entries);
+int  dsuring_listen(int fd);
+int  dsuring_stream(int fd);
+void dsuring_forget(int fd);
+int  dsuring_poll(struct pollfd *pollfds, int nfds, int timeout_ms);
+int  dsuring_accept(int fd, struct sockaddr *peer, socklen_t *peer_size);
+int  dsuring_recv(int fd, void *buf, int size);
+int  dsuring_send(int fd, const void *buf, int size);
+void dsuring_stats(PDSURING_STATS stats);
+void dsuring_release(void);
+
+#endif /* DSURING_H */
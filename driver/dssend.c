@@ -4,6 +4,7 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <errno.h>
@@ -11,45 +12,315 @@
 #include "dsmisc.h"
 #include "dspack.h"
 #include "dscrypto.h"
-
-
-
-#define CONNECTION_TIMEOUT_MS 3000
+#include "dszip.h"
+#include "dsring.h"
+#include "dscmd.h"
+#include "dshist.h"
+#include "dssend.h"
+
+
+
+#define CONNECTION_TIMEOUT_MS 3000    // default time for the whole call
+#define TIMEOUT_FIELD_SIZE    32
+#define PRIORITY_FIELD_SIZE   8
+#define DIGEST_FIELD_SIZE     8
+#define ZIP_FIELD_SIZE        16
+#define HEADER_READ_SIZE      64
+#define DAEMON_TAG            "dbsyncd:"
+#define DAEMON_TAG_SIZE       8
+#define LATENCY_EWMA_WEIGHT   8       // new sample weights 1/8 as TCP SRTT does
+#define LATENCY_DECAY_US      1000000 // estimation fades in time to retry slow servers
+#define BACKOFF_MIN_MS        250     // failed server is skipped, doubled on each failure
+#define BACKOFF_MAX_MS        30000
+#define UNIX_PREFIX           "unix:"
+#define UNIX_PORT             0       // of server on local socket, address is its path
 
 
 enum { DSSTATE_0 = 0, DSSTATE_CONN, DSSTATE_OUT, DSSTATE_IN, DSSTATE_ERR, DSSTATE_FIN };
 static const char *state_strings[] = {"DSSTATE_0", "DSSTATE_CONN", "DSSTATE_OUT", "DSSTATE_IN", "DSSTATE_ERR", "DSSTATE_FIN"};
 
+// Server state shared by all contexts of the worker process
+typedef struct _dsserver {
+  char  *address;
+  int   port;
+
+  double latency_us;    // EWMA of answer latency, 0 while not measured
+  long long updated_us; // time of latest latency sample
+
+  int failures;            // failed calls in a row
+  long long down_until_us; // skipped till then, the next call probes it
+  int zip;                 // answered in compressed frame, takes them too
+  int ring_failures;       // ring registrations failed in a row
+  long long ring_until_us; // rings are not offered till then
+  int sockfd;              // local connection of the worker kept between requests
+  void *ring;              // with its rings, taken by the next request
+
+  // statistics of the worker
+  long long calls;
+  long long answers;
+  long long call_failures;
+  long long overloaded;
+  long long mismatches;
+  long long bytes_out;
+  long long bytes_in;
+  DSHIST phases[DSSEND_SERVER_PHASES];
+
+  struct _dsserver *next;
+} DSSERVER, *PDSSERVER;
+
 typedef struct _dsconn {
   char  *address;
   int   port;
   int   sockfd;
-
-  char buf[64];
-  unsigned char *respkt;
+  void  *ring;          // shared memory rings with local daemon, socket stays for registration
+  void  *hello_ring;    // offered to daemon, taken when it answers registration
+  PDSSERVER server;
+  int   selected;       // takes part in current dssend call
+  int   aborted;        // dropped because other connection failed
+  int   overloaded;     // daemon refused command under load
+  int   digest_only;    // answers with digest of its answer in current call
+
+  unsigned char *respkt; // receive buffer, kept between calls
+  int respkt_bufsize;
+  unsigned char *zbuf;   // compressed answer is unpacked here, swapped with respkt
+  int zbuf_bufsize;
+  int zipped;            // answer came in compressed frame
   int respkt_size;
   int expected_size;
   int send_offset;
   int read_offset;
   int iostate;
   int inpoll;
+  long long phase_us;    // start of current phase of connection
 
   // managed in head instance
   int h_epollfd;
   struct epoll_event *h_epevents;
   int h_conns_num;
   int h_active_num;
+  int h_consistency;     // of current call
+  int h_keepalive;       // of current call, only kept connections take rings
+  long long h_deadline_us; // of current call, monotonic clock
+  char *h_msg;           // command with its fields, kept between calls
+  int h_msg_bufsize;
+  void *h_pkt;           // send buffer, kept between calls
+  int h_pkt_bufsize;
+  void *h_dpkt;          // send buffer of digest only servers
+  int h_dpkt_bufsize;
+  void *h_zip;           // compression context
+  void *h_zmsg;          // compressed message, kept between calls
+  int h_zmsg_bufsize;
+  long long h_phase_us[DSSEND_PHASES]; // of current call, -1 for phase not reached
 
   struct _dsconn *head;
   struct _dsconn *next;
 } DSCONN, *PDSCONN;
 
 
+static PDSSERVER    g_servers = NULL;
+static unsigned int g_route_seed = 0;
+static long long    g_calls = 0;
+static long long    g_failures = 0;
+static DSHIST       g_phases[DSSEND_PHASES];
+
+
+PDSSERVER get_server(const char *address, int port)
+{
+  PDSSERVER server;
+
+  for(server = g_servers; server; server = server->next)
+    if(server->port == port && !strcmp(server->address, address))
+      return server;
+
+  server = (PDSSERVER)calloc(1, sizeof(DSSERVER));
+  if(!server)
+  {
+    dslogerr(errno, "Cannot allocate server state");
+    return NULL;
+  }
+
+  server->address = strdup(address);
+  if(!server->address)
+  {
+    dslogerr(errno, "Cannot allocate server address");
+    free(server);
+    return NULL;
+  }
+
+  server->port = port;
+  server->latency_us = 0;
+  server->updated_us = 0;
+  server->failures = 0;
+  server->down_until_us = 0;
+  server->zip = 0;
+  server->ring_failures = 0;
+  server->ring_until_us = 0;
+  server->sockfd = -1;
+  server->ring = NULL;
+  server->next = g_servers;
+  g_servers = server;
+
+  return server;
+}
+
+
+void update_latency(PDSSERVER server, long long sample_us)
+{
+  if(server->latency_us > 0)
+    server->latency_us += (sample_us - server->latency_us) / LATENCY_EWMA_WEIGHT;
+  else
+    server->latency_us = sample_us;
+
+  server->updated_us = dsclock_us();
+}
+
+
+double estimate_latency(PDSSERVER server, long long now_us)
+{
+  return server->latency_us / (1 + (double)(now_us - server->updated_us) / LATENCY_DECAY_US);
+}
+
+
+long long backoff_ms(int failures)
+{
+  long long ms = BACKOFF_MIN_MS;
+  int i;
+  for(i = 0; i < failures && ms < BACKOFF_MAX_MS; i++)
+    ms *= 2;
+
+  return ms < BACKOFF_MAX_MS ? ms : BACKOFF_MAX_MS;
+}
+
+
+// Server is skipped after failure for exponentially growing time, the first
+// call after it is a probe
+void update_health(PDSSERVER server, int ok)
+{
+  if(ok)
+  {
+    if(server->failures)
+      dslog("Server %s:%d is back after %d failures", server->address, server->port, server->failures);
+
+    server->failures = 0;
+    server->down_until_us = 0;
+    return;
+  }
+
+  long long skip_ms = backoff_ms(server->failures);
+
+  server->failures++;
+  server->down_until_us = dsclock_us() + skip_ms * 1000;
+
+  dslogw("Server %s:%d is skipped for %lld ms", server->address, server->port, skip_ms);
+}
+
+
+// Daemon refusing rings is asked again with the same backoff as failed
+// server, connections go over the socket meanwhile
+void update_ring(PDSSERVER server, int ok)
+{
+  if(ok)
+  {
+    server->ring_failures = 0;
+    server->ring_until_us = 0;
+    return;
+  }
+
+  long long skip_ms = backoff_ms(server->ring_failures);
+
+  server->ring_failures++;
+  server->ring_until_us = dsclock_us() + skip_ms * 1000;
+
+  dslogw("Rings are not offered to %s for %lld ms", server->address, skip_ms);
+}
+
+
+int server_up(PDSSERVER server, long long now_us)
+{
+  return server->down_until_us <= now_us;
+}
+
+
+// xorshift, good enough to pick routing candidates
+unsigned int route_random(void)
+{
+  if(!g_route_seed)
+    g_route_seed = (unsigned int)(dsclock_us() ^ (getpid() << 16)) | 1;
+
+  g_route_seed ^= g_route_seed << 13;
+  g_route_seed ^= g_route_seed >> 17;
+  g_route_seed ^= g_route_seed << 5;
+
+  return g_route_seed;
+}
+
+
+// Power of two choices: two random alive connections, the faster one wins.
+// Servers skipped after failure are used only when nothing else is left.
+PDSCONN select_read_connection(PDSCONN head)
+{
+  PDSCONN ctx, first = NULL, second = NULL;
+  int alive = 0, up = 1;
+  long long now_us = dsclock_us();
+
+  for(ctx = head; ctx; ctx = ctx->next)
+    if(ctx->iostate != DSSTATE_ERR && server_up(ctx->server, now_us))
+      alive++;
+
+  if(!alive)
+  {
+    up = 0;
+    for(ctx = head; ctx; ctx = ctx->next)
+      if(ctx->iostate != DSSTATE_ERR)
+        alive++;
+  }
+
+  if(!alive)
+    return head;
+
+  int i1 = route_random() % alive;
+  int i2 = alive > 1 ? (i1 + 1 + route_random() % (alive - 1)) % alive : i1;
+
+  int i = 0;
+  for(ctx = head; ctx; ctx = ctx->next)
+  {
+    if(ctx->iostate == DSSTATE_ERR || (up && !server_up(ctx->server, now_us)))
+      continue;
+    if(i == i1)
+      first = ctx;
+    if(i == i2)
+      second = ctx;
+    i++;
+  }
+
+  if(estimate_latency(second->server, now_us) < estimate_latency(first->server, now_us))
+    first = second;
+
+  dstrace("Read routed to %s:%d", first->address, first->port);
+
+  return first;
+}
+
+
+// The fastest selected server sends full answer, others digest of theirs
+PDSCONN select_full_connection(PDSCONN head)
+{
+  PDSCONN ctx, full = NULL;
+  long long now_us = dsclock_us();
+
+  for(ctx = head; ctx; ctx = ctx->next)
+  {
+    if(ctx->selected &&
+       (!full || estimate_latency(ctx->server, now_us) < estimate_latency(full->server, now_us)))
+      full = ctx;
+  }
+
+  return full;
+}
+
+
 void reset_connection(PDSCONN ctx)
 {
-  if(ctx->respkt)
-    free(ctx->respkt);
-  ctx->respkt = NULL;
   ctx->respkt_size = 0;
   ctx->expected_size = -1;
   ctx->send_offset = 0;
@@ -57,11 +328,201 @@ void reset_connection(PDSCONN ctx)
 }
 
 
+void release_ring(PDSCONN ctx)
+{
+  if(ctx->ring)
+  {
+    dsring_free(ctx->ring);
+    ctx->ring = NULL;
+  }
+
+  if(ctx->hello_ring)
+  {
+    dsring_free(ctx->hello_ring);
+    ctx->hello_ring = NULL;
+  }
+}
+
+
+// Rings are set up once per worker, finished connection over them is handed
+// to server state when its context is released
+void park_ring(PDSCONN ctx)
+{
+  PDSSERVER server = ctx->server;
+
+  if(!ctx->ring || ctx->iostate != DSSTATE_FIN || server->ring)
+    return;
+
+  dstrace("Keep rings of %s for the next request", ctx->address);
+  server->sockfd = ctx->sockfd;
+  server->ring = ctx->ring;
+  ctx->sockfd = -1;
+  ctx->ring = NULL;
+}
+
+
+// returns 0 when kept rings are taken, they are dropped when daemon closed them
+int unpark_ring(PDSCONN ctx)
+{
+  PDSSERVER server = ctx->server;
+
+  if(!server->ring)
+    return -1;
+
+  ctx->sockfd = server->sockfd;
+  ctx->ring = server->ring;
+  server->sockfd = -1;
+  server->ring = NULL;
+
+  if(!dsring_closed(ctx->ring))
+  {
+    dstrace("Reuse rings of %s", ctx->address);
+    return 0;
+  }
+
+  dstrace("Connect again to %s, ring is closed by daemon", ctx->address);
+  release_ring(ctx);
+  close(ctx->sockfd);
+  ctx->sockfd = -1;
+
+  return -1;
+}
+
+
+int ring_hello(char *hello)
+{
+  return sprintf(hello, "%s:%d:%s", DSRING_TAG, (int)strlen(DSRING_VERSION), DSRING_VERSION);
+}
+
+
+// Rings are passed to daemon with registration frame, daemon sends it back
+// or drops connection when it does not take rings
+int offer_ring(PDSCONN ctx)
+{
+  char hello[HEADER_READ_SIZE];
+  int fds[DSRING_FDS];
+
+  void *ring = dsring_create();
+  if(!ring)
+    return -1;
+
+  int hello_size = ring_hello(hello);
+  dsring_fds(ring, fds);
+
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { hello, hello_size };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if(sendmsg(ctx->sockfd, &msg, 0) != hello_size)
+  {
+    dslogwerr(errno, "Cannot register ring at %s", ctx->address);
+    dsring_free(ring);
+    return -1;
+  }
+
+  ctx->hello_ring = ring;
+
+  return 0;
+}
+
+
+// returns 1 for need of polling, -1 for refused rings, 0 for taken ones,
+// they are moved to connection after its socket leaves polling
+int accept_ring(PDSCONN ctx)
+{
+  char hello[HEADER_READ_SIZE], answer[HEADER_READ_SIZE];
+  int hello_size = ring_hello(hello);
+
+  int rc = recv(ctx->sockfd, answer, sizeof(answer), 0);
+  if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 1;
+
+  if(rc != hello_size || memcmp(answer, hello, hello_size))
+  {
+    dslogw("Daemon at %s does not take rings", ctx->address);
+    release_ring(ctx);
+    update_ring(ctx->server, 0);
+    return -1;
+  }
+
+  dstrace("Ring is registered at %s", ctx->address);
+  update_ring(ctx->server, 1);
+
+  return 0;
+}
+
+
+// returns 1 for need of polling, -1 for error, 0 for success
+int create_unix_connection(PDSCONN ctx)
+{
+  struct sockaddr_un serv_addr;
+
+  if(ctx->head->h_keepalive && !unpark_ring(ctx))
+    return 0;
+
+  dstrace("Create connection to %s", ctx->address);
+
+  if(strlen(ctx->address) >= sizeof(serv_addr.sun_path))
+  {
+    dslog("Socket path '%s' is too long", ctx->address);
+    return -1;
+  }
+
+  bzero((char *) &serv_addr, sizeof(serv_addr));
+  serv_addr.sun_family = AF_UNIX;
+  strcpy(serv_addr.sun_path, ctx->address);
+
+  ctx->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(ctx->sockfd < 0)
+  {
+    dslogerr(errno, "Fail opening socket");
+    return -1;
+  }
+
+  // local connect completes at once or fails when daemon backlog is full
+  if(connect(ctx->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+  {
+    dslogwerr(errno, "Cannot connect to %s", ctx->address);
+    return -1;
+  }
+
+  // kept connection of worker goes over shared memory, the answer of daemon
+  // is polled with other connections
+  if(ctx->head->h_keepalive && ctx->server->ring_until_us <= dsclock_us())
+  {
+    if(!offer_ring(ctx))
+      return 1;
+
+    update_ring(ctx->server, 0);
+    close(ctx->sockfd);
+    ctx->sockfd = -1;
+    return create_unix_connection(ctx);
+  }
+
+  return 0;
+}
+
+
 // returns 1 for need of polling, -1 for error, 0 for success
 int create_connection(PDSCONN ctx)
 {
   struct sockaddr_in serv_addr;
 
+  if(ctx->port == UNIX_PORT)
+    return create_unix_connection(ctx);
+
   bzero((char *) &serv_addr, sizeof(serv_addr));
   serv_addr.sin_family = AF_INET;
   serv_addr.sin_port = htons(ctx->port);
@@ -99,14 +560,17 @@ int create_connection(PDSCONN ctx)
 }
 
 
-int sendbuf(int sockfd, const void *buf, int *send_size)
+int sendbuf(PDSCONN ctx, const void *buf, int *send_size)
 {
   int rc, buf_size = *send_size;
   *send_size = 0;
 
   while(*send_size < buf_size)
   {
-    rc = send(sockfd, buf + *send_size, buf_size - *send_size, 0);
+    if(ctx->ring)
+      rc = dsring_send(ctx->ring, buf + *send_size, buf_size - *send_size);
+    else
+      rc = send(ctx->sockfd, buf + *send_size, buf_size - *send_size, 0);
 
     if(rc > 0)
     {
@@ -138,7 +602,7 @@ int sendbuf(int sockfd, const void *buf, int *send_size)
 int sendpack(PDSCONN ctx, const char *msg, int size)
 {
   int send_size = size - ctx->send_offset;
-  if(sendbuf(ctx->sockfd, msg + ctx->send_offset, &send_size))
+  if(sendbuf(ctx, msg + ctx->send_offset, &send_size))
     return -1;
   
   ctx->send_offset += send_size;
@@ -150,14 +614,17 @@ int sendpack(PDSCONN ctx, const char *msg, int size)
 }
 
 
-int readbuf(int sockfd, void *buf, int *read_size)
+int readbuf(PDSCONN ctx, void *buf, int *read_size)
 {
   int rc, buf_size = *read_size;
   *read_size = 0;
 
   while(*read_size < buf_size)
   {
-    rc = recv(sockfd, buf + *read_size, buf_size - *read_size, 0);
+    if(ctx->ring)
+      rc = dsring_recv(ctx->ring, buf + *read_size, buf_size - *read_size);
+    else
+      rc = recv(ctx->sockfd, buf + *read_size, buf_size - *read_size, 0);
     if(rc > 0)
     {
       dstrace("Received answer chunk %d size", rc);
@@ -174,6 +641,10 @@ int readbuf(int sockfd, void *buf, int *read_size)
       dstrace("Read on hold to poll");
       break;
     }
+    else if(*read_size) // rc = 0, frame read before close is checked first
+    {
+      break;
+    }
     else // rc = 0
     {
       dstrace("Closed connection while reading the result from service");
@@ -185,17 +656,51 @@ int readbuf(int sockfd, void *buf, int *read_size)
 }
 
 
+// grows receive buffer geometrically, it is never shrunk
+int reserve_buf(void **buf, int *buf_size, int size)
+{
+  if(*buf_size >= size)
+    return 0;
+
+  int new_size = *buf_size ? *buf_size : 256;
+  while(new_size < size)
+    new_size *= 2;
+
+  void *new_buf = realloc(*buf, new_size);
+  if(!new_buf)
+  {
+    dslogerr(errno, "Cannot allocate result buffer");
+    return -1;
+  }
+
+  *buf = new_buf;
+  *buf_size = new_size;
+
+  return 0;
+}
+
+
+int reserve_respkt(PDSCONN ctx, int size)
+{
+  return reserve_buf((void **)&ctx->respkt, &ctx->respkt_bufsize, size);
+}
+
+
 int readpack(PDSCONN ctx)
 {
   if(ctx->expected_size < 0)
   {
-    int read_size = sizeof(ctx->buf) - ctx->read_offset;
-    if(readbuf(ctx->sockfd, ctx->buf + ctx->read_offset, &read_size) < 0)
+    if(reserve_respkt(ctx, HEADER_READ_SIZE))
+      return -1;
+
+    int read_size = HEADER_READ_SIZE - ctx->read_offset;
+    if(readbuf(ctx, ctx->respkt + ctx->read_offset, &read_size) < 0)
       return -1;
 
     ctx->read_offset += read_size;
 
-    if(dspack_bufsize("ds", ctx->buf, ctx->read_offset, &ctx->expected_size) < 0)
+    const char *tag = dszip_frame(ctx->respkt, ctx->read_offset) ? DSZIP_TAG : "ds";
+    if(dspack_bufsize(tag, ctx->respkt, ctx->read_offset, &ctx->expected_size) < 0)
       return -1;
   }
 
@@ -203,31 +708,23 @@ int readpack(PDSCONN ctx)
   {
     dstrace("Expected data size %d", ctx->expected_size);
 
-    char *data = (char *)malloc(ctx->expected_size);
-    if(!data)
-    {
-      dslogerr(errno, "Cannot allocate result buffer");
+    if(reserve_respkt(ctx, ctx->expected_size))
       return -1;
-    }
-
-    memcpy(data, ctx->buf, ctx->read_offset);
 
     int read_size = ctx->expected_size - ctx->read_offset;
-    int rc = readbuf(ctx->sockfd, data + ctx->read_offset, &read_size);
+    int rc = readbuf(ctx, ctx->respkt + ctx->read_offset, &read_size);
 
     ctx->read_offset += read_size;
 
     if(ctx->read_offset == ctx->expected_size)
     {
       dstrace("data read OK");
-      ctx->respkt = data;
       ctx->respkt_size = ctx->expected_size;
       return 0;
     }
     else if(rc < 0)
     {
       dslogw("data read failed, read size %d", read_size);
-      free(data);
       return -1;
     }
   }
@@ -245,6 +742,20 @@ const char* getstate_string(int iostate)
 }
 
 
+// Connection over rings is polled by eventfd the daemon wakes, both when
+// answer comes and when room for request is freed
+int poll_fd(PDSCONN ctx)
+{
+  return ctx->ring ? dsring_fd(ctx->ring) : ctx->sockfd;
+}
+
+
+int poll_event(PDSCONN ctx, int event)
+{
+  return ctx->ring ? EPOLLIN : event;
+}
+
+
 int poll_add(int epoll_fd, int sockfd, void *data, int event)
 {
   dstrace("epoll add the connection %d to %d", sockfd, epoll_fd);
@@ -295,6 +806,49 @@ int poll_del(int epoll_fd, int sockfd)
 }
 
 
+// Phases of server are timed by state changes of its connection, connect
+// starts before the socket is created
+void time_phase(PDSCONN ctx, int iostate)
+{
+  PDSSERVER server = ctx->server;
+  long long now_us;
+
+  if(iostate == DSSTATE_OUT && (ctx->iostate == DSSTATE_0 || ctx->iostate == DSSTATE_CONN))
+  {
+    now_us = dsclock_us();
+    dshist_add(&server->phases[DSSEND_CONNECT], now_us - ctx->phase_us);
+  }
+  else if(iostate == DSSTATE_OUT && ctx->iostate == DSSTATE_FIN)
+  {
+    now_us = dsclock_us();
+  }
+  else if(iostate == DSSTATE_IN)
+  {
+    now_us = dsclock_us();
+    dshist_add(&server->phases[DSSEND_SEND], now_us - ctx->phase_us);
+    server->bytes_out += ctx->send_offset;
+  }
+  else if(iostate == DSSTATE_FIN && ctx->iostate == DSSTATE_IN)
+  {
+    now_us = dsclock_us();
+    dshist_add(&server->phases[DSSEND_ANSWER], now_us - ctx->phase_us);
+    server->bytes_in += ctx->respkt_size;
+  }
+  else
+    return;
+
+  ctx->phase_us = now_us;
+}
+
+
+void add_phase(PDSCONN head, int phase, long long phase_us)
+{
+  if(head->h_phase_us[phase] < 0)
+    head->h_phase_us[phase] = 0;
+  head->h_phase_us[phase] += phase_us;
+}
+
+
 void setstate_connection(PDSCONN ctx, int iostate)
 {
   int rc = 0;
@@ -306,7 +860,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
     case DSSTATE_0:
       if(ctx->inpoll)
       {
-        poll_del(ctx->head->h_epollfd, ctx->sockfd);
+        poll_del(ctx->head->h_epollfd, poll_fd(ctx));
         ctx->inpoll = 0;
         ctx->head->h_active_num--;
       }
@@ -316,26 +870,28 @@ void setstate_connection(PDSCONN ctx, int iostate)
       if(ctx->iostate != DSSTATE_0)
         dsdie("Abnormal %s connection state transition from %s", getstate_string(iostate), getstate_string(ctx->iostate));
 
+      // local connection waits for the answer to ring registration
       if(ctx->inpoll)
       {
-        rc = poll_mod(ctx->head->h_epollfd, ctx->sockfd, ctx, EPOLLOUT);
+        rc = poll_mod(ctx->head->h_epollfd, ctx->sockfd, ctx, ctx->hello_ring ? EPOLLIN : EPOLLOUT);
       }
       else
       {
-        rc = poll_add(ctx->head->h_epollfd, ctx->sockfd, ctx, EPOLLOUT);
+        rc = poll_add(ctx->head->h_epollfd, ctx->sockfd, ctx, ctx->hello_ring ? EPOLLIN : EPOLLOUT);
         ctx->head->h_active_num++;
         ctx->inpoll = 1;
       }
       break;
 
     case DSSTATE_OUT:
-      if(ctx->iostate != DSSTATE_CONN && ctx->iostate != DSSTATE_FIN)
+      if(ctx->iostate != DSSTATE_0 && ctx->iostate != DSSTATE_CONN && ctx->iostate != DSSTATE_FIN)
         dsdie("Abnormal %s connection state transition from %s", getstate_string(iostate), getstate_string(ctx->iostate));
 
-      if(ctx->iostate == DSSTATE_FIN)
+      // keepalive connection or one connected at once, as local socket is
+      if(ctx->iostate == DSSTATE_FIN || ctx->iostate == DSSTATE_0)
       {
         if(!ctx->inpoll)
-          rc = poll_add(ctx->head->h_epollfd, ctx->sockfd, ctx, EPOLLOUT);
+          rc = poll_add(ctx->head->h_epollfd, poll_fd(ctx), ctx, poll_event(ctx, EPOLLOUT));
         else
           dsdie("Abnormal %s connection state", getstate_string(iostate));
         ctx->head->h_active_num++;
@@ -348,7 +904,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
         dsdie("Abnormal %s connection state transition from %s", getstate_string(iostate), getstate_string(ctx->iostate));
 
       if(ctx->inpoll)
-        rc = poll_mod(ctx->head->h_epollfd, ctx->sockfd, ctx, EPOLLIN);
+        rc = poll_mod(ctx->head->h_epollfd, poll_fd(ctx), ctx, EPOLLIN);
       else
         dsdie("Abnormal %s connection state", getstate_string(iostate));
       break;
@@ -356,7 +912,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
     case DSSTATE_ERR:
       if(ctx->inpoll)
       {
-        poll_del(ctx->head->h_epollfd, ctx->sockfd);
+        poll_del(ctx->head->h_epollfd, poll_fd(ctx));
         ctx->inpoll = 0;
         ctx->head->h_active_num--;
       }
@@ -365,7 +921,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
     case DSSTATE_FIN:
       if(ctx->inpoll)
       {
-        poll_del(ctx->head->h_epollfd, ctx->sockfd);
+        poll_del(ctx->head->h_epollfd, poll_fd(ctx));
         ctx->inpoll = 0;
         ctx->head->h_active_num--;
       }
@@ -374,6 +930,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
 
   if(!rc)
   {
+    time_phase(ctx, iostate);
     ctx->iostate = iostate;
   }
   else
@@ -381,7 +938,7 @@ void setstate_connection(PDSCONN ctx, int iostate)
     dstrace("Error detected in connection state manipulation");
 
     ctx->iostate = DSSTATE_ERR;
-    poll_del(ctx->head->h_epollfd, ctx->sockfd);
+    poll_del(ctx->head->h_epollfd, poll_fd(ctx));
     ctx->head->h_active_num--;
   }
 }
@@ -400,6 +957,7 @@ void process_connection(PDSCONN ctx, const char *pkt, int pkt_size)
   {
     dstrace("Zero state");
 
+    ctx->phase_us = dsclock_us();
     rc = create_connection(ctx);
     if(rc > 0)
       setstate_connection(ctx, DSSTATE_CONN);
@@ -433,7 +991,26 @@ void process_connection(PDSCONN ctx, const char *pkt, int pkt_size)
 }
 
 
-int poll_connections(PDSCONN head, void *pkt, int pkt_size)
+// Daemon answers with its own chunk instead of database results when it
+// sheds load
+int check_overloaded(PDSCONN ctx)
+{
+  const void *data = NULL;
+  int data_size = 0;
+
+  ctx->overloaded = 0;
+  if(ctx->iostate == DSSTATE_FIN && !dsunpack("ds", ctx->respkt, ctx->respkt_size, &data, &data_size, 0) &&
+     data_size > DAEMON_TAG_SIZE && !memcmp(data, DAEMON_TAG, DAEMON_TAG_SIZE))
+  {
+    dslogw("Server %s:%d is overloaded", ctx->address, ctx->port);
+    ctx->overloaded = 1;
+  }
+
+  return ctx->overloaded;
+}
+
+
+int poll_connections(PDSCONN head, void *pkt, int pkt_size, void *dpkt, int dpkt_size)
 {
   if(!head->h_active_num)
   {
@@ -442,7 +1019,8 @@ int poll_connections(PDSCONN head, void *pkt, int pkt_size)
   }
 
   dstrace("Polling connections");
-  int nfds = epoll_wait(head->h_epollfd, head->h_epevents, head->h_conns_num, CONNECTION_TIMEOUT_MS);
+  int timeout_ms = (head->h_deadline_us - dsclock_us() + 999) / 1000;
+  int nfds = timeout_ms > 0 ? epoll_wait(head->h_epollfd, head->h_epevents, head->h_conns_num, timeout_ms) : 0;
   if(nfds < 0)
   {
     dslogerr(errno, "epoll wait error");
@@ -458,7 +1036,35 @@ int poll_connections(PDSCONN head, void *pkt, int pkt_size)
   {
     PDSCONN ctx = (PDSCONN)head->h_epevents[i].data.ptr;
 
-    if(head->h_epevents[i].events & (EPOLLERR|EPOLLHUP))
+    if(ctx->hello_ring)
+    {
+      int taken = accept_ring(ctx);
+      if(taken > 0)
+        continue;
+
+      // socket leaves polling, the call goes on over taken rings or over
+      // new plain connection
+      setstate_connection(ctx, DSSTATE_0);
+      if(!taken)
+      {
+        ctx->ring = ctx->hello_ring;
+        ctx->hello_ring = NULL;
+        setstate_connection(ctx, DSSTATE_OUT);
+      }
+      else
+      {
+        close(ctx->sockfd);
+        ctx->sockfd = -1;
+      }
+
+      if(ctx->digest_only)
+        process_connection(ctx, dpkt, dpkt_size);
+      else
+        process_connection(ctx, pkt, pkt_size);
+    }
+    // answer of daemon closing connection after it comes with hangup
+    else if(head->h_epevents[i].events & EPOLLERR ||
+            (head->h_epevents[i].events & (EPOLLHUP|EPOLLIN)) == EPOLLHUP)
     {
       setstate_connection(ctx, DSSTATE_ERR);
     }
@@ -467,17 +1073,27 @@ int poll_connections(PDSCONN head, void *pkt, int pkt_size)
       if(ctx->iostate == DSSTATE_CONN)
         setstate_connection(ctx, DSSTATE_OUT);
 
-      process_connection(ctx, pkt, pkt_size);
+      if(ctx->ring)
+        dsring_drain(ctx->ring);
+
+      if(ctx->digest_only)
+        process_connection(ctx, dpkt, dpkt_size);
+      else
+        process_connection(ctx, pkt, pkt_size);
     }
 
-    if(ctx->iostate == DSSTATE_ERR)
+    // call fails anyway when every server has to answer
+    if(ctx->iostate == DSSTATE_ERR && head->h_consistency == DSSEND_ALL)
     {
       dstrace("Abort all connections processing because of single connection error");
 
       ctx = head;
       while(ctx)
       {
-        ctx->iostate = DSSTATE_ERR;
+        if(ctx->selected && ctx->iostate != DSSTATE_ERR && ctx->iostate != DSSTATE_FIN)
+          ctx->aborted = 1;
+        if(ctx->selected)
+          ctx->iostate = DSSTATE_ERR;
         ctx = ctx->next;
       }
 
@@ -489,9 +1105,152 @@ int poll_connections(PDSCONN head, void *pkt, int pkt_size)
 }
 
 
-void dssend(void *dsctx, int pack_signed, int keepalive, const char *msg, char **res, int *res_size)
+// Message carries time left for the call, so daemon does not run command
+// nobody waits for anymore, priority unless it is interactive and offer of
+// compression. Buffer keeps room for digest field.
+int build_msg(PDSCONN head, const char *msg, int timeout_ms, int priority, int zip, int *msg_size)
 {
-  PDSCONN ctx;
+  int len = strlen(msg);
+  int size = len + 1 + TIMEOUT_FIELD_SIZE + PRIORITY_FIELD_SIZE + ZIP_FIELD_SIZE + DIGEST_FIELD_SIZE;
+
+  if(head->h_msg_bufsize < size)
+  {
+    int new_size = head->h_msg_bufsize ? head->h_msg_bufsize : 256;
+    while(new_size < size)
+      new_size *= 2;
+
+    char *buf = (char *)realloc(head->h_msg, new_size);
+    if(!buf)
+    {
+      dslogerr(errno, "Cannot allocate message buffer");
+      return -1;
+    }
+
+    head->h_msg = buf;
+    head->h_msg_bufsize = new_size;
+  }
+
+  memcpy(head->h_msg, msg, len + 1); // with trailing 0 symbol
+
+  int field_size = dspack_timeout(timeout_ms, head->h_msg + len + 1, TIMEOUT_FIELD_SIZE);
+  if(field_size < 0)
+    return -1;
+
+  *msg_size = len + 1 + field_size;
+
+  if(priority != DSPRIO_INTERACTIVE)
+  {
+    field_size = dspack_priority(priority, head->h_msg + *msg_size, PRIORITY_FIELD_SIZE);
+    if(field_size < 0)
+      return -1;
+
+    *msg_size += field_size;
+  }
+
+  if(zip)
+  {
+    field_size = dspack_accept_zip(head->h_msg + *msg_size, ZIP_FIELD_SIZE);
+    if(field_size < 0)
+      return -1;
+
+    *msg_size += field_size;
+  }
+
+  return 0;
+}
+
+
+// Message is compressed before signing for servers known to take it
+int pack_msg(PDSCONN head, int msg_size, int zip, int pack_options, void **buf, int *buf_size, void **pkt, int *pkt_size)
+{
+  const char *tag = "ds";
+  void *payload = head->h_msg;
+  int payload_size = msg_size;
+  long long start_us = dsclock_us();
+
+  if(zip)
+  {
+    if(reserve_buf(&head->h_zmsg, &head->h_zmsg_bufsize, dszip_bound(msg_size)))
+      return -1;
+
+    payload_size = dszip_pack(head->h_zip, head->h_msg, msg_size, 0, head->h_zmsg);
+    if(payload_size < 0)
+      return -1;
+
+    tag = DSZIP_TAG;
+    payload = head->h_zmsg;
+  }
+
+  long long packed_us = dsclock_us();
+  add_phase(head, DSSEND_PACK, packed_us - start_us);
+
+  int rc = dspack_buf(tag, payload, payload_size, buf, buf_size, pkt, pkt_size, pack_options);
+  add_phase(head, pack_options & DSPACK_SIGNED ? DSSEND_SIGN : DSSEND_PACK, dsclock_us() - packed_us);
+
+  return rc;
+}
+
+
+// Compressed answer is unpacked into spare buffer which takes place of
+// receive buffer, both are kept between calls
+int unzip_answer(PDSCONN ctx)
+{
+  const void *payload = NULL;
+  int payload_size = 0;
+  char header[HEADER_READ_SIZE];
+
+  ctx->zipped = dszip_frame(ctx->respkt, ctx->respkt_size);
+  if(!ctx->zipped)
+    return 0;
+
+  if(dsunpack(DSZIP_TAG, ctx->respkt, ctx->respkt_size, &payload, &payload_size, 0))
+    return -1;
+
+  int raw_size = dszip_size(payload, payload_size);
+  if(raw_size < 0)
+    return -1;
+
+  int header_size = sprintf(header, "ds:%d:", raw_size);
+  if(reserve_buf((void **)&ctx->zbuf, &ctx->zbuf_bufsize, header_size + raw_size))
+    return -1;
+
+  memcpy(ctx->zbuf, header, header_size);
+  if(dszip_unpack(ctx->head->h_zip, payload, payload_size, ctx->zbuf + header_size, raw_size))
+    return -1;
+
+  unsigned char *buf = ctx->respkt;
+  int buf_size = ctx->respkt_bufsize;
+  ctx->respkt = ctx->zbuf;
+  ctx->respkt_bufsize = ctx->zbuf_bufsize;
+  ctx->respkt_size = header_size + raw_size;
+  ctx->zbuf = buf;
+  ctx->zbuf_bufsize = buf_size;
+
+  return 0;
+}
+
+
+// Server asked for digest may still answer in full, then whole answers are
+// compared
+int same_answer(PDSCONN ctx, PDSCONN first, int first_size, const char *first_digest)
+{
+  const void *data = NULL;
+  int data_size = 0;
+
+  if(ctx->digest_only && !dsunpack("ds", ctx->respkt, ctx->respkt_size, &data, &data_size, 0))
+  {
+    const char *digest = dsunpack_reply_digest(data, data_size);
+    if(digest)
+      return !strcmp(digest, first_digest);
+  }
+
+  return ctx->respkt_size == first_size && !memcmp(ctx->respkt, first->respkt, first_size);
+}
+
+
+int send_call(void *dsctx, int pack_signed, int keepalive, int consistency, int digest, int zip_min, int timeout_ms, int priority, const char *msg, const char **res, int *res_size)
+{
+  PDSCONN ctx, head = (PDSCONN)dsctx, first = NULL;
   int rc, pack_options = 0;
 
   if(keepalive)
@@ -499,7 +1258,66 @@ void dssend(void *dsctx, int pack_signed, int keepalive, const char *msg, char *
   else
     dstrace("Sending via non-keepalive connection");
 
-  if(pack_signed)
+  
+  // prepare packet
+  *res = NULL;
+  *res_size = 0;
+
+  if(timeout_ms <= 0)
+    timeout_ms = CONNECTION_TIMEOUT_MS;
+
+  void *pkt = NULL;
+  int pkt_size = 0;
+  int msg_size = 0;
+  long long build_us = dsclock_us();
+  rc = build_msg(head, msg, timeout_ms, priority, zip_min > 0, &msg_size);
+  add_phase(head, DSSEND_PACK, dsclock_us() - build_us);
+  if(rc)
+  {
+    dslog("Error: Packing failed");
+    return -1;
+  }
+
+
+  // read-only command goes to single server, others to all alive ones
+  PDSCONN read_ctx = NULL;
+  if(head->h_conns_num > 1 && dscmd_class(msg) == DSCMD_READ)
+    read_ctx = select_read_connection(head);
+
+  int required = 1;
+  if(!read_ctx)
+  {
+    if(consistency == DSSEND_ALL)
+      required = head->h_conns_num;
+    else if(consistency == DSSEND_QUORUM)
+      required = head->h_conns_num / 2 + 1;
+  }
+
+  int alive = 0;
+  long long now_us = dsclock_us();
+  for(ctx = head; ctx; ctx = ctx->next)
+  {
+    ctx->selected = read_ctx ? ctx == read_ctx : server_up(ctx->server, now_us);
+    ctx->aborted = 0;
+    alive += ctx->selected;
+  }
+
+  if(alive < required)
+  {
+    dslogw("Only %d of %d servers are alive, %d required", alive, head->h_conns_num, required);
+    return -1;
+  }
+
+  head->h_consistency = read_ctx ? DSSEND_ANY : consistency;
+  head->h_keepalive = keepalive;
+
+  // daemons on local sockets may trust credentials of the process instead
+  int signed_tcp = pack_signed == DSSEND_SIGNED_TCP;
+  for(ctx = head; signed_tcp && ctx; ctx = ctx->next)
+    if(ctx->selected && ctx->port != UNIX_PORT)
+      signed_tcp = 0;
+
+  if(pack_signed && !signed_tcp)
   {
     dstrace("Sending signed packets");
     pack_options |= DSPACK_SIGNED;
@@ -507,79 +1325,192 @@ void dssend(void *dsctx, int pack_signed, int keepalive, const char *msg, char *
   else
     dstrace("Sending non-signed packets");
 
-  
-  // prepare packet
-  void *pkt = NULL;
-  int pkt_size = 0;
-  int len = strlen(msg);
-  rc = dspack("ds", msg, len + 1, &pkt, &pkt_size, pack_options); // add trailing 0 symbol
-  if(rc)
+  // long message is compressed when every server takes it
+  int zip = zip_min > 0 && msg_size >= zip_min;
+  for(ctx = head; zip && ctx; ctx = ctx->next)
+    if(ctx->selected && !ctx->server->zip)
+      zip = 0;
+
+  if(pack_msg(head, msg_size, zip, pack_options, &head->h_pkt, &head->h_pkt_bufsize, &pkt, &pkt_size))
   {
     dslog("Error: Packing failed");
-    return;
+    return -1;
   }
 
+  // the same message with digest field goes to all servers but one
+  void *dpkt = NULL;
+  int dpkt_size = 0;
+  PDSCONN full_ctx = NULL;
+  if(digest && !read_ctx && alive > 1)
+  {
+    int field_size = dspack_digest_only(head->h_msg + msg_size, head->h_msg_bufsize - msg_size);
+    if(field_size < 0 ||
+       pack_msg(head, msg_size + field_size, zip, pack_options, &head->h_dpkt, &head->h_dpkt_bufsize, &dpkt, &dpkt_size))
+    {
+      dslog("Error: Packing failed");
+      return -1;
+    }
+
+    full_ctx = select_full_connection(head);
+    dstrace("Full answer is expected from %s:%d", full_ctx->address, full_ctx->port);
+  }
+
+  for(ctx = head; ctx; ctx = ctx->next)
+    ctx->digest_only = full_ctx && ctx != full_ctx;
+
   
   // init connections
+  long long start_us = dsclock_us();
+  head->h_deadline_us = start_us + timeout_ms * 1000LL;
   ctx = (PDSCONN)dsctx;
   while(ctx)
   {
-    if(ctx->iostate == DSSTATE_0)
-      process_connection(ctx, pkt, pkt_size);
+    if(ctx->selected)
+    {
+      // daemon dropped idle connection over rings
+      if(ctx->iostate == DSSTATE_FIN && ctx->ring && dsring_closed(ctx->ring))
+      {
+        dstrace("Connect again to %s, ring is closed by daemon", ctx->address);
+        release_ring(ctx);
+        close(ctx->sockfd);
+        ctx->sockfd = -1;
+        setstate_connection(ctx, DSSTATE_0);
+      }
+
+      if(ctx->iostate == DSSTATE_0)
+        process_connection(ctx, ctx->digest_only ? dpkt : pkt, ctx->digest_only ? dpkt_size : pkt_size);
+      else if(ctx->iostate == DSSTATE_FIN) // keepalive connection
+      {
+        setstate_connection(ctx, DSSTATE_OUT);
+
+        // nothing polls ring for room, request is written at once
+        if(ctx->ring)
+          process_connection(ctx, ctx->digest_only ? dpkt : pkt, ctx->digest_only ? dpkt_size : pkt_size);
+      }
+    }
     ctx = ctx->next;
   }
 
   
   // send+recv loop
-  while(!poll_connections((PDSCONN)dsctx, pkt, pkt_size));
+  while(!poll_connections((PDSCONN)dsctx, pkt, pkt_size, dpkt, dpkt_size));
 
+  long long poll_us = dsclock_us();
+  long long latency_us = poll_us - start_us;
+  add_phase(head, DSSEND_WAIT, latency_us);
 
-  ctx = (PDSCONN)dsctx;
-  // Build result
-  *res = NULL;
-  *res_size = 0;
-  if(ctx->respkt)
+
+  // Build result, unpacked in place of receive buffer. Failed servers are
+  // left out unless every server has to answer.
+  int answered = 0;
+  for(ctx = head; ctx; ctx = ctx->next)
+  {
+    if(ctx->selected && ctx->iostate == DSSTATE_FIN && unzip_answer(ctx))
+    {
+      dslogw("Server %s:%d sent bad compressed answer", ctx->address, ctx->port);
+      ctx->respkt_size = 0;
+    }
+
+    if(ctx->selected && check_overloaded(ctx) && head->h_consistency != DSSEND_ALL)
+      continue;
+
+    if(ctx->selected && (ctx->iostate == DSSTATE_FIN || head->h_consistency == DSSEND_ALL))
+    {
+      if(!first && !ctx->digest_only)
+        first = ctx;
+      if(ctx->iostate == DSSTATE_FIN && !ctx->overloaded)
+        answered++;
+    }
+  }
+
+  if(answered < required)
   {
-    dsunpack("ds", ctx->respkt, ctx->respkt_size, (const void **)res, res_size, 0);
-    *res = strdup(*res); // pointer inside existing buffer respkt which will be freed
+    dslogw("Only %d of %d servers answered, %d required", answered, alive, required);
+    rc = -1;
+  }
+
+  if(!rc && full_ctx && !first)
+  {
+    dslogw("Server %s:%d failed to send full answer", full_ctx->address, full_ctx->port);
+    rc = -1;
+  }
+
+  char first_digest[DSCRYPTO_DIGEST_SIZE] = "";
+  int first_size = first ? first->respkt_size : 0; // connections are reset while analysed
+  if(!rc && first_size)
+  {
+    if(dsunpack("ds", first->respkt, first->respkt_size, (const void **)res, res_size, 0))
+      rc = -1;
+    else
+    {
+      // server compared its databases itself
+      const char *verdict = dsunpack_verdict(*res, *res_size);
+      if(verdict && !strncmp(verdict, "diverged", 8))
+        dslogw("Server %s:%d reports %s", first->server->address, first->server->port, verdict);
+
+      if(full_ctx && dscrypto_digest(*res, *res_size, first_digest))
+        rc = -1;
+    }
   }
 
   // analyse results
-  while(ctx)
+  for(ctx = head; ctx; ctx = ctx->next)
   {
-    if(!rc)
+    if(!ctx->selected)
+      continue;
+
+    ctx->server->calls++;
+    if(ctx->iostate == DSSTATE_FIN)
+    {
+      ctx->server->answers++;
+      ctx->server->overloaded += ctx->overloaded;
+
+      // fast refusal says nothing about latency of commands
+      if(!ctx->overloaded)
+        update_latency(ctx->server, latency_us);
+      update_health(ctx->server, 1);
+
+      // server answering offer of compression in plain frame does not know it
+      if(zip_min > 0 && !ctx->overloaded && ctx->respkt_size)
+        ctx->server->zip = ctx->zipped;
+    }
+    else if(!ctx->aborted)
+    {
+      ctx->server->call_failures++;
+      update_latency(ctx->server, timeout_ms * 1000LL);
+      update_health(ctx->server, 0);
+    }
+
+    if(!rc && ctx->overloaded && head->h_consistency != DSSEND_ALL)
+    {
+      // left out of comparison as failed server
+    }
+    else if(!rc && (ctx->iostate == DSSTATE_FIN || head->h_consistency == DSSEND_ALL))
     {
-      if(!ctx->respkt || ctx->respkt_size == 0)
+      if(ctx->respkt_size == 0)
       {
         dslogw("DB %s:%d returns no result", ctx->address, ctx->port);
         rc = -1;
       }
-      else if(ctx->next &&
-          (
-            ctx->respkt_size != ctx->next->respkt_size || 
-            memcmp(ctx->respkt, ctx->next->respkt, ctx->respkt_size)
-          )
-        )
+      else if(ctx != first && !same_answer(ctx, first, first_size, first_digest))
       {
-        dslogw("DBs (%s:%d vs %s:%d) returns different results", ctx->address, ctx->port, ctx->next->address, ctx->next->port);
+        dslogw("DBs (%s:%d vs %s:%d) returns different results", first->address, first->port, ctx->address, ctx->port);
+        ctx->server->mismatches++;
         rc = -1;
       }
     } // if !rc
 
-    if(keepalive)
+    if(keepalive && ctx->iostate == DSSTATE_FIN)
     {
-      if(ctx->iostate == DSSTATE_FIN)
-      {
-        reset_connection(ctx);
-        setstate_connection(ctx, DSSTATE_OUT);
-      }
-      else if(ctx->iostate != DSSTATE_ERR)
-        setstate_connection(ctx, DSSTATE_ERR);
+      // finished connection stays out of polling till next call
+      reset_connection(ctx);
     }
     else
     {
+      // broken or unfinished connection is opened again by the next call
       reset_connection(ctx);
       setstate_connection(ctx, DSSTATE_0);
+      release_ring(ctx);
       if(ctx->sockfd > 0)
       {
         dstrace("Close connection %d because no keepalive", ctx->sockfd);
@@ -587,19 +1518,111 @@ void dssend(void *dsctx, int pack_signed, int keepalive, const char *msg, char *
         ctx->sockfd = -1;
       }
     }
-
-    ctx = ctx->next;
   }
   
-  if(rc && *res)
+  add_phase(head, DSSEND_COMPARE, dsclock_us() - poll_us);
+
+  if(rc)
   {
-    free(*res);
     *res = NULL;
     *res_size = 0;
   }
 
-  if(pkt)
-    free(pkt);
+  return rc;
+}
+
+
+void dssend(void *dsctx, int pack_signed, int keepalive, int consistency, int digest, int zip_min, int timeout_ms, int priority, const char *msg, const char **res, int *res_size)
+{
+  PDSCONN head = (PDSCONN)dsctx;
+  long long start_us = dsclock_us();
+  int i;
+
+  for(i = 0; i < DSSEND_PHASES; i++)
+    head->h_phase_us[i] = -1;
+
+  int rc = send_call(dsctx, pack_signed, keepalive, consistency, digest, zip_min, timeout_ms, priority, msg, res, res_size);
+  add_phase(head, DSSEND_CALL, dsclock_us() - start_us);
+
+  for(i = 0; i < DSSEND_PHASES; i++)
+    if(head->h_phase_us[i] >= 0)
+      dshist_add(&g_phases[i], head->h_phase_us[i]);
+
+  g_calls++;
+  if(rc)
+    g_failures++;
+}
+
+
+void hist_latency(PDSHIST hist, PDSSEND_LATENCY latency)
+{
+  latency->count = hist->count;
+  latency->p50_us = dshist_quantile(hist->buckets, hist->count, hist->max, 500);
+  latency->p99_us = dshist_quantile(hist->buckets, hist->count, hist->max, 990);
+  latency->p999_us = dshist_quantile(hist->buckets, hist->count, hist->max, 999);
+  latency->max_us = hist->max;
+}
+
+
+// Counters of the worker process, summed over its contexts
+void dssend_stats(PDSSEND_STATS stats)
+{
+  int i;
+
+  stats->calls = g_calls;
+  stats->failures = g_failures;
+  for(i = 0; i < DSSEND_PHASES; i++)
+    hist_latency(&g_phases[i], &stats->phases[i]);
+}
+
+
+// prev is the server returned by the previous call
+void* dssend_server_stats(void *prev, PDSSEND_SERVER_STATS stats)
+{
+  PDSSERVER server = prev ? ((PDSSERVER)prev)->next : g_servers;
+  int i;
+
+  if(!server)
+    return NULL;
+
+  stats->address = server->address;
+  stats->port = server->port;
+  stats->calls = server->calls;
+  stats->answers = server->answers;
+  stats->failures = server->call_failures;
+  stats->overloaded = server->overloaded;
+  stats->mismatches = server->mismatches;
+  stats->bytes_out = server->bytes_out;
+  stats->bytes_in = server->bytes_in;
+  stats->latency_us = server->latency_us;
+  stats->down = !server_up(server, dsclock_us());
+  for(i = 0; i < DSSEND_SERVER_PHASES; i++)
+    hist_latency(&server->phases[i], &stats->phases[i]);
+
+  return server;
+}
+
+
+// Routing state of servers is kept, it is not statistics
+void dssend_stats_reset(void)
+{
+  PDSSERVER server;
+
+  g_calls = 0;
+  g_failures = 0;
+  memset(g_phases, 0, sizeof(g_phases));
+
+  for(server = g_servers; server; server = server->next)
+  {
+    server->calls = 0;
+    server->answers = 0;
+    server->call_failures = 0;
+    server->overloaded = 0;
+    server->mismatches = 0;
+    server->bytes_out = 0;
+    server->bytes_in = 0;
+    memset(server->phases, 0, sizeof(server->phases));
+  }
 }
 
 
@@ -614,6 +1637,7 @@ void dsreset(void *dsctx)
   {
     reset_connection(ctx);
     setstate_connection(ctx, DSSTATE_0);
+    release_ring(ctx);
     if(ctx->sockfd > 0)
     {
       dstrace("Close connection %d because no keepalive", ctx->sockfd);
@@ -640,6 +1664,8 @@ void* dssend_init_ctx(const char *targets)
   {
     char *s1 = strchr(pos, ',');
     char *s2 = strchr(pos, ':');
+    int local = !strncmp(pos, UNIX_PREFIX, strlen(UNIX_PREFIX));
+
     if(!s2 || (s1 && (s2 > s1)))
     {
       dslog("Bad target format %s", pos);
@@ -647,11 +1673,12 @@ void* dssend_init_ctx(const char *targets)
     }
     else
     {
+      // path of local socket takes place of address
       s2[0] = 0;
-      const char *address = pos;
+      const char *address = local ? s2+1 : pos;
       if(s1)
         s1[0] = 0;
-      const char *port = s2+1;
+      const char *port = local ? "local" : s2+1;
       
       if(!head)
       {
@@ -665,6 +1692,24 @@ void* dssend_init_ctx(const char *targets)
         
         head->h_conns_num = 0;
         head->h_active_num = 0;
+        head->h_epollfd = -1;
+        head->h_epevents = NULL;
+        head->h_pkt = NULL;
+        head->h_pkt_bufsize = 0;
+        head->h_dpkt = NULL;
+        head->h_dpkt_bufsize = 0;
+        head->h_zmsg = NULL;
+        head->h_zmsg_bufsize = 0;
+        head->h_zip = dszip_create();
+        if(!head->h_zip)
+        {
+          free(head);
+          head = NULL;
+          rc = -1;
+          break;
+        }
+        head->h_msg = NULL;
+        head->h_msg_bufsize = 0;
 
         curr = head;
       }
@@ -683,16 +1728,31 @@ void* dssend_init_ctx(const char *targets)
       dstrace("Init connection context %s:%s", address, port);
 
       curr->address = strdup(address);
-      curr->port = atoi(port);
+      curr->port = local ? UNIX_PORT : atoi(port);
       curr->sockfd = -1;
+      curr->ring = NULL;
+      curr->hello_ring = NULL;
+      curr->server = get_server(curr->address, curr->port);
+      curr->selected = 0;
 
       curr->inpoll = 0;
       curr->iostate = -1;
+      curr->respkt = NULL;
+      curr->respkt_bufsize = 0;
+      curr->zbuf = NULL;
+      curr->zbuf_bufsize = 0;
+      curr->zipped = 0;
 
       curr->head = head;
       curr->next = NULL;
       head->h_conns_num++;
 
+      if(!curr->server)
+      {
+        rc = -1;
+        break;
+      }
+
       reset_connection(curr);
       setstate_connection(curr, DSSTATE_0);
     }
@@ -729,6 +1789,9 @@ void* dssend_init_ctx(const char *targets)
   {
     if(head->h_epollfd >= 0)
       close(head->h_epollfd);
+    if(head->h_epevents)
+      free(head->h_epevents);
+    dszip_free(head->h_zip);
 
     while(head)
     {
@@ -757,6 +1820,15 @@ void dssend_release_ctx(void *dsctx)
       close(head->h_epollfd);
     if(head->h_epevents)
       free(head->h_epevents);
+    if(head->h_pkt)
+      free(head->h_pkt);
+    if(head->h_dpkt)
+      free(head->h_dpkt);
+    if(head->h_zmsg)
+      free(head->h_zmsg);
+    dszip_free(head->h_zip);
+    if(head->h_msg)
+      free(head->h_msg);
   }
 
   while(head)
@@ -764,6 +1836,8 @@ void dssend_release_ctx(void *dsctx)
     curr = head;
     head = head->next;
 
+    park_ring(curr);
+    release_ring(curr);
     if(curr->sockfd >= 0)
     {
       dstrace("Close connection %d in dbsync context release", curr->sockfd);
@@ -772,6 +1846,28 @@ void dssend_release_ctx(void *dsctx)
 
     free(curr->address);
     free(curr->respkt);
+    free(curr->zbuf);
     free(curr);
   }
 }
+
+
+// Releases server state shared between contexts, on module shutdown
+void dssend_cleanup(void)
+{
+  PDSSERVER server;
+
+  while(g_servers)
+  {
+    server = g_servers;
+    g_servers = g_servers->next;
+
+    if(server->ring)
+    {
+      dsring_free(server->ring);
+      close(server->sockfd);
+    }
+    free(server->address);
+    free(server);
+  }
+}
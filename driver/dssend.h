@@ -1,10 +1,78 @@
 #ifndef SEND_H
 #define SEND_H
 
+// how many servers have to answer a command sent to all of them
+#define DSSEND_ALL    0 // every server, known dead one fails the call at once
+#define DSSEND_QUORUM 1 // majority, known dead servers are skipped
+#define DSSEND_ANY    2 // any alive server
 
-void dssend(void *dsctx, int pack_signed, int keepalive, const char *msg, char **res, int *res_size);
+// signing of packets
+#define DSSEND_UNSIGNED   0
+#define DSSEND_SIGNED     1
+#define DSSEND_SIGNED_TCP 2 // call going to local sockets only is not signed, daemon trusts peer credentials
+
+// phases of dssend call timed by driver
+#define DSSEND_PACK    0 // message is built and compressed
+#define DSSEND_SIGN    1
+#define DSSEND_WAIT    2 // till the slowest server answered
+#define DSSEND_COMPARE 3 // answers are unpacked and compared
+#define DSSEND_CALL    4 // the whole call
+#define DSSEND_PHASES  5
+
+// phases of single server
+#define DSSEND_CONNECT       0 // new connection, ring registration included
+#define DSSEND_SEND          1 // command is written
+#define DSSEND_ANSWER        2 // the whole answer is read
+#define DSSEND_SERVER_PHASES 3
+
+typedef struct _dssend_latency {
+  long long count;
+  long long p50_us;
+  long long p99_us;
+  long long p999_us;
+  long long max_us;
+
+} DSSEND_LATENCY, *PDSSEND_LATENCY;
+
+typedef struct _dssend_stats {
+  long long calls;
+  long long failures;
+  DSSEND_LATENCY phases[DSSEND_PHASES];
+
+} DSSEND_STATS, *PDSSEND_STATS;
+
+typedef struct _dssend_server_stats {
+  const char *address;  // path of local socket when port is 0
+  int port;
+  long long calls;      // took part in call
+  long long answers;
+  long long failures;   // connection broke or call timed out
+  long long overloaded;
+  long long mismatches; // answer differs from the first one
+  long long bytes_out;
+  long long bytes_in;
+  double latency_us;    // EWMA used for routing reads
+  int down;             // skipped after failure
+  DSSEND_LATENCY phases[DSSEND_SERVER_PHASES];
+
+} DSSEND_SERVER_STATS, *PDSSEND_SERVER_STATS;
+
+// pack_signed is DSSEND_UNSIGNED, DSSEND_SIGNED or DSSEND_SIGNED_TCP
+// *res points into context receive buffer, valid until next call on the context
+// timeout_ms covers the whole call, 0 for default
+// digest asks all servers but the fastest one for digest of their answer only
+// zip_min is size of message compressed for servers taking it, 0 disables
+// priority is DSPRIO_INTERACTIVE, DSPRIO_NORMAL or DSPRIO_BATCH of dspack.h
+void dssend(void *dsctx, int pack_signed, int keepalive, int consistency, int digest, int zip_min, int timeout_ms, int priority, const char *msg, const char **res, int *res_size);
 void dsreset(void *dsctx);
 void* dssend_init_ctx(const char *targets);
 void dssend_release_ctx(void *dsctx);
+void dssend_cleanup(void);
+
+// Counters of the worker process. Servers are walked starting from NULL,
+// the next one is returned till NULL.
+void dssend_stats(PDSSEND_STATS stats);
+void* dssend_server_stats(void *server, PDSSEND_SERVER_STATS stats);
+void dssend_stats_reset(void);
 
 #endif // SEND_H
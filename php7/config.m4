@@ -20,6 +20,7 @@ if test "$PHP_DBSYNC" != "no"; then
   AC_DEFINE(HAVE_DBSYNCLIB,1,[ ])
 
   PHP_ADD_LIBRARY(:libcrypto.so.1.1, 1, DBSYNC_SHARED_LIBADD)
+  PHP_ADD_LIBRARY(z, 1, DBSYNC_SHARED_LIBADD)
   
   rm -f common;ln -sf ../common
   PHP_ADD_INCLUDE(common)
@@ -27,6 +28,6 @@ if test "$PHP_DBSYNC" != "no"; then
   rm -f driver;ln -sf ../driver
   PHP_ADD_INCLUDE(driver)
 
-  PHP_NEW_EXTENSION(dbsync, dbsync.c driver/dssend.c common/dspack.c common/dscrypto.c common/dsmisc.c, $ext_shared,, $DSDEBUG -DZEND_ENABLE_STATIC_TSRMLS_CACHE=1)
+  PHP_NEW_EXTENSION(dbsync, dbsync.c driver/dssend.c common/dspack.c common/dsarena.c common/dshist.c common/dscmd.c common/dscrypto.c common/dszip.c common/dsring.c common/dsmisc.c, $ext_shared,, $DSDEBUG -DZEND_ENABLE_STATIC_TSRMLS_CACHE=1)
   PHP_SUBST(DBSYNC_SHARED_LIBADD)
 fi
@@ -40,6 +40,12 @@ PHP_INI_BEGIN()
   STD_PHP_INI_ENTRY("dbsync.servers", "127.0.0.1:1111", PHP_INI_ALL, OnUpdateString, g_dbsync_servers, zend_dbsync_globals, dbsync_globals)
   STD_PHP_INI_ENTRY("dbsync.signkey", NULL, PHP_INI_ALL, OnUpdateString, g_dbsync_signkey, zend_dbsync_globals, dbsync_globals)
   STD_PHP_INI_ENTRY("dbsync.keepalive", "1", PHP_INI_ALL, OnUpdateLong, g_dbsync_keepalive, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.consistency", "0", PHP_INI_ALL, OnUpdateLong, g_dbsync_consistency, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.timeout", "3000", PHP_INI_ALL, OnUpdateLong, g_dbsync_timeout, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.priority", "0", PHP_INI_ALL, OnUpdateLong, g_dbsync_priority, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.digest", "0", PHP_INI_ALL, OnUpdateLong, g_dbsync_digest, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.compress", "0", PHP_INI_ALL, OnUpdateLong, g_dbsync_compress, zend_dbsync_globals, dbsync_globals)
+  STD_PHP_INI_ENTRY("dbsync.peercred", "0", PHP_INI_ALL, OnUpdateLong, g_dbsync_peercred, zend_dbsync_globals, dbsync_globals)
 PHP_INI_END()
 
 
@@ -47,45 +53,62 @@ PHP_INI_END()
 ZEND_BEGIN_ARG_INFO_EX(arginfo_dbsync_send, 0, 0, 2)
   ZEND_ARG_INFO(0, cmd)
   ZEND_ARG_INFO(0, servers)
+  ZEND_ARG_INFO(0, timeout)
+  ZEND_ARG_INFO(0, priority)
 ZEND_END_ARG_INFO();
 
 PHP_FUNCTION(dbsync_send)
 {
   zend_string *cmd = NULL;
   zend_string *servers = NULL;
+  zend_long timeout = 0;
+  zend_long priority = 0;
+  zend_bool priority_null = 1;
   size_t cmd_len, len;
   zend_string *strg = NULL;
 
-  ZEND_PARSE_PARAMETERS_START(1, 2)
+  ZEND_PARSE_PARAMETERS_START(1, 4)
     Z_PARAM_STR(cmd);
     Z_PARAM_OPTIONAL
-    Z_PARAM_STR(servers);
+    Z_PARAM_STR_EX(servers, 1, 0);
+    Z_PARAM_LONG(timeout);
+    Z_PARAM_LONG_EX(priority, priority_null, 1, 0);
   ZEND_PARSE_PARAMETERS_END();
 
-  char *res = NULL;
+  if(timeout <= 0)
+    timeout = DBSYNC_G(g_dbsync_timeout);
+
+  if(priority_null)
+    priority = DBSYNC_G(g_dbsync_priority);
+
+  const char *res = NULL;
   int res_size = 0;
+  void *ctx = DBSYNC_G(g_dbsync_ctx);
   if(servers)
+    ctx = dssend_init_ctx(ZSTR_VAL(servers));
+
+  if(ctx)
   {
-    void *ctx = dssend_init_ctx(ZSTR_VAL(servers));
-    if(ctx)
+    int pack_signed = DSSEND_UNSIGNED;
+    if(DBSYNC_G(g_dbsync_signkey))
+      pack_signed = DBSYNC_G(g_dbsync_peercred) ? DSSEND_SIGNED_TCP : DSSEND_SIGNED;
+
+    dssend(ctx, pack_signed, DBSYNC_G(g_dbsync_keepalive), DBSYNC_G(g_dbsync_consistency), DBSYNC_G(g_dbsync_digest), DBSYNC_G(g_dbsync_compress), timeout, priority, ZSTR_VAL(cmd), &res, &res_size);
+
+    // result points into driver buffer, the only copy is the returned string
+    if(res)
     {
-      dssend(ctx, DBSYNC_G(g_dbsync_signkey)?1:0, DBSYNC_G(g_dbsync_keepalive), ZSTR_VAL(cmd), &res, &res_size);
-      dssend_release_ctx(ctx);
+      dstrace("Return to script the string of size: %d", res_size);
+
+      strg = zend_string_init(res, strnlen(res, res_size), 0);
     }
-  }
-  else
-  {
-    dssend(DBSYNC_G(g_dbsync_ctx), DBSYNC_G(g_dbsync_signkey)?1:0, DBSYNC_G(g_dbsync_keepalive), ZSTR_VAL(cmd), &res, &res_size);
-  }
 
-  if(res)
-  {
-    dstrace("Return to script the string of size: %d", res_size);
+    if(servers)
+      dssend_release_ctx(ctx);
+  }
 
-    strg = strpprintf(res_size, "%s", res);
-    free(res);
+  if(strg)
     RETURN_STR(strg);
-  }
 }
 
 PHP_FUNCTION(dbsync_reset)
@@ -93,6 +116,79 @@ PHP_FUNCTION(dbsync_reset)
   dsreset(DBSYNC_G(g_dbsync_ctx));
 }
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_dbsync_stats, 0, 0, 0)
+  ZEND_ARG_INFO(0, reset)
+ZEND_END_ARG_INFO();
+
+static void add_latency(zval *arr, const char *name, PDSSEND_LATENCY latency)
+{
+  zval lat;
+
+  array_init(&lat);
+  add_assoc_long(&lat, "count", latency->count);
+  add_assoc_long(&lat, "p50_us", latency->p50_us);
+  add_assoc_long(&lat, "p99_us", latency->p99_us);
+  add_assoc_long(&lat, "p999_us", latency->p999_us);
+  add_assoc_long(&lat, "max_us", latency->max_us);
+  add_assoc_zval(arr, name, &lat);
+}
+
+// Counters of this worker process since its start or the latest reset
+PHP_FUNCTION(dbsync_stats)
+{
+  static const char *phases[] = {"pack", "sign", "wait", "compare", "call"};
+  static const char *server_phases[] = {"connect", "send", "answer"};
+  zend_bool reset = 0;
+  DSSEND_STATS stats;
+  DSSEND_SERVER_STATS server_stats;
+  zval servers;
+  void *server = NULL;
+  int i;
+
+  ZEND_PARSE_PARAMETERS_START(0, 1)
+    Z_PARAM_OPTIONAL
+    Z_PARAM_BOOL(reset);
+  ZEND_PARSE_PARAMETERS_END();
+
+  dssend_stats(&stats);
+
+  array_init(return_value);
+  add_assoc_long(return_value, "calls", stats.calls);
+  add_assoc_long(return_value, "failures", stats.failures);
+  for(i = 0; i < DSSEND_PHASES; i++)
+    add_latency(return_value, phases[i], &stats.phases[i]);
+
+  array_init(&servers);
+  while((server = dssend_server_stats(server, &server_stats)))
+  {
+    char name[512];
+    zval srv;
+
+    if(server_stats.port)
+      snprintf(name, sizeof(name), "%s:%d", server_stats.address, server_stats.port);
+    else
+      snprintf(name, sizeof(name), "unix:%s", server_stats.address);
+
+    array_init(&srv);
+    add_assoc_long(&srv, "calls", server_stats.calls);
+    add_assoc_long(&srv, "answers", server_stats.answers);
+    add_assoc_long(&srv, "failures", server_stats.failures);
+    add_assoc_long(&srv, "overloaded", server_stats.overloaded);
+    add_assoc_long(&srv, "mismatches", server_stats.mismatches);
+    add_assoc_long(&srv, "bytes_out", server_stats.bytes_out);
+    add_assoc_long(&srv, "bytes_in", server_stats.bytes_in);
+    add_assoc_long(&srv, "latency_us", (zend_long)server_stats.latency_us);
+    add_assoc_bool(&srv, "down", server_stats.down);
+    for(i = 0; i < DSSEND_SERVER_PHASES; i++)
+      add_latency(&srv, server_phases[i], &server_stats.phases[i]);
+    add_assoc_zval(&servers, name, &srv);
+  }
+  add_assoc_zval(return_value, "servers", &servers);
+
+  if(reset)
+    dssend_stats_reset();
+}
+
 PHP_MINIT_FUNCTION(dbsync)
 {
   REGISTER_INI_ENTRIES();
@@ -109,6 +205,7 @@ PHP_MSHUTDOWN_FUNCTION(dbsync)
 {
   UNREGISTER_INI_ENTRIES();
 
+  dssend_cleanup();
   dscrypto_keyfree(NULL);
   dscrypto_cleanup();
 
@@ -147,6 +244,7 @@ PHP_GINIT_FUNCTION(dbsync)
 {
   ZEND_SECURE_ZERO(dbsync_globals, sizeof(*dbsync_globals));
   dbsync_globals->g_dbsync_keepalive = 1; // default to keep connection per request
+  dbsync_globals->g_dbsync_timeout = 3000;
 }
 
 PHP_GSHUTDOWN_FUNCTION(dbsync)
@@ -159,6 +257,7 @@ PHP_GSHUTDOWN_FUNCTION(dbsync)
 const zend_function_entry dbsync_functions[] = {
   PHP_FE(dbsync_send, arginfo_dbsync_send)   /* Actual entry point for PHP. */
   PHP_FE(dbsync_reset, NULL)  /* Actual entry point for PHP. */
+  PHP_FE(dbsync_stats, arginfo_dbsync_stats)
   PHP_FE_END  /* Must be the last line in dbsync_functions[] */
 };
 
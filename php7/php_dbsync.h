@@ -23,6 +23,12 @@ char *g_dbsync_servers;
 char *g_dbsync_signkey;
 void *g_dbsync_ctx;
 zend_long g_dbsync_keepalive; // 0 no keepalive, 1 per request, 2 totally
+zend_long g_dbsync_consistency; // DSSEND_ALL, DSSEND_QUORUM or DSSEND_ANY
+zend_long g_dbsync_timeout; // default time for dbsync_send call in milliseconds
+zend_long g_dbsync_priority; // DSPRIO_INTERACTIVE, DSPRIO_NORMAL or DSPRIO_BATCH
+zend_long g_dbsync_digest; // 1 for full answer from single server, digests from others
+zend_long g_dbsync_compress; // messages this long are compressed, 0 disables
+zend_long g_dbsync_peercred; // 1 when daemons on local sockets trust credentials instead of signature
 ZEND_END_MODULE_GLOBALS(dbsync)
 
 /* Always refer to the globals in your function as DBSYNC_G(variable).